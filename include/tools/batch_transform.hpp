@@ -0,0 +1,270 @@
+// Author: Lin Jiarong          ziv.lin.ljr@gmail.com
+
+#ifndef __BATCH_TRANSFORM_HPP__
+#define __BATCH_TRANSFORM_HPP__
+#include <Eigen/Eigen>
+#include <math.h>
+#include <stddef.h>
+#include <vector>
+
+#if defined( __GNUC__ ) && ( defined( __x86_64__ ) || defined( __i386__ ) )
+#define BATCH_TRANSFORM_ENABLE_AVX2 1
+#include <immintrin.h>
+#else
+#define BATCH_TRANSFORM_ENABLE_AVX2 0
+#endif
+
+namespace Common_tools
+{
+    // Points in structure-of-arrays layout.
+    struct Points_soa
+    {
+        std::vector<float> m_x;
+        std::vector<float> m_y;
+        std::vector<float> m_z;
+        std::vector<float> m_s; // interpolation ratio of each point, only used by interpolated transform
+
+        void resize( size_t size )
+        {
+            m_x.resize( size );
+            m_y.resize( size );
+            m_z.resize( size );
+            m_s.resize( size );
+        }
+
+        size_t size() const
+        {
+            return m_x.size();
+        }
+
+        // s is taken from intensity, which holds the relative time stamp of a point in its frame.
+        template < typename T_cloud >
+        void from_cloud( const T_cloud &pc_in )
+        {
+            resize( pc_in.points.size() );
+            for ( size_t i = 0; i < pc_in.points.size(); i++ )
+            {
+                m_x[ i ] = pc_in.points[ i ].x;
+                m_y[ i ] = pc_in.points[ i ].y;
+                m_z[ i ] = pc_in.points[ i ].z;
+                m_s[ i ] = pc_in.points[ i ].intensity;
+            }
+        }
+
+        // Only x, y, z are written, pc_out must have the same size.
+        template < typename T_cloud >
+        void to_cloud( T_cloud &pc_out ) const
+        {
+            for ( size_t i = 0; i < pc_out.points.size(); i++ )
+            {
+                pc_out.points[ i ].x = m_x[ i ];
+                pc_out.points[ i ].y = m_y[ i ];
+                pc_out.points[ i ].z = m_z[ i ];
+            }
+        }
+    };
+
+    // Transform a batch of points, with AVX2 when the cpu supports it and a scalar loop otherwise.
+    //   rigid:        p_out = R * p + t
+    //   interpolated: p_out = R * ( Exp( s * theta * omega ) * p + s * t_incre ) + t, s of every point from Points_soa::m_s
+    // Exp( s * theta * omega ) is computed by Rodrigues formula I + sin( s * theta ) * K + ( 1 - cos( s * theta ) ) * K^2,
+    // K is the skew matrix of the unit rotation axis omega.
+    // The AVX2 code is compiled with function level target attributes and chosen at runtime,
+    // so the rest of the program does not need -mavx2.
+    class Batch_transform
+    {
+      public:
+        float m_rot[ 9 ]; // row major
+        float m_trans[ 3 ];
+        float m_hat[ 9 ];
+        float m_hat_sq[ 9 ];
+        float m_theta = 0;
+        float m_trans_incre[ 3 ];
+        bool  m_if_interpolate = false;
+        bool  m_if_use_simd = true;
+
+        Batch_transform()
+        {
+            set_rigid( Eigen::Matrix3d::Identity(), Eigen::Vector3d::Zero() );
+        }
+
+        void set_rigid( const Eigen::Matrix3d &rot, const Eigen::Vector3d &trans )
+        {
+            copy_mat( rot, m_rot );
+            copy_vec( trans, m_trans );
+            m_if_interpolate = false;
+        }
+
+        void set_interpolated( const Eigen::Matrix3d &rot, const Eigen::Vector3d &trans,
+                               const Eigen::Matrix3d &hat, const Eigen::Matrix3d &hat_sq, double theta, const Eigen::Vector3d &trans_incre )
+        {
+            copy_mat( rot, m_rot );
+            copy_vec( trans, m_trans );
+            copy_mat( hat, m_hat );
+            copy_mat( hat_sq, m_hat_sq );
+            copy_vec( trans_incre, m_trans_incre );
+            m_theta = theta;
+            m_if_interpolate = true;
+        }
+
+        static bool is_avx2_supported()
+        {
+#if BATCH_TRANSFORM_ENABLE_AVX2
+            static const bool if_supported = __builtin_cpu_supports( "avx2" ) && __builtin_cpu_supports( "fma" );
+            return if_supported;
+#else
+            return false;
+#endif
+        }
+
+        void apply( const Points_soa &pts_in, Points_soa &pts_out ) const
+        {
+            int size = pts_in.size();
+            if ( &pts_out != &pts_in )
+            {
+                pts_out.resize( size );
+                pts_out.m_s = pts_in.m_s;
+            }
+            int done_size = 0;
+#if BATCH_TRANSFORM_ENABLE_AVX2
+            if ( m_if_use_simd && is_avx2_supported() )
+            {
+                done_size = m_if_interpolate ? apply_interpolated_avx2( pts_in, pts_out, size ) : apply_rigid_avx2( pts_in, pts_out, size );
+            }
+#endif
+            for ( int i = done_size; i < size; i++ )
+            {
+                float x = pts_in.m_x[ i ], y = pts_in.m_y[ i ], z = pts_in.m_z[ i ];
+                if ( m_if_interpolate )
+                {
+                    float s = pts_in.m_s[ i ];
+                    float sin_v = sinf( s * m_theta );
+                    float one_minus_cos_v = 1.0f - cosf( s * m_theta );
+                    float kx = m_hat[ 0 ] * x + m_hat[ 1 ] * y + m_hat[ 2 ] * z;
+                    float ky = m_hat[ 3 ] * x + m_hat[ 4 ] * y + m_hat[ 5 ] * z;
+                    float kz = m_hat[ 6 ] * x + m_hat[ 7 ] * y + m_hat[ 8 ] * z;
+                    float kkx = m_hat_sq[ 0 ] * x + m_hat_sq[ 1 ] * y + m_hat_sq[ 2 ] * z;
+                    float kky = m_hat_sq[ 3 ] * x + m_hat_sq[ 4 ] * y + m_hat_sq[ 5 ] * z;
+                    float kkz = m_hat_sq[ 6 ] * x + m_hat_sq[ 7 ] * y + m_hat_sq[ 8 ] * z;
+                    x = x + sin_v * kx + one_minus_cos_v * kkx + s * m_trans_incre[ 0 ];
+                    y = y + sin_v * ky + one_minus_cos_v * kky + s * m_trans_incre[ 1 ];
+                    z = z + sin_v * kz + one_minus_cos_v * kkz + s * m_trans_incre[ 2 ];
+                }
+                pts_out.m_x[ i ] = m_rot[ 0 ] * x + m_rot[ 1 ] * y + m_rot[ 2 ] * z + m_trans[ 0 ];
+                pts_out.m_y[ i ] = m_rot[ 3 ] * x + m_rot[ 4 ] * y + m_rot[ 5 ] * z + m_trans[ 1 ];
+                pts_out.m_z[ i ] = m_rot[ 6 ] * x + m_rot[ 7 ] * y + m_rot[ 8 ] * z + m_trans[ 2 ];
+            }
+        }
+
+      private:
+        static void copy_mat( const Eigen::Matrix3d &mat, float *out )
+        {
+            for ( int r = 0; r < 3; r++ )
+                for ( int c = 0; c < 3; c++ )
+                    out[ r * 3 + c ] = mat( r, c );
+        }
+
+        static void copy_vec( const Eigen::Vector3d &vec, float *out )
+        {
+            for ( int r = 0; r < 3; r++ )
+                out[ r ] = vec( r );
+        }
+
+#if BATCH_TRANSFORM_ENABLE_AVX2
+        // out = mat * ( x, y, z ) + trans, for 8 points.
+        __attribute__( ( target( "avx2,fma" ) ) ) static inline void mat_mul_avx2( const float *mat, const float *trans, __m256 x, __m256 y, __m256 z,
+                                                                                   __m256 &out_x, __m256 &out_y, __m256 &out_z )
+        {
+            out_x = _mm256_fmadd_ps( _mm256_set1_ps( mat[ 0 ] ), x, _mm256_fmadd_ps( _mm256_set1_ps( mat[ 1 ] ), y, _mm256_fmadd_ps( _mm256_set1_ps( mat[ 2 ] ), z, _mm256_set1_ps( trans[ 0 ] ) ) ) );
+            out_y = _mm256_fmadd_ps( _mm256_set1_ps( mat[ 3 ] ), x, _mm256_fmadd_ps( _mm256_set1_ps( mat[ 4 ] ), y, _mm256_fmadd_ps( _mm256_set1_ps( mat[ 5 ] ), z, _mm256_set1_ps( trans[ 1 ] ) ) ) );
+            out_z = _mm256_fmadd_ps( _mm256_set1_ps( mat[ 6 ] ), x, _mm256_fmadd_ps( _mm256_set1_ps( mat[ 7 ] ), y, _mm256_fmadd_ps( _mm256_set1_ps( mat[ 8 ] ), z, _mm256_set1_ps( trans[ 2 ] ) ) ) );
+        }
+
+        // sin and cos of 8 floats, the Cephes single precision polynomials with range reduction by pi/4.
+        __attribute__( ( target( "avx2,fma" ) ) ) static inline void sincos_avx2( __m256 x, __m256 &out_sin, __m256 &out_cos )
+        {
+            const __m256 sign_mask = _mm256_set1_ps( -0.0f );
+            __m256       sign_bit_sin = _mm256_and_ps( x, sign_mask );
+            x = _mm256_andnot_ps( sign_mask, x );
+
+            __m256i j = _mm256_cvttps_epi32( _mm256_mul_ps( x, _mm256_set1_ps( 1.27323954473516f ) ) ); // 4 / pi
+            j = _mm256_and_si256( _mm256_add_epi32( j, _mm256_set1_epi32( 1 ) ), _mm256_set1_epi32( ~1 ) );
+            __m256 y = _mm256_cvtepi32_ps( j );
+
+            __m256 swap_sign_bit_sin = _mm256_castsi256_ps( _mm256_slli_epi32( _mm256_and_si256( j, _mm256_set1_epi32( 4 ) ), 29 ) );
+            __m256 poly_mask = _mm256_castsi256_ps( _mm256_cmpeq_epi32( _mm256_and_si256( j, _mm256_set1_epi32( 2 ) ), _mm256_setzero_si256() ) );
+            __m256 sign_bit_cos = _mm256_castsi256_ps( _mm256_slli_epi32( _mm256_andnot_si256( _mm256_sub_epi32( j, _mm256_set1_epi32( 2 ) ), _mm256_set1_epi32( 4 ) ), 29 ) );
+            sign_bit_sin = _mm256_xor_ps( sign_bit_sin, swap_sign_bit_sin );
+
+            // x = ( ( x - y * DP1 ) - y * DP2 ) - y * DP3
+            x = _mm256_fmadd_ps( y, _mm256_set1_ps( -0.78515625f ), x );
+            x = _mm256_fmadd_ps( y, _mm256_set1_ps( -2.4187564849853515625e-4f ), x );
+            x = _mm256_fmadd_ps( y, _mm256_set1_ps( -3.77489497744594108e-8f ), x );
+            __m256 z = _mm256_mul_ps( x, x );
+
+            __m256 poly_cos = _mm256_set1_ps( 2.443315711809948e-005f );
+            poly_cos = _mm256_fmadd_ps( poly_cos, z, _mm256_set1_ps( -1.388731625493765e-003f ) );
+            poly_cos = _mm256_fmadd_ps( poly_cos, z, _mm256_set1_ps( 4.166664568298827e-002f ) );
+            poly_cos = _mm256_mul_ps( _mm256_mul_ps( poly_cos, z ), z );
+            poly_cos = _mm256_fnmadd_ps( _mm256_set1_ps( 0.5f ), z, poly_cos );
+            poly_cos = _mm256_add_ps( poly_cos, _mm256_set1_ps( 1.0f ) );
+
+            __m256 poly_sin = _mm256_set1_ps( -1.9515295891e-4f );
+            poly_sin = _mm256_fmadd_ps( poly_sin, z, _mm256_set1_ps( 8.3321608736e-3f ) );
+            poly_sin = _mm256_fmadd_ps( poly_sin, z, _mm256_set1_ps( -1.6666654611e-1f ) );
+            poly_sin = _mm256_fmadd_ps( _mm256_mul_ps( poly_sin, z ), x, x );
+
+            out_sin = _mm256_xor_ps( _mm256_blendv_ps( poly_cos, poly_sin, poly_mask ), sign_bit_sin );
+            out_cos = _mm256_xor_ps( _mm256_blendv_ps( poly_sin, poly_cos, poly_mask ), sign_bit_cos );
+        }
+
+        __attribute__( ( target( "avx2,fma" ) ) ) int apply_rigid_avx2( const Points_soa &pts_in, Points_soa &pts_out, int size ) const
+        {
+            int i = 0;
+            for ( ; i + 8 <= size; i += 8 )
+            {
+                __m256 x = _mm256_loadu_ps( &pts_in.m_x[ i ] );
+                __m256 y = _mm256_loadu_ps( &pts_in.m_y[ i ] );
+                __m256 z = _mm256_loadu_ps( &pts_in.m_z[ i ] );
+                __m256 out_x, out_y, out_z;
+                mat_mul_avx2( m_rot, m_trans, x, y, z, out_x, out_y, out_z );
+                _mm256_storeu_ps( &pts_out.m_x[ i ], out_x );
+                _mm256_storeu_ps( &pts_out.m_y[ i ], out_y );
+                _mm256_storeu_ps( &pts_out.m_z[ i ], out_z );
+            }
+            return i;
+        }
+
+        __attribute__( ( target( "avx2,fma" ) ) ) int apply_interpolated_avx2( const Points_soa &pts_in, Points_soa &pts_out, int size ) const
+        {
+            const float zero[ 3 ] = { 0, 0, 0 };
+            int         i = 0;
+            for ( ; i + 8 <= size; i += 8 )
+            {
+                __m256 x = _mm256_loadu_ps( &pts_in.m_x[ i ] );
+                __m256 y = _mm256_loadu_ps( &pts_in.m_y[ i ] );
+                __m256 z = _mm256_loadu_ps( &pts_in.m_z[ i ] );
+                __m256 s = _mm256_loadu_ps( &pts_in.m_s[ i ] );
+                __m256 sin_v, cos_v;
+                sincos_avx2( _mm256_mul_ps( s, _mm256_set1_ps( m_theta ) ), sin_v, cos_v );
+                __m256 one_minus_cos_v = _mm256_sub_ps( _mm256_set1_ps( 1.0f ), cos_v );
+
+                __m256 kx, ky, kz, kkx, kky, kkz;
+                mat_mul_avx2( m_hat, zero, x, y, z, kx, ky, kz );
+                mat_mul_avx2( m_hat_sq, zero, x, y, z, kkx, kky, kkz );
+                x = _mm256_fmadd_ps( sin_v, kx, _mm256_fmadd_ps( one_minus_cos_v, kkx, _mm256_fmadd_ps( s, _mm256_set1_ps( m_trans_incre[ 0 ] ), x ) ) );
+                y = _mm256_fmadd_ps( sin_v, ky, _mm256_fmadd_ps( one_minus_cos_v, kky, _mm256_fmadd_ps( s, _mm256_set1_ps( m_trans_incre[ 1 ] ), y ) ) );
+                z = _mm256_fmadd_ps( sin_v, kz, _mm256_fmadd_ps( one_minus_cos_v, kkz, _mm256_fmadd_ps( s, _mm256_set1_ps( m_trans_incre[ 2 ] ), z ) ) );
+
+                __m256 out_x, out_y, out_z;
+                mat_mul_avx2( m_rot, m_trans, x, y, z, out_x, out_y, out_z );
+                _mm256_storeu_ps( &pts_out.m_x[ i ], out_x );
+                _mm256_storeu_ps( &pts_out.m_y[ i ], out_y );
+                _mm256_storeu_ps( &pts_out.m_z[ i ], out_z );
+            }
+            return i;
+        }
+#endif
+    };
+};
+#endif
@@ -0,0 +1,148 @@
+// Author: Lin Jiarong          ziv.lin.ljr@gmail.com
+
+#ifndef __BLOCKING_QUEUE_HPP__
+#define __BLOCKING_QUEUE_HPP__
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+namespace Common_tools
+{
+    // Bounded FIFO between producer threads ( e.g. ROS callbacks ) and one consumer thread.
+    // pop() sleeps on a condition variable until an item arrives, so an idle consumer uses no CPU.
+    // When the queue is full, push() drops the oldest item, so that the consumer always gets the newest data,
+    // and push_wait() blocks the producer until there is room, for stages that must not lose data.
+    // Items of push_wait() are never dropped by push(): if the queue only holds such items, push() drops its own item.
+    template < typename T >
+    class Blocking_queue
+    {
+    public:
+        std::deque< T >         m_queue;
+        std::deque< char >      m_if_droppable; // of every item in m_queue
+        size_t                  m_capacity;
+        size_t                  m_drop_num = 0; // items dropped since last pop()
+        bool                    m_if_stop = false;
+        mutable std::mutex      m_mutex;
+        std::condition_variable m_cv;
+        std::condition_variable m_cv_not_full;
+
+        Blocking_queue ( size_t capacity = 1000 ) : m_capacity ( capacity ){};
+        ~Blocking_queue(){};
+
+        Blocking_queue ( const Blocking_queue & ) = delete;
+        Blocking_queue &operator= ( const Blocking_queue & ) = delete;
+
+        void set_capacity ( size_t capacity )
+        {
+            std::unique_lock< std::mutex > lock ( m_mutex );
+            m_capacity = std::max< size_t > ( capacity, 1 );
+        }
+
+        // Return false if an item, possibly this one, was dropped to make room.
+        bool push ( const T &item )
+        {
+            bool if_no_drop = true;
+            {
+                std::unique_lock< std::mutex > lock ( m_mutex );
+                while ( m_queue.size() >= m_capacity )
+                {
+                    if_no_drop = false;
+                    m_drop_num++;
+                    size_t idx = std::find ( m_if_droppable.begin(), m_if_droppable.end(), 1 ) - m_if_droppable.begin();
+                    if ( idx == m_queue.size() )
+                    {
+                        return false;
+                    }
+                    m_queue.erase ( m_queue.begin() + idx );
+                    m_if_droppable.erase ( m_if_droppable.begin() + idx );
+                }
+                m_queue.push_back ( item );
+                m_if_droppable.push_back ( 1 );
+            }
+            m_cv.notify_one();
+            return if_no_drop;
+        }
+
+        // Block until there is room, return false if the queue is stopped.
+        bool push_wait ( const T &item )
+        {
+            {
+                std::unique_lock< std::mutex > lock ( m_mutex );
+                m_cv_not_full.wait ( lock, [ this ] { return m_queue.size() < m_capacity || m_if_stop; } );
+                if ( m_if_stop )
+                {
+                    return false;
+                }
+                m_queue.push_back ( item );
+                m_if_droppable.push_back ( 0 );
+            }
+            m_cv.notify_one();
+            return true;
+        }
+
+        // Block until an item is available, return false if the queue is stopped.
+        // drop_num ( if not nullptr ) is the number of items dropped by push() since last pop().
+        bool pop ( T &item, size_t *drop_num = nullptr )
+        {
+            std::unique_lock< std::mutex > lock ( m_mutex );
+            m_cv.wait ( lock, [ this ] { return !m_queue.empty() || m_if_stop; } );
+            if ( m_queue.empty() )
+            {
+                return false;
+            }
+            item = m_queue.front();
+            m_queue.pop_front();
+            m_if_droppable.pop_front();
+            if ( drop_num != nullptr )
+            {
+                *drop_num = m_drop_num;
+            }
+            m_drop_num = 0;
+            lock.unlock();
+            m_cv_not_full.notify_one();
+            return true;
+        }
+
+        // Return false at once if the queue is empty.
+        bool try_pop ( T &item )
+        {
+            {
+                std::unique_lock< std::mutex > lock ( m_mutex );
+                if ( m_queue.empty() )
+                {
+                    return false;
+                }
+                item = m_queue.front();
+                m_queue.pop_front();
+                m_if_droppable.pop_front();
+            }
+            m_cv_not_full.notify_one();
+            return true;
+        }
+
+        // Wake up all waiting pop(), which return false once the queue is empty, and all waiting push_wait().
+        void stop()
+        {
+            {
+                std::unique_lock< std::mutex > lock ( m_mutex );
+                m_if_stop = true;
+            }
+            m_cv.notify_all();
+            m_cv_not_full.notify_all();
+        }
+
+        size_t size() const
+        {
+            std::unique_lock< std::mutex > lock ( m_mutex );
+            return m_queue.size();
+        }
+
+        bool empty() const
+        {
+            return size() == 0;
+        }
+    };
+} // namespace Common_tools
+
+#endif
@@ -0,0 +1,161 @@
+// Author: Lin Jiarong          ziv.lin.ljr@gmail.com
+
+#ifndef __MESSAGE_SYNCHRONIZER_HPP__
+#define __MESSAGE_SYNCHRONIZER_HPP__
+#include <algorithm>
+#include <math.h>
+#include <vector>
+
+namespace Common_tools
+{
+    // Group messages of N channels by time stamp, e.g. the corner, surface and full clouds of one lidar frame.
+    // Incomplete groups are kept in a fixed number of slots, no memory is allocated after construction.
+    // A slot is evicted when:
+    //   1. a newer group is completed: every channel is delivered in order, so the older group never completes;
+    //   2. it is older than the newest message by more than m_max_delay;
+    //   3. all slots are in use, the oldest one is evicted to make room.
+    // A message older than the newest one by more than m_max_delay means the clock jumped backwards ( rosbag loop,
+    // sim time restart, driver clock reset ): all slots are flushed and the newest time restarts from it.
+    // Not thread safe, guard it with the lock of the callbacks.
+    template < typename T_msg, int N >
+    class Message_synchronizer
+    {
+    public:
+        struct Slot
+        {
+            double       m_time = 0;
+            T_msg        m_msgs[ N ];
+            unsigned int m_mask = 0; // bit i is set if channel i is received
+            bool         m_in_use = false;
+        };
+
+        double m_time_tolerance = 1e-3; // stamps closer than this belong to the same group
+        double m_max_delay = 1.0;       // in second
+
+        // Counters since construction
+        size_t m_complete_num = 0;
+        size_t m_evict_num = 0;     // incomplete groups dropped
+        size_t m_duplicate_num = 0; // message replaced a received one of the same channel and group
+        size_t m_time_jump_num = 0; // clock jumped backwards
+
+        Message_synchronizer ( size_t slot_num = 10 ) : m_slots ( std::max< size_t > ( slot_num, 1 ) ){};
+        ~Message_synchronizer(){};
+
+        void set_slot_num ( size_t slot_num )
+        {
+            m_slots.assign ( std::max< size_t > ( slot_num, 1 ), Slot() );
+        }
+
+        // Return true if the group of this message is completed, its messages are then moved to msgs_out.
+        bool add ( int channel, double time, const T_msg &msg, T_msg *msgs_out )
+        {
+            if ( time < m_newest_time - m_max_delay )
+            {
+                m_time_jump_num++;
+                evict_if ( []( const Slot & ) { return true; } );
+                m_newest_time = time;
+            }
+            m_newest_time = std::max ( m_newest_time, time );
+            evict_if ( [ this ]( const Slot &slot ) { return slot.m_time < m_newest_time - m_max_delay; } );
+
+            Slot *slot = find_slot ( time );
+            if ( slot == nullptr )
+            {
+                slot = get_free_slot();
+                slot->m_in_use = true;
+                slot->m_time = time;
+                slot->m_mask = 0;
+            }
+            if ( slot->m_mask & ( 1u << channel ) )
+            {
+                m_duplicate_num++;
+            }
+            slot->m_msgs[ channel ] = msg;
+            slot->m_mask |= ( 1u << channel );
+
+            if ( slot->m_mask != ( 1u << N ) - 1 )
+            {
+                return false;
+            }
+            for ( int i = 0; i < N; i++ )
+            {
+                msgs_out[ i ] = slot->m_msgs[ i ];
+            }
+            double complete_time = slot->m_time;
+            release ( *slot );
+            m_complete_num++;
+            evict_if ( [ complete_time ]( const Slot &slot ) { return slot.m_time < complete_time; } );
+            return true;
+        }
+
+        int get_pending_num() const
+        {
+            int num = 0;
+            for ( size_t i = 0; i < m_slots.size(); i++ )
+            {
+                num += m_slots[ i ].m_in_use;
+            }
+            return num;
+        }
+
+    private:
+        std::vector< Slot > m_slots;
+        double              m_newest_time = -1e30;
+
+        void release ( Slot &slot )
+        {
+            slot.m_in_use = false;
+            slot.m_mask = 0;
+            for ( int i = 0; i < N; i++ )
+            {
+                slot.m_msgs[ i ] = T_msg(); // free the message
+            }
+        }
+
+        template < typename T_cond >
+        void evict_if ( const T_cond &cond )
+        {
+            for ( size_t i = 0; i < m_slots.size(); i++ )
+            {
+                if ( m_slots[ i ].m_in_use && cond ( m_slots[ i ] ) )
+                {
+                    release ( m_slots[ i ] );
+                    m_evict_num++;
+                }
+            }
+        }
+
+        Slot *find_slot ( double time )
+        {
+            for ( size_t i = 0; i < m_slots.size(); i++ )
+            {
+                if ( m_slots[ i ].m_in_use && fabs ( m_slots[ i ].m_time - time ) <= m_time_tolerance )
+                {
+                    return &m_slots[ i ];
+                }
+            }
+            return nullptr;
+        }
+
+        Slot *get_free_slot()
+        {
+            Slot *oldest = &m_slots[ 0 ];
+            for ( size_t i = 0; i < m_slots.size(); i++ )
+            {
+                if ( !m_slots[ i ].m_in_use )
+                {
+                    return &m_slots[ i ];
+                }
+                if ( m_slots[ i ].m_time < oldest->m_time )
+                {
+                    oldest = &m_slots[ i ];
+                }
+            }
+            release ( *oldest );
+            m_evict_num++;
+            return oldest;
+        }
+    };
+} // namespace Common_tools
+
+#endif
@@ -0,0 +1,160 @@
+// Author: Lin Jiarong          ziv.lin.ljr@gmail.com
+
+#ifndef __POINT_CLOUD2_VIEW_HPP__
+#define __POINT_CLOUD2_VIEW_HPP__
+#include <algorithm>
+#include <stdint.h>
+#include <string.h>
+
+#include <pcl/point_cloud.h>
+#include <sensor_msgs/PointCloud2.h>
+
+namespace Common_tools
+{
+    // Read only access to the points of a sensor_msgs::PointCloud2, straight from its data buffer, replacing pcl::fromROSMsg.
+    // The offsets of x, y, z, intensity and time ( if present ) are looked up once when the view is created.
+    // The common packed layout, x y z intensity as float32 at offset 0, 4, 8, 12 ( e.g. livox driver ), is read with one memcpy per point.
+    // The message must outlive the view. Big endian messages are not supported, as in the rest of this package.
+    class Point_cloud2_view
+    {
+    public:
+        enum Field
+        {
+            e_x = 0,
+            e_y = 1,
+            e_z = 2,
+            e_intensity = 3,
+            e_time = 4,
+            e_field_num = 5,
+        };
+
+        Point_cloud2_view ( const sensor_msgs::PointCloud2 &msg ) : m_data ( msg.data.data() ), m_point_step ( msg.point_step )
+        {
+            static const char *field_names[ e_field_num ] = { "x", "y", "z", "intensity", "time" };
+            for ( int i = 0; i < e_field_num; i++ )
+            {
+                m_offsets[ i ] = -1;
+                m_datatypes[ i ] = 0;
+            }
+            for ( size_t i = 0; i < msg.fields.size(); i++ )
+            {
+                for ( int j = 0; j < e_field_num; j++ )
+                {
+                    if ( msg.fields[ i ].name == field_names[ j ] || ( j == e_time && ( msg.fields[ i ].name == "t" || msg.fields[ i ].name == "timestamp" ) ) )
+                    {
+                        m_offsets[ j ] = msg.fields[ i ].offset;
+                        m_datatypes[ j ] = msg.fields[ i ].datatype;
+                    }
+                }
+            }
+            // Only complete rows are read
+            m_size = m_point_step ? std::min< size_t > ( ( size_t ) msg.width * msg.height, msg.data.size() / m_point_step ) : 0;
+            m_if_packed_xyzi = m_point_step >= 16;
+            for ( int i = e_x; i <= e_intensity; i++ )
+            {
+                m_if_packed_xyzi = m_if_packed_xyzi && m_offsets[ i ] == 4 * i && m_datatypes[ i ] == sensor_msgs::PointField::FLOAT32;
+            }
+        };
+        ~Point_cloud2_view(){};
+
+        size_t size() const
+        {
+            return m_size;
+        }
+
+        bool has_field ( int field ) const
+        {
+            return m_offsets[ field ] >= 0;
+        }
+
+        bool is_packed_xyzi() const
+        {
+            return m_if_packed_xyzi;
+        }
+
+        // 0 if the field is absent.
+        double get ( size_t idx, int field ) const
+        {
+            if ( m_offsets[ field ] < 0 )
+            {
+                return 0;
+            }
+            const uint8_t *ptr = m_data + idx * m_point_step + m_offsets[ field ];
+            switch ( m_datatypes[ field ] )
+            {
+            case sensor_msgs::PointField::INT8:    return read< int8_t > ( ptr );
+            case sensor_msgs::PointField::UINT8:   return read< uint8_t > ( ptr );
+            case sensor_msgs::PointField::INT16:   return read< int16_t > ( ptr );
+            case sensor_msgs::PointField::UINT16:  return read< uint16_t > ( ptr );
+            case sensor_msgs::PointField::INT32:   return read< int32_t > ( ptr );
+            case sensor_msgs::PointField::UINT32:  return read< uint32_t > ( ptr );
+            case sensor_msgs::PointField::FLOAT32: return read< float > ( ptr );
+            case sensor_msgs::PointField::FLOAT64: return read< double > ( ptr );
+            default:                               return 0;
+            }
+        }
+
+        // x, y, z and intensity of a point type like pcl::PointXYZI.
+        template < typename T_point >
+        void get_point ( size_t idx, T_point &pt ) const
+        {
+            if ( m_if_packed_xyzi )
+            {
+                float xyzi[ 4 ];
+                memcpy ( xyzi, m_data + idx * m_point_step, sizeof ( xyzi ) );
+                pt.x = xyzi[ 0 ];
+                pt.y = xyzi[ 1 ];
+                pt.z = xyzi[ 2 ];
+                pt.intensity = xyzi[ 3 ];
+            }
+            else
+            {
+                pt.x = get_float ( idx, e_x );
+                pt.y = get_float ( idx, e_y );
+                pt.z = get_float ( idx, e_z );
+                pt.intensity = get_float ( idx, e_intensity );
+            }
+        }
+
+        // Fill cloud, its memory is reused. Organized clouds are flattened, as the nodes of this package only use unorganized ones.
+        template < typename T_point >
+        void copy_to ( pcl::PointCloud< T_point > &cloud ) const
+        {
+            cloud.points.resize ( m_size );
+            for ( size_t i = 0; i < m_size; i++ )
+            {
+                get_point ( i, cloud.points[ i ] );
+            }
+            cloud.width = m_size;
+            cloud.height = 1;
+            cloud.is_dense = false;
+        }
+
+    private:
+        const uint8_t *m_data;
+        size_t         m_point_step;
+        size_t         m_size;
+        int            m_offsets[ e_field_num ];
+        uint8_t        m_datatypes[ e_field_num ];
+        bool           m_if_packed_xyzi;
+
+        template < typename T >
+        static T read ( const uint8_t *ptr )
+        {
+            T val;
+            memcpy ( &val, ptr, sizeof ( T ) ); // data may be unaligned
+            return val;
+        }
+
+        float get_float ( size_t idx, int field ) const
+        {
+            if ( m_datatypes[ field ] == sensor_msgs::PointField::FLOAT32 )
+            {
+                return read< float > ( m_data + idx * m_point_step + m_offsets[ field ] );
+            }
+            return get ( idx, field );
+        }
+    };
+} // namespace Common_tools
+
+#endif
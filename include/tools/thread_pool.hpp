@@ -0,0 +1,133 @@
+// Author: Lin Jiarong          ziv.lin.ljr@gmail.com
+
+#ifndef __THREAD_POOL_HPP__
+#define __THREAD_POOL_HPP__
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+namespace Common_tools
+{
+    // Fixed size pool of worker threads, the caller thread also works as one of them.
+    class Thread_pool
+    {
+    public:
+        std::vector< std::thread >          m_workers;
+        std::queue< std::function<void()> > m_tasks;
+        std::mutex                          m_mutex;
+        std::condition_variable             m_cv_task;
+        std::condition_variable             m_cv_done;
+        int                                 m_pending_task_num = 0;
+        bool                                m_if_stop = false;
+
+        Thread_pool ( int thread_num = 1 )
+        {
+            init ( thread_num );
+        }
+
+        ~Thread_pool()
+        {
+            release();
+        }
+
+        Thread_pool ( const Thread_pool & ) = delete;
+        Thread_pool &operator= ( const Thread_pool & ) = delete;
+
+        void init ( int thread_num )
+        {
+            release();
+            m_if_stop = false;
+            for ( int i = 1; i < thread_num; i++ )
+            {
+                m_workers.emplace_back ( &Thread_pool::worker_loop, this );
+            }
+        }
+
+        void release()
+        {
+            {
+                std::unique_lock< std::mutex > lock ( m_mutex );
+                m_if_stop = true;
+            }
+            m_cv_task.notify_all();
+            for ( size_t i = 0; i < m_workers.size(); i++ )
+            {
+                m_workers[ i ].join();
+            }
+            m_workers.clear();
+        }
+
+        int get_thread_num() const
+        {
+            return m_workers.size() + 1;
+        }
+
+        // Split [0, task_num) into get_thread_num() contiguous blocks, call func( begin, end, block_idx )
+        // for every block and return after all blocks are finished.
+        // Block boundaries only depend on task_num and the thread number, so per-block outputs
+        // merged in block order are identical to a serial run.
+        template < typename T_func >
+        void parallel_for ( int task_num, const T_func &func )
+        {
+            int block_num = get_thread_num();
+            int block_size = ( task_num + block_num - 1 ) / block_num;
+            if ( block_num == 1 || task_num <= 1 )
+            {
+                for ( int block_idx = 0; block_idx < block_num; block_idx++ )
+                {
+                    func ( std::min ( block_idx * block_size, task_num ), std::min ( ( block_idx + 1 ) * block_size, task_num ), block_idx );
+                }
+                return;
+            }
+
+            {
+                std::unique_lock< std::mutex > lock ( m_mutex );
+                for ( int block_idx = 1; block_idx < block_num; block_idx++ )
+                {
+                    int begin = std::min ( block_idx * block_size, task_num );
+                    int end = std::min ( ( block_idx + 1 ) * block_size, task_num );
+                    m_tasks.push ( [&func, begin, end, block_idx]() { func ( begin, end, block_idx ); } );
+                    m_pending_task_num++;
+                }
+            }
+            m_cv_task.notify_all();
+
+            func ( 0, std::min ( block_size, task_num ), 0 );
+
+            std::unique_lock< std::mutex > lock ( m_mutex );
+            m_cv_done.wait ( lock, [this]() { return m_pending_task_num == 0; } );
+        }
+
+    private:
+        void worker_loop()
+        {
+            while ( 1 )
+            {
+                std::function<void()> task;
+                {
+                    std::unique_lock< std::mutex > lock ( m_mutex );
+                    m_cv_task.wait ( lock, [this]() { return m_if_stop || !m_tasks.empty(); } );
+                    if ( m_if_stop && m_tasks.empty() )
+                    {
+                        return;
+                    }
+                    task = std::move ( m_tasks.front() );
+                    m_tasks.pop();
+                }
+
+                task();
+
+                {
+                    std::unique_lock< std::mutex > lock ( m_mutex );
+                    m_pending_task_num--;
+                }
+                m_cv_done.notify_all();
+            }
+        }
+    };
+};
+#endif
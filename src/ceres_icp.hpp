@@ -4,13 +4,16 @@
 #define __ceres_icp_hpp__
 #define MAX_LOG_LEVEL -100
 #include "eigen_math.hpp"
+#include "icp_correspondence.hpp"
 #include <Eigen/Eigen>
+#include <algorithm>
 #include <ceres/ceres.h>
 #include <cmath>
 #include <fstream>
 #include <iostream>
 #include <map>
 #include <math.h>
+#include <memory>
 #include <stdio.h>
 #include <vector>
 // Point to Point ICP
@@ -243,4 +246,277 @@ struct ceres_icp_point2plane
     }
 };
 
+// Analytic jacobian version of point-to-line and point-to-plane, both residuals have the form
+//   residual = P * ( q_last * ( slerp( I, q_incre, s ) * pt + s * t_incre ) + t_last - a )
+// with a constant 3x3 projection P, so only the derivative of the slerp rotation is needed.
+// The slerp and the quaternion-vector product follow Eigen step by step, the jacobian is the same as the autodiff one.
+// Plain evaluator without ceres bookkeeping, jacobian_q is 3x4 and jacobian_t is 3x3, both row major, can be nullptr.
+struct ceres_icp_analytic_residual
+{
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    Eigen::Matrix<double, 3, 1> m_current_pt;
+    double                      m_motion_blur_s;
+    Eigen::Matrix<double, 3, 3> m_residual_mat;    // P * R_last
+    Eigen::Matrix<double, 3, 1> m_residual_offset; // P * ( t_last - a )
+
+    ceres_icp_analytic_residual() : m_current_pt( Eigen::Matrix<double, 3, 1>::Zero() ),
+                                    m_motion_blur_s( 1.0 ),
+                                    m_residual_mat( Eigen::Matrix<double, 3, 3>::Zero() ),
+                                    m_residual_offset( Eigen::Matrix<double, 3, 1>::Zero() ){};
+
+    ceres_icp_analytic_residual( const Eigen::Matrix<double, 3, 1> &current_pt,
+                                 const Eigen::Matrix<double, 3, 1> &target_pt_a,
+                                 const Eigen::Matrix<double, 3, 3> &projection,
+                                 const double                       motion_blur_s,
+                                 const Eigen::Matrix<double, 4, 1> &q_last,
+                                 const Eigen::Matrix<double, 3, 1> &t_last ) : m_current_pt( current_pt ),
+                                                                               m_motion_blur_s( motion_blur_s )
+    {
+        Eigen::Quaterniond q_last_{ q_last( 0 ), q_last( 1 ), q_last( 2 ), q_last( 3 ) };
+        m_residual_mat = projection * q_last_.toRotationMatrix();
+        m_residual_offset = projection * ( t_last - target_pt_a );
+    };
+
+    bool evaluate( const double *_q, const double *_t, double *residuals, double *jacobian_q_ptr, double *jacobian_t_ptr ) const
+    {
+        const double  s = m_motion_blur_s;
+        const double  w = _q[ 3 ];
+        Eigen::Matrix<double, 3, 1> u{ _q[ 0 ], _q[ 1 ], _q[ 2 ] };
+        Eigen::Matrix<double, 3, 1> t_incre{ _t[ 0 ], _t[ 1 ], _t[ 2 ] };
+
+        // slerp( I, q_incre ) = scale0 * I + scale1 * q_incre, d_scale0/d_scale1 are the derivatives w.r.t. w.
+        double abs_w = fabs( w );
+        double scale0, scale1;
+        double d_scale0 = 0, d_scale1 = 0;
+        if ( abs_w >= 1.0 - Eigen::NumTraits<double>::epsilon() )
+        {
+            scale0 = 1.0 - s;
+            scale1 = s;
+        }
+        else
+        {
+            double theta = acos( abs_w );
+            double sin_theta = sin( theta );
+            double d_theta = ( w < 0 ? 1.0 : -1.0 ) / sin_theta;
+            scale0 = sin( ( 1.0 - s ) * theta ) / sin_theta;
+            scale1 = sin( s * theta ) / sin_theta;
+            d_scale0 = ( ( 1.0 - s ) * cos( ( 1.0 - s ) * theta ) * sin_theta - sin( ( 1.0 - s ) * theta ) * abs_w ) / ( sin_theta * sin_theta ) * d_theta;
+            d_scale1 = ( s * cos( s * theta ) * sin_theta - sin( s * theta ) * abs_w ) / ( sin_theta * sin_theta ) * d_theta;
+        }
+        if ( w < 0 )
+        {
+            scale1 = -scale1;
+            d_scale1 = -d_scale1;
+        }
+        double                      w_s = scale0 + scale1 * w;
+        Eigen::Matrix<double, 3, 1> u_s = scale1 * u;
+
+        // q_s * pt = pt + w_s * uv + u_s x uv, uv = 2 * u_s x pt
+        const Eigen::Matrix<double, 3, 1> &pt = m_current_pt;
+        Eigen::Matrix<double, 3, 1>        uv = 2.0 * u_s.cross( pt );
+        Eigen::Matrix<double, 3, 1>        pt_rotated = pt + w_s * uv + u_s.cross( uv );
+
+        Eigen::Map<Eigen::Matrix<double, 3, 1>> residual_vec( residuals );
+        residual_vec = m_residual_mat * ( pt_rotated + s * t_incre ) + m_residual_offset;
+
+        if ( jacobian_q_ptr != nullptr )
+        {
+            // d( q_s * pt ) / d( u_s ) and d( q_s * pt ) / d( w_s )
+            Eigen::Matrix<double, 3, 3> pt_hat;
+            pt_hat << 0, -pt( 2 ), pt( 1 ),
+                pt( 2 ), 0, -pt( 0 ),
+                -pt( 1 ), pt( 0 ), 0;
+            Eigen::Matrix<double, 3, 3> jacobian_u_s = -2.0 * w_s * pt_hat +
+                                                       2.0 * ( u_s.dot( pt ) * Eigen::Matrix<double, 3, 3>::Identity() + u_s * pt.transpose() - 2.0 * pt * u_s.transpose() );
+            const Eigen::Matrix<double, 3, 1> &jacobian_w_s = uv;
+
+            Eigen::Map<Eigen::Matrix<double, 3, 4, Eigen::RowMajor>> jacobian_q( jacobian_q_ptr );
+            jacobian_q.block<3, 3>( 0, 0 ) = m_residual_mat * jacobian_u_s * scale1;
+            jacobian_q.col( 3 ) = m_residual_mat * ( jacobian_u_s * u * d_scale1 + jacobian_w_s * ( d_scale0 + d_scale1 * w + scale1 ) );
+        }
+
+        if ( jacobian_t_ptr != nullptr )
+        {
+            Eigen::Map<Eigen::Matrix<double, 3, 3, Eigen::RowMajor>> jacobian_t( jacobian_t_ptr );
+            jacobian_t = m_residual_mat * s;
+        }
+        return true;
+    }
+};
+
+class ceres_icp_analytic_base : public ceres::SizedCostFunction<3, 4, 3>
+{
+  public:
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    ceres_icp_analytic_residual m_residual;
+
+    ceres_icp_analytic_base( const Eigen::Matrix<double, 3, 1> &current_pt,
+                             const Eigen::Matrix<double, 3, 1> &target_pt_a,
+                             const Eigen::Matrix<double, 3, 3> &projection,
+                             const double                       motion_blur_s,
+                             const Eigen::Matrix<double, 4, 1> &q_last,
+                             const Eigen::Matrix<double, 3, 1> &t_last ) : m_residual( current_pt, target_pt_a, projection, motion_blur_s, q_last, t_last ){};
+
+    virtual ~ceres_icp_analytic_base(){};
+
+    virtual bool Evaluate( double const *const *parameters, double *residuals, double **jacobians ) const
+    {
+        return m_residual.evaluate( parameters[ 0 ], parameters[ 1 ], residuals,
+                                    jacobians == nullptr ? nullptr : jacobians[ 0 ],
+                                    jacobians == nullptr ? nullptr : jacobians[ 1 ] );
+    }
+};
+
+struct ceres_icp_point2line_analytic : public ceres_icp_analytic_base
+{
+    ceres_icp_point2line_analytic( const Eigen::Matrix<double, 3, 1> &current_pt,
+                                   const Eigen::Matrix<double, 3, 1> &target_line_a,
+                                   const Eigen::Matrix<double, 3, 1> &target_line_b,
+                                   const double                       motion_blur_s = 1.0,
+                                   Eigen::Matrix<double, 4, 1>        q_last = Eigen::Matrix<double, 4, 1>( 1, 0, 0, 0 ),
+                                   Eigen::Matrix<double, 3, 1>        t_last = Eigen::Matrix<double, 3, 1>( 0, 0, 0 ) )
+        : ceres_icp_analytic_base( current_pt, target_line_a, projection( target_line_a, target_line_b ), motion_blur_s, q_last, t_last ){};
+
+    // I - ab * ab^T, remove the component along the line.
+    static Eigen::Matrix<double, 3, 3> projection( const Eigen::Matrix<double, 3, 1> &target_line_a,
+                                                   const Eigen::Matrix<double, 3, 1> &target_line_b )
+    {
+        Eigen::Matrix<double, 3, 1> unit_vec_ab = target_line_b - target_line_a;
+        unit_vec_ab = unit_vec_ab / unit_vec_ab.norm();
+        return Eigen::Matrix<double, 3, 3>::Identity() - unit_vec_ab * unit_vec_ab.transpose();
+    }
+
+    static ceres::CostFunction *Create( const Eigen::Matrix<double, 3, 1> &current_pt,
+                                        const Eigen::Matrix<double, 3, 1> &target_line_a,
+                                        const Eigen::Matrix<double, 3, 1> &target_line_b,
+                                        const double                       motion_blur_s = 1.0,
+                                        Eigen::Matrix<double, 4, 1>        q_last = Eigen::Matrix<double, 4, 1>( 1, 0, 0, 0 ),
+                                        Eigen::Matrix<double, 3, 1>        t_last = Eigen::Matrix<double, 3, 1>( 0, 0, 0 ) )
+    {
+        return new ceres_icp_point2line_analytic( current_pt, target_line_a, target_line_b, motion_blur_s, q_last, t_last );
+    }
+};
+
+struct ceres_icp_point2plane_analytic : public ceres_icp_analytic_base
+{
+    ceres_icp_point2plane_analytic( const Eigen::Matrix<double, 3, 1> &current_pt,
+                                    const Eigen::Matrix<double, 3, 1> &target_line_a,
+                                    const Eigen::Matrix<double, 3, 1> &target_line_b,
+                                    const Eigen::Matrix<double, 3, 1> &target_line_c,
+                                    const double                       motion_blur_s = 1.0,
+                                    Eigen::Matrix<double, 4, 1>        q_last = Eigen::Matrix<double, 4, 1>( 1, 0, 0, 0 ),
+                                    Eigen::Matrix<double, 3, 1>        t_last = Eigen::Matrix<double, 3, 1>( 0, 0, 0 ) )
+        : ceres_icp_analytic_base( current_pt, target_line_a, projection( target_line_a, target_line_b, target_line_c ), motion_blur_s, q_last, t_last ){};
+
+    // n * n^T, n is not normalized, the same as ceres_icp_point2plane.
+    static Eigen::Matrix<double, 3, 3> projection( const Eigen::Matrix<double, 3, 1> &target_line_a,
+                                                   const Eigen::Matrix<double, 3, 1> &target_line_b,
+                                                   const Eigen::Matrix<double, 3, 1> &target_line_c )
+    {
+        Eigen::Matrix<double, 3, 1> unit_vec_ab = target_line_b - target_line_a;
+        unit_vec_ab = unit_vec_ab / unit_vec_ab.norm();
+        Eigen::Matrix<double, 3, 1> unit_vec_ac = target_line_c - target_line_a;
+        unit_vec_ac = unit_vec_ac / unit_vec_ac.norm();
+        Eigen::Matrix<double, 3, 1> unit_vec_n = unit_vec_ab.cross( unit_vec_ac );
+        return unit_vec_n * unit_vec_n.transpose();
+    }
+
+    static ceres::CostFunction *Create( const Eigen::Matrix<double, 3, 1> &current_pt,
+                                        const Eigen::Matrix<double, 3, 1> &target_line_a,
+                                        const Eigen::Matrix<double, 3, 1> &target_line_b,
+                                        const Eigen::Matrix<double, 3, 1> &target_line_c,
+                                        const double                       motion_blur_s = 1.0,
+                                        Eigen::Matrix<double, 4, 1>        q_last = Eigen::Matrix<double, 4, 1>( 1, 0, 0, 0 ),
+                                        Eigen::Matrix<double, 3, 1>        t_last = Eigen::Matrix<double, 3, 1>( 0, 0, 0 ) )
+    {
+        return new ceres_icp_point2plane_analytic( current_pt, target_line_a, target_line_b, target_line_c, motion_blur_s, q_last, t_last );
+    }
+};
+
+// Analytic residual of a point-to-line or point-to-plane correspondence, q_last is ( w, x, y, z ).
+inline ceres_icp_analytic_residual ceres_icp_create_residual( const Icp_correspondence &corr, const Eigen::Matrix<double, 4, 1> &q_last,
+                                                              const Eigen::Matrix<double, 3, 1> &t_last )
+{
+    Eigen::Matrix<double, 3, 3> projection;
+    if ( corr.m_type == Icp_correspondence::e_point_to_line )
+    {
+        projection = ceres_icp_point2line_analytic::projection( corr.m_target_pt_a, corr.m_target_pt_b );
+    }
+    else
+    {
+        projection = ceres_icp_point2plane_analytic::projection( corr.m_target_pt_a, corr.m_target_pt_b, corr.m_target_pt_c );
+    }
+    return ceres_icp_analytic_residual( corr.m_current_pt, corr.m_target_pt_a, projection, corr.m_motion_blur_s, q_last, t_last );
+}
+
+// Residual block of a ceres::Problem which is reused across solves, the problem must not take ownership of it.
+// The content is reset in place by set(), and a switched off one has zero residual and jacobian,
+// so neither the problem nor the cost function are rebuilt when the correspondences change.
+// If m_autodiff_cost is set, it is evaluated instead of the analytic residual.
+class ceres_icp_pooled_cost_function : public ceres::SizedCostFunction<3, 4, 3>
+{
+  public:
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    ceres_icp_analytic_residual          m_residual;
+    std::unique_ptr<ceres::CostFunction> m_autodiff_cost;
+    bool                                 m_if_active = false;
+
+    ceres_icp_pooled_cost_function(){};
+    virtual ~ceres_icp_pooled_cost_function(){};
+
+    void set( const ceres_icp_analytic_residual &residual, ceres::CostFunction *autodiff_cost = nullptr )
+    {
+        m_residual = residual;
+        m_autodiff_cost.reset( autodiff_cost );
+        m_if_active = true;
+    }
+
+    void switch_off()
+    {
+        m_autodiff_cost.reset();
+        m_if_active = false;
+    }
+
+    virtual bool Evaluate( double const *const *parameters, double *residuals, double **jacobians ) const
+    {
+        if ( !m_if_active )
+        {
+            std::fill( residuals, residuals + 3, 0.0 );
+            if ( jacobians != nullptr && jacobians[ 0 ] != nullptr )
+                std::fill( jacobians[ 0 ], jacobians[ 0 ] + 12, 0.0 );
+            if ( jacobians != nullptr && jacobians[ 1 ] != nullptr )
+                std::fill( jacobians[ 1 ], jacobians[ 1 ] + 9, 0.0 );
+            return true;
+        }
+        if ( m_autodiff_cost != nullptr )
+        {
+            return m_autodiff_cost->Evaluate( parameters, residuals, jacobians );
+        }
+        return m_residual.evaluate( parameters[ 0 ], parameters[ 1 ], residuals,
+                                    jacobians == nullptr ? nullptr : jacobians[ 0 ],
+                                    jacobians == nullptr ? nullptr : jacobians[ 1 ] );
+    }
+};
+
+// Evaluate two cost functions of the same size at (q, t), return the maximum absolute difference
+// of the residuals and jacobians. Used to check the analytic cost functions against autodiff.
+inline double ceres_icp_compare_cost_function( const ceres::CostFunction *cost_a, const ceres::CostFunction *cost_b, const double *q, const double *t )
+{
+    const double *parameters[ 2 ] = { q, t };
+    double        residual_a[ 3 ], residual_b[ 3 ];
+    double        jacobian_q_a[ 12 ], jacobian_q_b[ 12 ], jacobian_t_a[ 9 ], jacobian_t_b[ 9 ];
+    double *      jacobians_a[ 2 ] = { jacobian_q_a, jacobian_t_a };
+    double *      jacobians_b[ 2 ] = { jacobian_q_b, jacobian_t_b };
+    cost_a->Evaluate( parameters, residual_a, jacobians_a );
+    cost_b->Evaluate( parameters, residual_b, jacobians_b );
+    double max_err = 0;
+    for ( int i = 0; i < 3; i++ )
+        max_err = std::max( max_err, fabs( residual_a[ i ] - residual_b[ i ] ) );
+    for ( int i = 0; i < 12; i++ )
+        max_err = std::max( max_err, fabs( jacobian_q_a[ i ] - jacobian_q_b[ i ] ) );
+    for ( int i = 0; i < 9; i++ )
+        max_err = std::max( max_err, fabs( jacobian_t_a[ i ] - jacobian_t_b[ i ] ) );
+    return max_err;
+}
+
 #endif
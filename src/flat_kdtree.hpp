@@ -0,0 +1,196 @@
+// Author: Lin Jiarong          ziv.lin.ljr@gmail.com
+
+#ifndef __FLAT_KDTREE_HPP__
+#define __FLAT_KDTREE_HPP__
+
+#include <algorithm>
+#include <limits>
+#include <math.h>
+#include <utility>
+#include <vector>
+
+// A static kd-tree in the style of nanoflann: points are copied once into a flat xyz float array,
+// reordered so that every leaf is a contiguous range, and nodes are kept in one vector.
+// Build is O( n log n ) without any per-node allocation, search only touches the flat array.
+// The tree can not be modified, call build() again when the points change.
+template <typename T_point>
+class Flat_kdtree
+{
+  public:
+    struct Node
+    {
+        int   m_begin;       // leaf: point range [m_begin, m_end) in m_coords
+        int   m_end;
+        int   m_left = -1;   // -1 for leaf
+        int   m_right = -1;
+        int   m_axis = 0;
+        float m_split = 0;
+    };
+
+    // Scratch memory of nearest_search, use one per thread.
+    typedef std::vector<std::pair<float, int>> Knn_buffer;
+
+    int m_leaf_size = 10; // same as the default of nanoflann
+
+  private:
+    std::vector<T_point> m_points; // in tree order
+    std::vector<float>   m_coords; // x, y, z of m_points
+    std::vector<Node>    m_nodes;
+
+    int build_node( std::vector<int> &order, int begin, int end, std::vector<float> &coords_unordered )
+    {
+        int node_idx = m_nodes.size();
+        m_nodes.push_back( Node() );
+        m_nodes[ node_idx ].m_begin = begin;
+        m_nodes[ node_idx ].m_end = end;
+        if ( end - begin <= m_leaf_size )
+        {
+            return node_idx;
+        }
+
+        // Split at the median of the axis with largest extent
+        float box_min[ 3 ] = { std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max() };
+        float box_max[ 3 ] = { -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max() };
+        for ( int i = begin; i < end; i++ )
+        {
+            for ( int axis = 0; axis < 3; axis++ )
+            {
+                box_min[ axis ] = std::min( box_min[ axis ], coords_unordered[ 3 * order[ i ] + axis ] );
+                box_max[ axis ] = std::max( box_max[ axis ], coords_unordered[ 3 * order[ i ] + axis ] );
+            }
+        }
+        int axis = 0;
+        for ( int i = 1; i < 3; i++ )
+        {
+            if ( box_max[ i ] - box_min[ i ] > box_max[ axis ] - box_min[ axis ] )
+            {
+                axis = i;
+            }
+        }
+
+        int mid = ( begin + end ) / 2;
+        std::nth_element( order.begin() + begin, order.begin() + mid, order.begin() + end,
+                          [&]( int a, int b ) { return coords_unordered[ 3 * a + axis ] < coords_unordered[ 3 * b + axis ]; } );
+        m_nodes[ node_idx ].m_axis = axis;
+        m_nodes[ node_idx ].m_split = coords_unordered[ 3 * order[ mid ] + axis ];
+        int left = build_node( order, begin, mid, coords_unordered );
+        int right = build_node( order, mid, end, coords_unordered );
+        m_nodes[ node_idx ].m_left = left;
+        m_nodes[ node_idx ].m_right = right;
+        return node_idx;
+    }
+
+    // knn is kept sorted by distance, at most k items.
+    void search( int node_idx, const float *pt, unsigned int k, Knn_buffer &knn ) const
+    {
+        const Node &node = m_nodes[ node_idx ];
+        if ( node.m_left < 0 )
+        {
+            for ( int i = node.m_begin; i < node.m_end; i++ )
+            {
+                float dx = m_coords[ 3 * i + 0 ] - pt[ 0 ];
+                float dy = m_coords[ 3 * i + 1 ] - pt[ 1 ];
+                float dz = m_coords[ 3 * i + 2 ] - pt[ 2 ];
+                float sq_dis = dx * dx + dy * dy + dz * dz;
+                if ( knn.size() < k )
+                {
+                    knn.push_back( std::make_pair( sq_dis, i ) );
+                }
+                else if ( sq_dis < knn.back().first )
+                {
+                    knn.back() = std::make_pair( sq_dis, i );
+                }
+                else
+                {
+                    continue;
+                }
+                for ( size_t j = knn.size() - 1; j > 0 && knn[ j ].first < knn[ j - 1 ].first; j-- )
+                {
+                    std::swap( knn[ j ], knn[ j - 1 ] );
+                }
+            }
+            return;
+        }
+
+        float diff = pt[ node.m_axis ] - node.m_split;
+        int   near_idx = diff < 0 ? node.m_left : node.m_right;
+        int   far_idx = diff < 0 ? node.m_right : node.m_left;
+        search( near_idx, pt, k, knn );
+        if ( knn.size() < k || diff * diff < knn.back().first )
+        {
+            search( far_idx, pt, k, knn );
+        }
+    }
+
+  public:
+    Flat_kdtree(){};
+    ~Flat_kdtree(){};
+
+    void clear()
+    {
+        m_points.clear();
+        m_coords.clear();
+        m_nodes.clear();
+    }
+
+    int size() const
+    {
+        return m_points.size();
+    }
+
+    // Build from scratch, T_cloud is any container of T_point with begin() and end().
+    template <typename T_cloud>
+    void build( const T_cloud &pts )
+    {
+        std::vector<float> coords_unordered;
+        std::vector<int>   order;
+        std::vector<T_point> points_unordered( pts.begin(), pts.end() );
+        coords_unordered.resize( 3 * points_unordered.size() );
+        order.resize( points_unordered.size() );
+        for ( size_t i = 0; i < points_unordered.size(); i++ )
+        {
+            coords_unordered[ 3 * i + 0 ] = points_unordered[ i ].x;
+            coords_unordered[ 3 * i + 1 ] = points_unordered[ i ].y;
+            coords_unordered[ 3 * i + 2 ] = points_unordered[ i ].z;
+            order[ i ] = i;
+        }
+
+        m_nodes.clear();
+        m_nodes.reserve( 2 * points_unordered.size() / std::max( m_leaf_size / 2, 1 ) + 1 );
+        if ( points_unordered.size() )
+        {
+            build_node( order, 0, order.size(), coords_unordered );
+        }
+
+        m_points.resize( order.size() );
+        m_coords.resize( 3 * order.size() );
+        for ( size_t i = 0; i < order.size(); i++ )
+        {
+            m_points[ i ] = points_unordered[ order[ i ] ];
+            m_coords[ 3 * i + 0 ] = coords_unordered[ 3 * order[ i ] + 0 ];
+            m_coords[ 3 * i + 1 ] = coords_unordered[ 3 * order[ i ] + 1 ];
+            m_coords[ 3 * i + 2 ] = coords_unordered[ 3 * order[ i ] + 2 ];
+        }
+    }
+
+    // Same output layout as pcl::KdTreeFLANN::nearestKSearch, points are sorted by distance.
+    int nearest_search( const T_point &pt, int k, std::vector<T_point> &nearest_pts, std::vector<float> &nearest_sq_dis, Knn_buffer &knn ) const
+    {
+        knn.clear();
+        if ( m_nodes.size() && k > 0 )
+        {
+            float pt_coord[ 3 ] = { pt.x, pt.y, pt.z };
+            search( 0, pt_coord, k, knn );
+        }
+        nearest_pts.resize( knn.size() );
+        nearest_sq_dis.resize( knn.size() );
+        for ( size_t i = 0; i < knn.size(); i++ )
+        {
+            nearest_pts[ i ] = m_points[ knn[ i ].second ];
+            nearest_sq_dis[ i ] = knn[ i ].first;
+        }
+        return knn.size();
+    }
+};
+
+#endif
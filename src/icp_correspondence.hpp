@@ -0,0 +1,55 @@
+// Author: Lin Jiarong          ziv.lin.ljr@gmail.com
+
+#ifndef __ICP_CORRESPONDENCE_HPP__
+#define __ICP_CORRESPONDENCE_HPP__
+
+#include <Eigen/Eigen>
+#include <vector>
+
+// One matched feature point of the current frame and its target line/plane in map.
+struct Icp_correspondence
+{
+    enum E_type
+    {
+        e_point_to_line = 0,
+        e_point_to_plane = 1,
+    };
+
+    int             m_type;
+    Eigen::Vector3d m_current_pt; // point in lidar frame
+    Eigen::Vector3d m_target_pt_a; // line: point a, b; plane: point a, b, c
+    Eigen::Vector3d m_target_pt_b;
+    Eigen::Vector3d m_target_pt_c;
+    double          m_motion_blur_s = 1.0;
+
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+typedef std::vector<Icp_correspondence, Eigen::aligned_allocator<Icp_correspondence>> Icp_correspondence_vec;
+
+// Last association result of one feature point, reused while the point moves less than a distance in map.
+struct Icp_correspondence_cache
+{
+    enum E_state
+    {
+        e_not_searched = 0,
+        e_no_neighbor = 1, // not enough neighbours near by
+        e_rejected = 2,    // neighbours are not a line/plane
+        e_matched = 3,
+    };
+
+    int                m_state = e_not_searched;
+    Eigen::Vector3d    m_pt_w; // position in map when it was associated
+    Icp_correspondence m_correspondence;
+
+    bool is_reusable( const Eigen::Vector3d &pt_w, double max_distance ) const
+    {
+        return m_state != e_not_searched && max_distance > 0 && ( pt_w - m_pt_w ).squaredNorm() < max_distance * max_distance;
+    }
+
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+typedef std::vector<Icp_correspondence_cache, Eigen::aligned_allocator<Icp_correspondence_cache>> Icp_correspondence_cache_vec;
+
+#endif
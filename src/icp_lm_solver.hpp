@@ -0,0 +1,303 @@
+// Author: Lin Jiarong          ziv.lin.ljr@gmail.com
+
+#ifndef __ICP_LM_SOLVER_HPP__
+#define __ICP_LM_SOLVER_HPP__
+
+#include <Eigen/Eigen>
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "ceres_icp.hpp"
+#include "icp_correspondence.hpp"
+#include "tools/thread_pool.hpp"
+
+// Levenberg-Marquardt solver of the scan-to-map registration, an alternative to ceres::Solve.
+// Same problem as the ceres one in Laser_mapping: parameters are q_incre (x, y, z, w) and t_incre,
+// the quaternion is updated by q = exp( delta ) * q like ceres::EigenQuaternionParameterization,
+// every translation axis is bounded by m_translation_center +/- m_max_translation, and the residuals
+// are robustified by a Huber loss, solved as iteratively reweighted least squares.
+class Icp_lm_solver
+{
+  public:
+    typedef Eigen::Matrix<double, 6, 6> Mat_6;
+    typedef Eigen::Matrix<double, 6, 1> Vec_6;
+    typedef std::vector<ceres_icp_analytic_residual, Eigen::aligned_allocator<ceres_icp_analytic_residual>> Residual_vec;
+
+    struct Summary
+    {
+        int    m_iterations = 0;
+        int    m_successful_iterations = 0;
+        int    m_residual_num = 0;
+        double m_initial_cost = 0;
+        double m_final_cost = 0;
+        bool   m_if_converged = false;
+
+        std::string brief_report() const
+        {
+            char buffer[ 256 ];
+            sprintf( buffer, "Icp_lm_solver, Initial %e, Final %e, Residuals %d, Iterations %d (%d successful), %s",
+                     m_initial_cost, m_final_cost, m_residual_num, m_iterations, m_successful_iterations,
+                     m_if_converged ? "CONVERGENCE" : "NO_CONVERGENCE" );
+            return std::string( buffer );
+        }
+    };
+
+    double m_huber_delta = 0.1;
+    double m_max_translation = 1e10;
+    double m_function_tolerance = 1e-6; // same as the default of ceres::Solver::Options
+    double m_gradient_tolerance = 1e-10;
+    double m_parameter_tolerance = 1e-8;
+
+    Eigen::Vector3d m_translation_center = Eigen::Vector3d::Zero(); // e.g. the motion prior
+
+    Residual_vec      m_residuals;
+    std::vector<char> m_residual_active; // outliers are disabled instead of removed
+
+    Common_tools::Thread_pool *m_thread_pool = nullptr;
+
+    Icp_lm_solver(){};
+    ~Icp_lm_solver(){};
+
+    void set_problem( const Icp_correspondence_vec &correspondences, const Eigen::Quaterniond &q_last, const Eigen::Vector3d &t_last )
+    {
+        Eigen::Matrix<double, 4, 1> q_last_vec( q_last.w(), q_last.x(), q_last.y(), q_last.z() );
+        m_residuals.resize( correspondences.size() );
+        for ( size_t i = 0; i < correspondences.size(); i++ )
+        {
+            m_residuals[ i ] = ceres_icp_create_residual( correspondences[ i ], q_last_vec, t_last );
+        }
+        m_residual_active.assign( m_residuals.size(), 1 );
+    }
+
+    int get_active_residual_num() const
+    {
+        int num = 0;
+        for ( size_t i = 0; i < m_residual_active.size(); i++ )
+        {
+            num += m_residual_active[ i ];
+        }
+        return num;
+    }
+
+    // Robustified cost of active residuals, 0.5 * sum( rho( |r|^2 ) ) like ceres::Problem::Evaluate.
+    // residuals holds 3 values of every residual, including inactive ones.
+    double evaluate( const double *para, std::vector<double> *residuals = nullptr )
+    {
+        if ( residuals != nullptr )
+        {
+            residuals->resize( m_residuals.size() * 3 );
+        }
+        std::vector<double> block_cost( get_block_num(), 0.0 );
+        for_each_block( [&]( int begin, int end, int block_idx ) {
+            double residual[ 3 ];
+            for ( int i = begin; i < end; i++ )
+            {
+                m_residuals[ i ].evaluate( para, para + 4, residual, nullptr, nullptr );
+                if ( residuals != nullptr )
+                {
+                    ( *residuals )[ 3 * i + 0 ] = residual[ 0 ];
+                    ( *residuals )[ 3 * i + 1 ] = residual[ 1 ];
+                    ( *residuals )[ 3 * i + 2 ] = residual[ 2 ];
+                }
+                if ( m_residual_active[ i ] )
+                {
+                    block_cost[ block_idx ] += huber_cost( residual[ 0 ] * residual[ 0 ] + residual[ 1 ] * residual[ 1 ] + residual[ 2 ] * residual[ 2 ] );
+                }
+            }
+        } );
+        double cost = 0;
+        for ( size_t i = 0; i < block_cost.size(); i++ )
+        {
+            cost += block_cost[ i ];
+        }
+        return cost;
+    }
+
+    // Solve in place, para is { q_x, q_y, q_z, q_w, t_x, t_y, t_z }.
+    void solve( double *para, int max_iterations, Summary &summary )
+    {
+        summary = Summary();
+        summary.m_residual_num = get_active_residual_num();
+
+        Mat_6  hessian;
+        Vec_6  gradient;
+        double cost = build_normal_equation( para, hessian, gradient );
+        double lambda = 1e-4;
+        double lambda_factor = 2.0;
+        double para_new[ 7 ];
+        summary.m_initial_cost = cost;
+        summary.m_final_cost = cost;
+
+        while ( summary.m_iterations < max_iterations )
+        {
+            if ( gradient.lpNorm<Eigen::Infinity>() <= m_gradient_tolerance )
+            {
+                summary.m_if_converged = true;
+                break;
+            }
+            summary.m_iterations++;
+
+            Mat_6 hessian_lm = hessian;
+            for ( int i = 0; i < 6; i++ )
+            {
+                hessian_lm( i, i ) += lambda * std::min( std::max( hessian( i, i ), 1e-6 ), 1e32 );
+            }
+            Vec_6 delta = hessian_lm.ldlt().solve( -gradient );
+            plus( para, delta, para_new );
+
+            double cost_new = evaluate( para_new );
+            double predicted_reduction = -( gradient.dot( delta ) + 0.5 * delta.dot( hessian * delta ) );
+            double actual_reduction = cost - cost_new;
+            if ( actual_reduction > 0 && predicted_reduction > 0 )
+            {
+                double rho = actual_reduction / predicted_reduction;
+                lambda *= std::max( 1.0 / 3.0, 1.0 - pow( 2.0 * rho - 1.0, 3 ) );
+                lambda_factor = 2.0;
+                summary.m_successful_iterations++;
+
+                double para_norm = 0;
+                for ( int i = 0; i < 7; i++ )
+                {
+                    para_norm += para[ i ] * para[ i ];
+                    para[ i ] = para_new[ i ];
+                }
+                cost = build_normal_equation( para, hessian, gradient );
+                summary.m_final_cost = cost;
+                if ( actual_reduction < m_function_tolerance * summary.m_final_cost ||
+                     delta.norm() <= m_parameter_tolerance * ( sqrt( para_norm ) + m_parameter_tolerance ) )
+                {
+                    summary.m_if_converged = true;
+                    break;
+                }
+            }
+            else
+            {
+                lambda *= lambda_factor;
+                lambda_factor *= 2.0;
+                if ( lambda > 1e32 )
+                {
+                    break;
+                }
+            }
+        }
+    }
+
+  private:
+    // Residuals are summed in blocks of fixed size, then the block sums in block order. The blocks do not depend
+    // on the thread number, so neither does the floating point summation order nor the solution.
+    static const int m_block_size = 128;
+
+    int get_block_num() const
+    {
+        return ( ( int ) m_residuals.size() + m_block_size - 1 ) / m_block_size;
+    }
+
+    // func( begin, end, block_idx ) for every block of residuals, in parallel if there is a thread pool.
+    template < typename T_func >
+    void for_each_block( const T_func &func )
+    {
+        int block_num = get_block_num();
+        int residual_num = m_residuals.size();
+        auto func_blocks = [&]( int block_begin, int block_end, int ) {
+            for ( int block_idx = block_begin; block_idx < block_end; block_idx++ )
+            {
+                func( block_idx * m_block_size, std::min( ( block_idx + 1 ) * m_block_size, residual_num ), block_idx );
+            }
+        };
+        if ( m_thread_pool == nullptr )
+        {
+            func_blocks( 0, block_num, 0 );
+        }
+        else
+        {
+            m_thread_pool->parallel_for( block_num, func_blocks );
+        }
+    }
+
+    double huber_cost( double sq_norm ) const
+    {
+        double b = m_huber_delta * m_huber_delta;
+        return 0.5 * ( sq_norm > b ? 2.0 * m_huber_delta * sqrt( sq_norm ) - b : sq_norm );
+    }
+
+    // Build J^T W J and J^T W r over the 6-dof local parameterization, W is the huber weight of each residual.
+    double build_normal_equation( const double *para, Mat_6 &hessian, Vec_6 &gradient )
+    {
+        // d( q ) / d( delta ) of q = exp( delta ) * q at delta = 0, the same as ceres::EigenQuaternionParameterization.
+        Eigen::Matrix<double, 4, 3, Eigen::RowMajor> jacobian_plus;
+        jacobian_plus << para[ 3 ], para[ 2 ], -para[ 1 ],
+            -para[ 2 ], para[ 3 ], para[ 0 ],
+            para[ 1 ], -para[ 0 ], para[ 3 ],
+            -para[ 0 ], -para[ 1 ], -para[ 2 ];
+
+        int                                                 block_num = get_block_num();
+        std::vector<Mat_6, Eigen::aligned_allocator<Mat_6>> block_hessian( block_num, Mat_6::Zero() );
+        std::vector<Vec_6, Eigen::aligned_allocator<Vec_6>> block_gradient( block_num, Vec_6::Zero() );
+        std::vector<double>                                 block_cost( block_num, 0.0 );
+        for_each_block( [&]( int begin, int end, int block_idx ) {
+            Eigen::Matrix<double, 3, 1>                  residual;
+            Eigen::Matrix<double, 3, 4, Eigen::RowMajor> jacobian_q;
+            Eigen::Matrix<double, 3, 3, Eigen::RowMajor> jacobian_t;
+            Eigen::Matrix<double, 3, 6>                  jacobian;
+            Mat_6                                        hessian_ = Mat_6::Zero();
+            Vec_6                                        gradient_ = Vec_6::Zero();
+            double                                       cost_ = 0;
+            for ( int i = begin; i < end; i++ )
+            {
+                if ( !m_residual_active[ i ] )
+                {
+                    continue;
+                }
+                m_residuals[ i ].evaluate( para, para + 4, residual.data(), jacobian_q.data(), jacobian_t.data() );
+                double sq_norm = residual.squaredNorm();
+                double weight = sq_norm > m_huber_delta * m_huber_delta ? m_huber_delta / sqrt( sq_norm ) : 1.0;
+                jacobian.block<3, 3>( 0, 0 ) = jacobian_q * jacobian_plus;
+                jacobian.block<3, 3>( 0, 3 ) = jacobian_t;
+                hessian_.noalias() += weight * jacobian.transpose() * jacobian;
+                gradient_.noalias() += weight * jacobian.transpose() * residual;
+                cost_ += huber_cost( sq_norm );
+            }
+            block_hessian[ block_idx ] = hessian_;
+            block_gradient[ block_idx ] = gradient_;
+            block_cost[ block_idx ] = cost_;
+        } );
+
+        double cost = 0;
+        hessian.setZero();
+        gradient.setZero();
+        for ( int i = 0; i < block_num; i++ )
+        {
+            hessian += block_hessian[ i ];
+            gradient += block_gradient[ i ];
+            cost += block_cost[ i ];
+        }
+        return cost;
+    }
+
+    void plus( const double *para, const Vec_6 &delta, double *para_new ) const
+    {
+        Eigen::Map<const Eigen::Quaterniond> q( para );
+        Eigen::Map<Eigen::Quaterniond>       q_new( para_new );
+        Eigen::Matrix<double, 3, 1>          delta_q = delta.head<3>();
+        double                               norm_delta = delta_q.norm();
+        if ( norm_delta > 0.0 )
+        {
+            Eigen::Matrix<double, 3, 1> vec = sin( norm_delta ) / norm_delta * delta_q;
+            q_new = Eigen::Quaterniond( cos( norm_delta ), vec( 0 ), vec( 1 ), vec( 2 ) ) * q;
+        }
+        else
+        {
+            q_new = q;
+        }
+        for ( int i = 0; i < 3; i++ )
+        {
+            para_new[ 4 + i ] = std::min( std::max( para[ 4 + i ] + delta( 3 + i ), m_translation_center( i ) - m_max_translation ),
+                                          m_translation_center( i ) + m_max_translation );
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,151 @@
+// Author: Lin Jiarong          ziv.lin.ljr@gmail.com
+
+#ifndef __ICP_RESIDUAL_SELECTOR_HPP__
+#define __ICP_RESIDUAL_SELECTOR_HPP__
+
+#include <Eigen/Eigen>
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "ceres_icp.hpp"
+#include "icp_correspondence.hpp"
+
+// Keep at most m_max_residual_num correspondences of scan-to-map ICP, chosen by their information on the pose.
+// The residual r = P * ( R * p + t - a ) of a correspondence has jacobian J = P * [ -( R * p )^, I ] w.r.t. a rotation
+// around the sensor and a translation, and the information of the pose is H = sum( J^T * J ).
+// The rotation and translation blocks of H are decomposed separately ( they have different units ), which gives 6
+// directions. Correspondences are picked round robin over the directions, weakest direction first, each direction
+// taking its unpicked correspondence of largest information along it. So a degenerate direction, e.g. along a corridor,
+// keeps its few constraints, while the well constrained directions share the rest of the budget.
+class Icp_residual_selector
+{
+  public:
+    typedef Eigen::Matrix<double, 6, 6> Mat_6;
+    typedef Eigen::Matrix<double, 6, 1> Vec_6;
+
+    int m_max_residual_num = 0; // 0 to keep all
+
+    // Of last select(), smallest eigen value of the rotation and translation information blocks.
+    double m_min_info_rotation[ 2 ] = { 0, 0 }; // before, after selection
+    double m_min_info_translation[ 2 ] = { 0, 0 };
+
+  private:
+    std::vector<Mat_6, Eigen::aligned_allocator<Mat_6>> m_infos;
+    std::vector<std::pair<double, int>>                 m_scores[ 6 ];
+    std::vector<char>                                   m_if_selected;
+    Icp_correspondence_vec                              m_selected;
+
+    static void get_min_eigen_values( const Mat_6 &info, double &min_rotation, double &min_translation )
+    {
+        Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> eigen_rotation( info.block<3, 3>( 0, 0 ), Eigen::EigenvaluesOnly );
+        Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> eigen_translation( info.block<3, 3>( 3, 3 ), Eigen::EigenvaluesOnly );
+        min_rotation = eigen_rotation.eigenvalues()( 0 );
+        min_translation = eigen_translation.eigenvalues()( 0 );
+    }
+
+  public:
+    static Mat_6 get_information( const Icp_correspondence &corr, const Eigen::Quaterniond &q_w )
+    {
+        Eigen::Matrix3d projection;
+        if ( corr.m_type == Icp_correspondence::e_point_to_line )
+        {
+            projection = ceres_icp_point2line_analytic::projection( corr.m_target_pt_a, corr.m_target_pt_b );
+        }
+        else
+        {
+            projection = ceres_icp_point2plane_analytic::projection( corr.m_target_pt_a, corr.m_target_pt_b, corr.m_target_pt_c );
+        }
+        Eigen::Vector3d pt = q_w * corr.m_current_pt;
+        Eigen::Matrix3d pt_hat;
+        pt_hat << 0, -pt( 2 ), pt( 1 ),
+            pt( 2 ), 0, -pt( 0 ),
+            -pt( 1 ), pt( 0 ), 0;
+        Eigen::Matrix<double, 3, 6> jacobian;
+        jacobian.block<3, 3>( 0, 0 ) = -projection * pt_hat;
+        jacobian.block<3, 3>( 0, 3 ) = projection;
+        return jacobian.transpose() * jacobian;
+    }
+
+    // Select in place, q_w is the current rotation of lidar in map. Return the number of removed correspondences.
+    int select( Icp_correspondence_vec &correspondences, const Eigen::Quaterniond &q_w )
+    {
+        int corr_num = correspondences.size();
+        if ( m_max_residual_num <= 0 || corr_num <= m_max_residual_num )
+        {
+            return 0;
+        }
+
+        Mat_6 info_total = Mat_6::Zero();
+        m_infos.resize( corr_num );
+        for ( int i = 0; i < corr_num; i++ )
+        {
+            m_infos[ i ] = get_information( correspondences[ i ], q_w );
+            info_total += m_infos[ i ];
+        }
+
+        Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> eigen_rotation( info_total.block<3, 3>( 0, 0 ) );
+        Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> eigen_translation( info_total.block<3, 3>( 3, 3 ) );
+        m_min_info_rotation[ 0 ] = eigen_rotation.eigenvalues()( 0 );
+        m_min_info_translation[ 0 ] = eigen_translation.eigenvalues()( 0 );
+
+        // Directions sorted by eigen value, relative to the largest one of its block so that the units cancel
+        std::vector<std::pair<double, Vec_6>> directions( 6 );
+        for ( int i = 0; i < 3; i++ )
+        {
+            directions[ i ].first = eigen_rotation.eigenvalues()( i ) / std::max( eigen_rotation.eigenvalues()( 2 ), 1e-12 );
+            directions[ i ].second << eigen_rotation.eigenvectors().col( i ), Eigen::Vector3d::Zero();
+            directions[ 3 + i ].first = eigen_translation.eigenvalues()( i ) / std::max( eigen_translation.eigenvalues()( 2 ), 1e-12 );
+            directions[ 3 + i ].second << Eigen::Vector3d::Zero(), eigen_translation.eigenvectors().col( i );
+        }
+        std::stable_sort( directions.begin(), directions.end(),
+                          []( const std::pair<double, Vec_6> &a, const std::pair<double, Vec_6> &b ) { return a.first < b.first; } );
+
+        for ( int k = 0; k < 6; k++ )
+        {
+            m_scores[ k ].resize( corr_num );
+            for ( int i = 0; i < corr_num; i++ )
+            {
+                m_scores[ k ][ i ] = std::make_pair( -directions[ k ].second.dot( m_infos[ i ] * directions[ k ].second ), i );
+            }
+            // Every direction picks at most m_max_residual_num
+            std::partial_sort( m_scores[ k ].begin(), m_scores[ k ].begin() + m_max_residual_num, m_scores[ k ].end() );
+        }
+
+        m_if_selected.assign( corr_num, 0 );
+        int                 selected_num = 0;
+        std::vector<size_t> next( 6, 0 );
+        while ( selected_num < m_max_residual_num )
+        {
+            for ( int k = 0; k < 6 && selected_num < m_max_residual_num; k++ )
+            {
+                while ( next[ k ] < ( size_t ) m_max_residual_num && m_if_selected[ m_scores[ k ][ next[ k ] ].second ] )
+                {
+                    next[ k ]++;
+                }
+                if ( next[ k ] < ( size_t ) m_max_residual_num )
+                {
+                    m_if_selected[ m_scores[ k ][ next[ k ] ].second ] = 1;
+                    selected_num++;
+                }
+            }
+        }
+
+        // Keep the order of correspondences
+        Mat_6 info_selected = Mat_6::Zero();
+        m_selected.clear();
+        for ( int i = 0; i < corr_num; i++ )
+        {
+            if ( m_if_selected[ i ] )
+            {
+                m_selected.push_back( correspondences[ i ] );
+                info_selected += m_infos[ i ];
+            }
+        }
+        get_min_eigen_values( info_selected, m_min_info_rotation[ 1 ], m_min_info_translation[ 1 ] );
+        correspondences.swap( m_selected );
+        return corr_num - correspondences.size();
+    }
+};
+
+#endif
@@ -0,0 +1,427 @@
+// Author: Lin Jiarong          ziv.lin.ljr@gmail.com
+
+#ifndef __INCREMENTAL_KDTREE_HPP__
+#define __INCREMENTAL_KDTREE_HPP__
+
+#include <algorithm>
+#include <limits>
+#include <math.h>
+#include <queue>
+#include <vector>
+
+// A kd-tree which supports point insertion and box deletion without rebuilding the whole tree.
+// Deleted points are only labeled, a subtree is rebuilt when it becomes unbalanced
+// or holds too many deleted points (scapegoat style rebalancing).
+template <typename T_point>
+class Incremental_kdtree
+{
+  public:
+    struct Node
+    {
+        T_point m_point;
+        int     m_axis;
+        Node *  m_left = nullptr;
+        Node *  m_right = nullptr;
+        int     m_size = 1;        // number of nodes in subtree, including deleted ones
+        int     m_invalid_num = 0; // number of deleted nodes in subtree
+        bool    m_deleted = false;
+        float   m_box_min[ 3 ];    // bounding box of subtree
+        float   m_box_max[ 3 ];
+
+        Node( const T_point &pt, int axis ) : m_point( pt ), m_axis( axis )
+        {
+            for ( int i = 0; i < 3; i++ )
+            {
+                m_box_min[ i ] = m_box_max[ i ] = get_coord( pt, i );
+            }
+        }
+    };
+
+    float m_balance_ratio = 0.7;  // rebuild if one child holds more than this ratio of the subtree
+    float m_delete_ratio = 0.5;   // rebuild if more than this ratio of the subtree is deleted
+    int   m_min_rebuild_size = 16; // subtree smaller than this is never rebuilt
+
+  private:
+    Node *                m_root = nullptr;
+    Node **               m_rebuild_ptr = nullptr;
+    std::vector<T_point>  m_rebuild_pts;
+    int                   m_rebuild_count = 0;
+
+    typedef std::pair<float, const Node *> Heap_item;
+    struct Heap_compare
+    {
+        bool operator()( const Heap_item &a, const Heap_item &b ) const
+        {
+            return a.first < b.first;
+        }
+    };
+    typedef std::priority_queue<Heap_item, std::vector<Heap_item>, Heap_compare> Knn_heap;
+
+    static float get_coord( const T_point &pt, int axis )
+    {
+        return ( axis == 0 ) ? pt.x : ( ( axis == 1 ) ? pt.y : pt.z );
+    }
+
+    static float sq_dis( const T_point &a, const T_point &b )
+    {
+        return ( a.x - b.x ) * ( a.x - b.x ) + ( a.y - b.y ) * ( a.y - b.y ) + ( a.z - b.z ) * ( a.z - b.z );
+    }
+
+    static float box_sq_dis( const Node *node, const T_point &pt )
+    {
+        float dis = 0;
+        for ( int i = 0; i < 3; i++ )
+        {
+            float v = get_coord( pt, i );
+            if ( v < node->m_box_min[ i ] )
+            {
+                dis += ( node->m_box_min[ i ] - v ) * ( node->m_box_min[ i ] - v );
+            }
+            else if ( v > node->m_box_max[ i ] )
+            {
+                dis += ( v - node->m_box_max[ i ] ) * ( v - node->m_box_max[ i ] );
+            }
+        }
+        return dis;
+    }
+
+    void update_node( Node *node )
+    {
+        node->m_size = 1;
+        node->m_invalid_num = node->m_deleted ? 1 : 0;
+        for ( int i = 0; i < 3; i++ )
+        {
+            node->m_box_min[ i ] = node->m_box_max[ i ] = get_coord( node->m_point, i );
+        }
+        Node *childs[ 2 ] = { node->m_left, node->m_right };
+        for ( int c = 0; c < 2; c++ )
+        {
+            if ( childs[ c ] == nullptr )
+            {
+                continue;
+            }
+            node->m_size += childs[ c ]->m_size;
+            node->m_invalid_num += childs[ c ]->m_invalid_num;
+            for ( int i = 0; i < 3; i++ )
+            {
+                node->m_box_min[ i ] = std::min( node->m_box_min[ i ], childs[ c ]->m_box_min[ i ] );
+                node->m_box_max[ i ] = std::max( node->m_box_max[ i ], childs[ c ]->m_box_max[ i ] );
+            }
+        }
+    }
+
+    bool is_need_rebuild( const Node *node ) const
+    {
+        if ( node->m_size < m_min_rebuild_size )
+        {
+            return false;
+        }
+        int left_size = node->m_left ? node->m_left->m_size : 0;
+        int right_size = node->m_right ? node->m_right->m_size : 0;
+        return ( std::max( left_size, right_size ) > m_balance_ratio * node->m_size ) ||
+               ( node->m_invalid_num > m_delete_ratio * node->m_size );
+    }
+
+    void collect_and_free( Node *node, std::vector<T_point> &pts )
+    {
+        if ( node == nullptr )
+        {
+            return;
+        }
+        collect_and_free( node->m_left, pts );
+        if ( !node->m_deleted )
+        {
+            pts.push_back( node->m_point );
+        }
+        collect_and_free( node->m_right, pts );
+        delete node;
+    }
+
+    Node *build_subtree( typename std::vector<T_point>::iterator begin, typename std::vector<T_point>::iterator end )
+    {
+        if ( begin == end )
+        {
+            return nullptr;
+        }
+
+        // Split along the axis of largest spread.
+        float box_min[ 3 ] = { get_coord( *begin, 0 ), get_coord( *begin, 1 ), get_coord( *begin, 2 ) };
+        float box_max[ 3 ] = { box_min[ 0 ], box_min[ 1 ], box_min[ 2 ] };
+        for ( typename std::vector<T_point>::iterator it = begin; it != end; it++ )
+        {
+            for ( int i = 0; i < 3; i++ )
+            {
+                box_min[ i ] = std::min( box_min[ i ], get_coord( *it, i ) );
+                box_max[ i ] = std::max( box_max[ i ], get_coord( *it, i ) );
+            }
+        }
+        int axis = 0;
+        for ( int i = 1; i < 3; i++ )
+        {
+            if ( box_max[ i ] - box_min[ i ] > box_max[ axis ] - box_min[ axis ] )
+            {
+                axis = i;
+            }
+        }
+
+        typename std::vector<T_point>::iterator mid = begin + ( end - begin ) / 2;
+        std::nth_element( begin, mid, end, [axis]( const T_point &a, const T_point &b ) { return get_coord( a, axis ) < get_coord( b, axis ); } );
+        Node *node = new Node( *mid, axis );
+        node->m_left = build_subtree( begin, mid );
+        node->m_right = build_subtree( mid + 1, end );
+        update_node( node );
+        return node;
+    }
+
+    void rebuild( Node **node_ptr )
+    {
+        m_rebuild_pts.clear();
+        collect_and_free( *node_ptr, m_rebuild_pts );
+        *node_ptr = build_subtree( m_rebuild_pts.begin(), m_rebuild_pts.end() );
+        m_rebuild_count++;
+    }
+
+    void add_point( Node **node_ptr, const T_point &pt, int axis )
+    {
+        Node *node = *node_ptr;
+        if ( node == nullptr )
+        {
+            *node_ptr = new Node( pt, axis );
+            return;
+        }
+
+        if ( get_coord( pt, node->m_axis ) < get_coord( node->m_point, node->m_axis ) )
+        {
+            add_point( &node->m_left, pt, ( node->m_axis + 1 ) % 3 );
+        }
+        else
+        {
+            add_point( &node->m_right, pt, ( node->m_axis + 1 ) % 3 );
+        }
+        update_node( node );
+
+        // Outer calls overwrite inner ones, so the highest unbalanced subtree is rebuilt.
+        if ( is_need_rebuild( node ) )
+        {
+            m_rebuild_ptr = node_ptr;
+        }
+    }
+
+    int delete_box( Node **node_ptr, const float *box_min, const float *box_max )
+    {
+        Node *node = *node_ptr;
+        if ( node == nullptr || node->m_invalid_num == node->m_size )
+        {
+            return 0;
+        }
+        for ( int i = 0; i < 3; i++ )
+        {
+            if ( node->m_box_max[ i ] < box_min[ i ] || node->m_box_min[ i ] >= box_max[ i ] )
+            {
+                return 0;
+            }
+        }
+
+        int  delete_num = 0;
+        bool is_inside = true;
+        for ( int i = 0; i < 3; i++ )
+        {
+            float v = get_coord( node->m_point, i );
+            if ( v < box_min[ i ] || v >= box_max[ i ] )
+            {
+                is_inside = false;
+            }
+        }
+        if ( is_inside && !node->m_deleted )
+        {
+            node->m_deleted = true;
+            delete_num++;
+        }
+        // The box may unbalance both children, so they are rebuilt on the way back instead of through m_rebuild_ptr,
+        // which only holds one subtree. A rebuilt child may still unbalance this node, which is checked by the caller.
+        Node **childs[ 2 ] = { &node->m_left, &node->m_right };
+        for ( int c = 0; c < 2; c++ )
+        {
+            delete_num += delete_box( childs[ c ], box_min, box_max );
+            if ( *childs[ c ] != nullptr && is_need_rebuild( *childs[ c ] ) )
+            {
+                rebuild( childs[ c ] );
+            }
+        }
+        update_node( node );
+        return delete_num;
+    }
+
+    bool is_balanced( const Node *node ) const
+    {
+        return node == nullptr || ( !is_need_rebuild( node ) && is_balanced( node->m_left ) && is_balanced( node->m_right ) );
+    }
+
+    void search( const Node *node, const T_point &pt, unsigned int k, float max_sq_dis, Knn_heap &heap ) const
+    {
+        if ( node == nullptr || node->m_invalid_num == node->m_size )
+        {
+            return;
+        }
+        float bound = ( heap.size() == k ) ? heap.top().first : max_sq_dis;
+        if ( box_sq_dis( node, pt ) > bound )
+        {
+            return;
+        }
+
+        if ( !node->m_deleted )
+        {
+            float dis = sq_dis( node->m_point, pt );
+            if ( heap.size() < k && dis <= max_sq_dis )
+            {
+                heap.push( Heap_item( dis, node ) );
+            }
+            else if ( heap.size() == k && dis < heap.top().first )
+            {
+                heap.pop();
+                heap.push( Heap_item( dis, node ) );
+            }
+        }
+
+        // Visit the child on the side of the query point first.
+        if ( get_coord( pt, node->m_axis ) < get_coord( node->m_point, node->m_axis ) )
+        {
+            search( node->m_left, pt, k, max_sq_dis, heap );
+            search( node->m_right, pt, k, max_sq_dis, heap );
+        }
+        else
+        {
+            search( node->m_right, pt, k, max_sq_dis, heap );
+            search( node->m_left, pt, k, max_sq_dis, heap );
+        }
+    }
+
+  public:
+    Incremental_kdtree(){};
+
+    ~Incremental_kdtree()
+    {
+        clear();
+    };
+
+    Incremental_kdtree( const Incremental_kdtree & ) = delete;
+    Incremental_kdtree &operator=( const Incremental_kdtree & ) = delete;
+
+    void clear()
+    {
+        m_rebuild_pts.clear();
+        collect_and_free( m_root, m_rebuild_pts );
+        m_rebuild_pts.clear();
+        m_root = nullptr;
+    }
+
+    // Number of points that are not deleted.
+    int size() const
+    {
+        return m_root ? ( m_root->m_size - m_root->m_invalid_num ) : 0;
+    }
+
+    int get_rebuild_count() const
+    {
+        return m_rebuild_count;
+    }
+
+    // No subtree is unbalanced or holds too many deleted points, e.g. for tests.
+    bool is_balanced() const
+    {
+        return is_balanced( m_root );
+    }
+
+    // Build a balanced tree from scratch, discard all points in the tree.
+    template <typename T_cloud>
+    void build( const T_cloud &pts )
+    {
+        clear();
+        m_rebuild_pts.assign( pts.begin(), pts.end() );
+        m_root = build_subtree( m_rebuild_pts.begin(), m_rebuild_pts.end() );
+    }
+
+    // Insert points. If downsample_resolution > 0, a point is skipped when its nearest
+    // point in the tree lies in the same voxel of this resolution.
+    template <typename T_cloud>
+    int add_points( const T_cloud &pts, float downsample_resolution = 0 )
+    {
+        int                  add_num = 0;
+        std::vector<T_point> nearest_pts;
+        std::vector<float>   nearest_sq_dis;
+        float                voxel_diag_sq = 3 * downsample_resolution * downsample_resolution;
+        for ( typename T_cloud::const_iterator it = pts.begin(); it != pts.end(); it++ )
+        {
+            if ( downsample_resolution > 0 )
+            {
+                if ( nearest_search( *it, 1, nearest_pts, nearest_sq_dis, voxel_diag_sq ) )
+                {
+                    bool is_same_voxel = true;
+                    for ( int i = 0; i < 3; i++ )
+                    {
+                        if ( floor( get_coord( nearest_pts[ 0 ], i ) / downsample_resolution ) != floor( get_coord( *it, i ) / downsample_resolution ) )
+                        {
+                            is_same_voxel = false;
+                        }
+                    }
+                    if ( is_same_voxel )
+                    {
+                        continue;
+                    }
+                }
+            }
+
+            m_rebuild_ptr = nullptr;
+            add_point( &m_root, *it, 0 );
+            if ( m_rebuild_ptr != nullptr )
+            {
+                rebuild( m_rebuild_ptr );
+            }
+            add_num++;
+        }
+        return add_num;
+    }
+
+    // Delete the points equal to pt, return number of deleted points.
+    int delete_point( const T_point &pt )
+    {
+        float box_min[ 3 ], box_max[ 3 ];
+        for ( int i = 0; i < 3; i++ )
+        {
+            box_min[ i ] = get_coord( pt, i );
+            box_max[ i ] = nextafterf( box_min[ i ], INFINITY );
+        }
+        return delete_points_in_box( box_min, box_max );
+    }
+
+    // Delete all points inside box [box_min, box_max), return number of deleted points.
+    int delete_points_in_box( const float *box_min, const float *box_max )
+    {
+        int delete_num = delete_box( &m_root, box_min, box_max );
+        if ( m_root != nullptr && is_need_rebuild( m_root ) )
+        {
+            rebuild( &m_root );
+        }
+        return delete_num;
+    }
+
+    // Same output layout as pcl::KdTreeFLANN::nearestKSearch, points are sorted by distance.
+    int nearest_search( const T_point &pt, int k, std::vector<T_point> &nearest_pts, std::vector<float> &nearest_sq_dis,
+                        float max_sq_dis = std::numeric_limits<float>::max() ) const
+    {
+        Knn_heap heap;
+        search( m_root, pt, k, max_sq_dis, heap );
+        int found_num = heap.size();
+        nearest_pts.resize( found_num );
+        nearest_sq_dis.resize( found_num );
+        for ( int i = found_num - 1; i >= 0; i-- )
+        {
+            nearest_pts[ i ] = heap.top().second->m_point;
+            nearest_sq_dis[ i ] = heap.top().first;
+            heap.pop();
+        }
+        return found_num;
+    }
+};
+
+#endif
@@ -58,6 +58,7 @@
 #include "tools/common.h"
 //#include "tools/angle.h"
 #include "tools/logger.hpp"
+#include "tools/point_cloud2_view.hpp"
 
 using std::atan2;
 using std::cos;
@@ -118,9 +119,8 @@ class Laser_feature
     pcl::VoxelGrid<PointType> m_voxel_filter_for_corner;
 
 
-    int                       init_ros_env()
+    int                       init_ros_env( ros::NodeHandle &nh )
     {
-        ros::NodeHandle nh;
         m_init_timestamp = ros::Time::now();
         //init_livox_lidar_para();
         init_zvision_lidar_para();
@@ -189,11 +189,23 @@ class Laser_feature
     }
 
     ~Laser_feature(){};
-    Laser_feature()
+    // nh is the node handle of the nodelet when running in a nodelet manager
+    Laser_feature( ros::NodeHandle nh = ros::NodeHandle() )
     {
-        init_ros_env();
+        init_ros_env( nh );
     };
 
+    // Published by pointer, so that subscribers in the same process ( e.g. Laser_mapping_nodelet ) get it without serialization.
+    // The message must not be changed after publishing.
+    void publish_feature_cloud( ros::Publisher &pub, const pcl::PointCloud<PointType> &cloud, const ros::Time &stamp )
+    {
+        sensor_msgs::PointCloud2Ptr msg( new sensor_msgs::PointCloud2() );
+        pcl::toROSMsg( cloud, *msg );
+        msg->header.stamp = stamp;
+        msg->header.frame_id = "/camera_init";
+        pub.publish( msg );
+    }
+
     template <typename PointT>
     void removeClosedPointCloud( const pcl::PointCloud<PointT> &cloud_in,
                                  pcl::PointCloud<PointT> &cloud_out, float thres )
@@ -246,7 +258,7 @@ class Laser_feature
         std::vector<int> scanEndInd( 1000, 0 );
 
         pcl::PointCloud<pcl::PointXYZI> laserCloudIn;
-        pcl::fromROSMsg( *laserCloudMsg, laserCloudIn );
+        Common_tools::Point_cloud2_view( *laserCloudMsg ).copy_to( laserCloudIn );
         int raw_pts_num = laserCloudIn.size();
 
         m_file_logger.printf( " Time: %.5f, num_raw: %d, num_filted: %d\r\n", laserCloudMsg->header.stamp.toSec(), raw_pts_num, laserCloudIn.size() );
@@ -277,29 +289,19 @@ class Laser_feature
                 ros::Time current_time = ros::Time::now();
 
                 printf("full size: %d\n", livox_full->points.size());
-                pcl::toROSMsg( *livox_full, temp_out_msg );
-                temp_out_msg.header.stamp = current_time;
-                temp_out_msg.header.frame_id = "/camera_init";
-                m_pub_pc_livox_full.publish( temp_out_msg );
+                publish_feature_cloud( m_pub_pc_livox_full, *livox_full, current_time );
 
                 m_voxel_filter_for_surface.setInputCloud( livox_surface );
                 m_voxel_filter_for_surface.filter( *livox_surface );
-                pcl::toROSMsg( *livox_surface, temp_out_msg );
-                temp_out_msg.header.stamp = current_time;
-                temp_out_msg.header.frame_id = "/camera_init";
-                m_pub_pc_livox_surface.publish( temp_out_msg );
+                publish_feature_cloud( m_pub_pc_livox_surface, *livox_surface, current_time );
 
                 //pcl::PointCloud<PointType> corner_tmp = *livox_corners;
                 //pcl::PointCloud<PointType> corner_tmp2;
 
                 m_voxel_filter_for_corner.setInputCloud( livox_corners );
                 m_voxel_filter_for_corner.filter( *livox_corners );
-                pcl::toROSMsg( *livox_corners, temp_out_msg );
                 //m_voxel_filter_for_corner.filter( corner_tmp2 );
-
-                temp_out_msg.header.stamp = current_time;
-                temp_out_msg.header.frame_id = "/camera_init";
-                m_pub_pc_livox_corners.publish( temp_out_msg );
+                publish_feature_cloud( m_pub_pc_livox_corners, *livox_corners, current_time );
 
                 printf("cnt: %d %d %d\n", livox_corners->size(), livox_surface->size(), livox_full->size());
                 #if 0
@@ -398,24 +400,15 @@ class Laser_feature
 
                     ros::Time current_time = ros::Time::now();
 
-                    pcl::toROSMsg( *livox_full, temp_out_msg );
-                    temp_out_msg.header.stamp = current_time;
-                    temp_out_msg.header.frame_id = "/camera_init";
-                    m_pub_pc_livox_full.publish( temp_out_msg );
+                    publish_feature_cloud( m_pub_pc_livox_full, *livox_full, current_time );
 
                     m_voxel_filter_for_surface.setInputCloud( livox_surface );
                     m_voxel_filter_for_surface.filter( *livox_surface );
-                    pcl::toROSMsg( *livox_surface, temp_out_msg );
-                    temp_out_msg.header.stamp = current_time;
-                    temp_out_msg.header.frame_id = "/camera_init";
-                    m_pub_pc_livox_surface.publish( temp_out_msg );
+                    publish_feature_cloud( m_pub_pc_livox_surface, *livox_surface, current_time );
 
                     m_voxel_filter_for_corner.setInputCloud( livox_corners );
                     m_voxel_filter_for_corner.filter( *livox_corners );
-                    pcl::toROSMsg( *livox_corners, temp_out_msg );
-                    temp_out_msg.header.stamp = current_time;
-                    temp_out_msg.header.frame_id = "/camera_init";
-                    m_pub_pc_livox_corners.publish( temp_out_msg );
+                    publish_feature_cloud( m_pub_pc_livox_corners, *livox_corners, current_time );
                     if ( m_odom_mode == 0 ) // odometry mode
                     {
                         break;
@@ -0,0 +1,23 @@
+// Developer: Lin Jiarong  ziv.lin.ljr@gmail.com
+
+// Laser_feature as a nodelet. Loaded in the same manager as Laser_mapping_nodelet, the feature clouds
+// are passed to the mapping by pointer, without serialization.
+
+#include <memory>
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+
+#include "laser_feature_extractor.hpp"
+
+class Laser_feature_nodelet : public nodelet::Nodelet
+{
+  private:
+    std::unique_ptr<Laser_feature> m_laser_feature;
+
+    void onInit()
+    {
+        m_laser_feature.reset( new Laser_feature( getNodeHandle() ) );
+    }
+};
+
+PLUGINLIB_EXPORT_CLASS( Laser_feature_nodelet, nodelet::Nodelet )
@@ -45,6 +45,8 @@ int main( int argc, char **argv )
     std::thread mapping_process{ &Laser_mapping::process, &laser_mapping };
 
     ros::spin();
+    laser_mapping.stop();
+    mapping_process.join();
     return 0;
 }
 // kate: indent-mode cstyle; indent-width 4; replace-tabs on;
@@ -37,11 +37,15 @@
 #ifndef LASER_MAPPING_HPP
 #define LASER_MAPPING_HPP
 
+#include <algorithm>
+#include <atomic>
 #include <ceres/ceres.h>
 #include <eigen3/Eigen/Dense>
 #include <geometry_msgs/PoseStamped.h>
 #include <iostream>
+#include <limits>
 #include <math.h>
+#include <memory>
 #include <mutex>
 #include <nav_msgs/Odometry.h>
 #include <nav_msgs/Path.h>
@@ -56,16 +60,31 @@
 #include <ros/ros.h>
 #include <sensor_msgs/Imu.h>
 #include <sensor_msgs/PointCloud2.h>
+#include <std_srvs/Trigger.h>
 #include <string>
 #include <tf/transform_broadcaster.h>
 #include <tf/transform_datatypes.h>
 #include <thread>
+#include <unordered_set>
 #include <vector>
 
 #include "ceres_icp.hpp"
+#include "icp_correspondence.hpp"
+#include "icp_lm_solver.hpp"
+#include "icp_residual_selector.hpp"
+#include "map_file.hpp"
+#include "map_search_backend.hpp"
+#include "map_tile_store.hpp"
+#include "motion_prior.hpp"
+#include "points_cube_map.hpp"
+#include "tools/batch_transform.hpp"
+#include "tools/blocking_queue.hpp"
 #include "tools/common.h"
 #include "tools/logger.hpp"
+#include "tools/message_synchronizer.hpp"
 #include "tools/pcl_tools.hpp"
+#include "tools/point_cloud2_view.hpp"
+#include "tools/thread_pool.hpp"
 
 #define PUB_SURROUND_PTS 1
 #define PCD_SAVE_RAW 1
@@ -81,9 +100,6 @@ int g_if_undistore = 0;
 #define ICP_PLANE 1
 #define ICP_LINE 1
 int MOTION_DEBLUR = 0;
-#define CUBE_W 50.0 // 10
-#define CUBE_H 50.0 // 10
-#define CUBE_D 50.0 // 5
 
 #define BLUR_SCALE 1.0
 
@@ -91,46 +107,131 @@ int line_search_num = 5;
 int IF_LINE_FEATURE_CHECK = 1;
 int plane_search_num = 5;
 int IF_PLANE_FEATURE_CHECK = 0;
+float line_search_max_sq_dis = 2.0;   // the farthest of the line_search_num neighbours must be closer
+float plane_search_max_sq_dis = 10.0;
 
 using namespace PCL_TOOLS;
 using namespace Common_tools;
 
+// Corner, surface and full clouds of one lidar frame.
 struct Data_pair
 {
-    sensor_msgs::PointCloud2ConstPtr m_pc_corner;
-    sensor_msgs::PointCloud2ConstPtr m_pc_full;
-    sensor_msgs::PointCloud2ConstPtr m_pc_plane;
-    bool                             m_has_pc_corner = 0;
-    bool                             m_has_pc_full = 0;
-    bool                             m_has_pc_plane = 0;
-
-    void add_pc_corner( sensor_msgs::PointCloud2ConstPtr ros_pc )
+    enum
     {
-        m_pc_corner = ros_pc;
-        m_has_pc_corner = true;
+        e_pc_corner = 0,
+        e_pc_plane = 1,
+        e_pc_full = 2,
+        e_pc_num = 3,
+    };
+
+    sensor_msgs::PointCloud2ConstPtr m_pcs[ e_pc_num ];
+
+    const sensor_msgs::PointCloud2ConstPtr &pc_corner() const
+    {
+        return m_pcs[ e_pc_corner ];
     }
 
-    void add_pc_plane( sensor_msgs::PointCloud2ConstPtr ros_pc )
+    const sensor_msgs::PointCloud2ConstPtr &pc_plane() const
     {
-        m_pc_plane = ros_pc;
-        m_has_pc_plane = true;
+        return m_pcs[ e_pc_plane ];
     }
 
-    void add_pc_full( sensor_msgs::PointCloud2ConstPtr ros_pc )
+    const sensor_msgs::PointCloud2ConstPtr &pc_full() const
+    {
+        return m_pcs[ e_pc_full ];
+    }
+};
+
+// Output of the decode stage of Laser_mapping::process().
+struct Mapping_frame
+{
+    double                           m_time_stamp = 0;
+    float                            m_max_intensity = 0;
+    size_t                           m_drop_num = 0; // frames dropped before this one
+    pcl::PointCloud<PointType>::Ptr  m_corner;
+    pcl::PointCloud<PointType>::Ptr  m_surface;
+    sensor_msgs::PointCloud2ConstPtr m_full_msg; // converted by registration only when it is published or saved
+    pcl::PointCloud<PointType>::Ptr  m_corner_stack; // down sampled m_corner and m_surface
+    pcl::PointCloud<PointType>::Ptr  m_surface_stack;
+
+    Mapping_frame() : m_corner( new pcl::PointCloud<PointType>() ),
+                      m_surface( new pcl::PointCloud<PointType>() ),
+                      m_corner_stack( new pcl::PointCloud<PointType>() ),
+                      m_surface_stack( new pcl::PointCloud<PointType>() ){};
+};
+
+// Input of the publish stage of Laser_mapping::process(), points are in the map frame.
+// Clouds are snapshots which are not changed after being queued, nullptr if not published in this frame.
+struct Publish_frame
+{
+    double                               m_time_stamp = 0;
+    nav_msgs::Odometry                   m_odom;
+    pcl::PointCloud<PointType>::ConstPtr m_corner;
+    pcl::PointCloud<PointType>::ConstPtr m_surface;
+    pcl::PointCloud<PointType>::ConstPtr m_full; // deskewed, not down sampled yet
+    pcl::PointCloud<PointType>::ConstPtr m_surround;
+    pcl::PointCloud<PointType>::ConstPtr m_map;
+    bool                                 m_if_publish_full = false; // m_full and m_surround may be only for pcd files
+    bool                                 m_if_publish_surround = false;
+};
+
+// Map publishing by cubes, see Laser_mapping::cubes_to_ros_msg, and map saving.
+// Unlike Publish_frame it is never dropped: the cube versions are marked as published when it is queued.
+struct Publish_map_frame
+{
+    struct Cube_snapshot
+    {
+        Points_cube_map::Cube_id             m_id;
+        int                                  m_version;
+        pcl::PointCloud<PointType>::ConstPtr m_pts; // corner and surface points
+    };
+    double                                m_time_stamp = 0;
+    std::vector<Cube_snapshot>            m_map_delta; // cubes changed since last delta publishing
+    std::vector<Points_cube_map::Cube_id> m_map_removed_ids;
+    bool                                  m_if_map_delta = false;
+    std::vector<Cube_snapshot>            m_map_snapshot; // all cubes, requested by the snapshot service
+    bool                                  m_if_map_snapshot = false;
+
+    // Requested by the save map service, see Laser_mapping::save_map
+    std::vector<Map_file::Tile>           m_save_tiles; // cubes in memory
+    std::vector<Points_cube_map::Cube_id> m_save_on_disk_ids; // cubes only in the files of Map_tile_store
+    bool                                  m_if_save_map = false;
+};
+
+// A publisher whose message is only built when somebody subscribes, at most m_max_rate times per second.
+struct Rate_limited_publisher
+{
+    ros::Publisher m_publisher;
+    double         m_max_rate = 0; // Hz, 0 for no limit
+    double         m_last_time = -1e10;
+
+    // Return true if a message should be built and published at time, the time is then recorded.
+    bool is_due( double time )
     {
-        m_pc_full = ros_pc;
-        m_has_pc_full = true;
+        if ( m_publisher.getNumSubscribers() == 0 )
+        {
+            return false;
+        }
+        if ( m_max_rate > 0 && time - m_last_time < 1.0 / m_max_rate )
+        {
+            return false;
+        }
+        m_last_time = time;
+        return true;
     }
 
-    bool is_completed()
+    template <typename T_msg>
+    void publish( const T_msg &msg ) const
     {
-        return ( m_has_pc_corner & m_has_pc_full & m_has_pc_plane );
+        m_publisher.publish( msg );
     }
 };
 
 class Laser_mapping
 {
   public:
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW // allocated on heap by Laser_mapping_nodelet
+
     int frameCount = 0;
     int m_para_min_match_blur = 0.0;
     int m_para_max_match_blur = 0.3;
@@ -138,6 +239,28 @@ class Laser_mapping
     int   m_max_buffer_size = 50000000;
     int   m_para_icp_max_iterations = 20;
     int   m_para_cere_max_iterations = 100;
+    int   m_para_if_analytic_jacobian = 1;       // 1: analytic jacobian, 0: ceres autodiff
+    int   m_para_if_check_analytic_jacobian = 0; // compare analytic jacobian with autodiff and log the error
+    int   m_para_icp_solver_type = 0;            // 0: ceres, 1: Icp_lm_solver
+    float m_para_icp_reassociate_distance = 0.05; // search map again only if a point moved farther than this, 0 to disable
+    // ICP stops before icp_maximum_iteration when less than this ratio of correspondences changed, and either the pose
+    // moved less than both translation and rotation thresholds, or the cost decreased less than the ratio.
+    int    m_para_icp_if_early_termination = 1;
+    int    m_para_icp_min_iterations = 2;
+    float  m_para_icp_converge_translation = 0.001; // in meter
+    float  m_para_icp_converge_rotation = 0.01;     // in degree
+    float  m_para_icp_converge_cost_ratio = 0.001;
+    float  m_para_icp_converge_correspondence_change = 0.02;
+    double m_para_solver_function_tolerance = 1e-6; // of every ceres::Solve and Icp_lm_solver::solve, the same as ceres default
+    double m_para_solver_parameter_tolerance = 1e-8;
+    int    m_icp_solver_iteration_num = 0; // of current frame
+
+    // caps the number of residuals of every ICP iteration, see Icp_residual_selector
+    Icp_residual_selector m_icp_residual_selector;
+    int   m_para_map_publish_mode = 0;            // 0: whole map on /laser_cloud_map, 1: changed cubes on /laser_cloud_map_delta
+    int   m_para_if_voxel_primitive = 0;         // associate with lines/planes cached in map voxels instead of kNN
+    int   m_para_primitive_min_point_num = 5;
+    float m_para_primitive_min_quality = 0.667;   // 1 - second largest / largest eigen value, 0.667 is the 3 times check of kNN
     float m_para_max_angular_rate = 200.0 / 50.0; // max angular rate = 90.0 /50.0 deg/s
     float m_para_max_speed = 100.0 / 50.0;        // max speed = 10 m/s
     float m_max_final_cost = 100.0;
@@ -145,15 +268,6 @@ class Laser_mapping
     int   m_kmean_filter_count = 3;
     int   m_kmean_filter_threshold = 2.0;
 
-    int m_para_laser_cloud_center_width = CUBE_W;
-    int m_para_laser_cloud_center_height = CUBE_H;
-    int m_para_laser_cloud_center_depth = CUBE_D;
-    int m_para_laser_cloud_width = CUBE_W * 2 + 1;
-    int m_para_laser_cloud_height = CUBE_H * 2 + 1;
-    int m_para_laser_cloud_depth = CUBE_D * 2 + 1;
-
-    int m_laser_cloud_num = m_para_laser_cloud_width * m_para_laser_cloud_height * m_para_laser_cloud_depth;
-
     double m_time_pc_corner_past = 0;
     double m_time_pc_surface_past = 0;
     double m_time_pc_full = 0;
@@ -164,23 +278,24 @@ class Laser_mapping
     float  m_last_max_blur = 0.0;
 
     double m_map_downsample_para = 0.5;
+    float  m_line_resolution = 0.4;
+    float  m_plane_resolution = 0.8;
+    int    m_para_map_search_backend = Map_search_backend::e_incremental_kdtree; // Map_search_backend::Backend_type
+    float  m_para_map_search_voxel_size = 1.0;                                  // voxel size of the voxel hash backend
 
     double m_interpolatation_theta;
     Eigen::Matrix<double, 3, 1> m_interpolatation_omega;
     Eigen::Matrix<double, 3, 3> m_interpolatation_omega_hat;
     Eigen::Matrix<double, 3, 3> m_interpolatation_omega_hat_sq2;
 
-    // points in every cube
-    pcl::PointCloud<PointType>::Ptr *m_laser_cloud_corner_array;
-    pcl::PointCloud<PointType>::Ptr *m_laser_cloud_surface_array;
+    // points in every cube, cubes are allocated on demand
+    Points_cube_map m_cube_map;
+    // cubes far from the sensor, paged out to disk, nullptr if disabled
+    std::unique_ptr<Map_tile_store> m_map_tile_store;
 
     // ouput: all visualble cube points
     pcl::PointCloud<PointType>::Ptr m_laser_cloud_surround;
 
-    // surround points in map to build tree
-    pcl::PointCloud<PointType>::Ptr m_laser_cloud_corner_from_map;
-    pcl::PointCloud<PointType>::Ptr m_laser_cloud_surf_from_map;
-
     //input & output: points in one frame. local --> global
     pcl::PointCloud<PointType>::Ptr m_laser_cloud_full_res;
 
@@ -188,12 +303,11 @@ class Laser_mapping
     pcl::PointCloud<PointType>::Ptr m_laser_cloud_corner_last;
     pcl::PointCloud<PointType>::Ptr m_laser_cloud_surf_last;
 
-    //kd-tree
-    pcl::KdTreeFLANN<PointType>::Ptr m_kdtree_corner_from_map;
-    pcl::KdTreeFLANN<PointType>::Ptr m_kdtree_surf_from_map;
+    // nearest neighbour search over the points of the cubes around the sensor
+    std::unique_ptr<Map_search_backend> m_map_search_backend;
 
-    int m_laser_cloud_valid_Idx[ 1024 ];
-    int m_laser_cloud_surround_Idx[ 1024 ];
+    Points_cube_map::Cube_id m_laser_cloud_valid_Idx[ 1024 ];
+    Points_cube_map::Cube_id m_laser_cloud_surround_Idx[ 1024 ];
 
     double m_para_buffer_RT[ 7 ] = { 0, 0, 0, 1, 0, 0, 0 };
     double m_para_buffer_RT_last[ 7 ] = { 0, 0, 0, 1, 0, 0, 0 };
@@ -209,9 +323,20 @@ class Laser_mapping
 
     Eigen::Map<Eigen::Quaterniond> m_q_w_incre = Eigen::Map<Eigen::Quaterniond>( m_para_buffer_incremental );
     Eigen::Map<Eigen::Vector3d>    m_t_w_incre = Eigen::Map<Eigen::Vector3d>( m_para_buffer_incremental + 4 );
+    Eigen::Vector3d                m_t_w_incre_prior = Eigen::Vector3d::Zero(); // center of the bound of m_t_w_incre
+
+    // initial guess of m_q_w_incre and m_t_w_incre
+    Motion_prior m_motion_prior;
+    int          m_para_if_motion_prior = 1;
 
-    std::map<double, Data_pair *> m_map_data_pair;
-    std::queue<Data_pair *> m_queue_avail_data;
+    // Clouds of the same frame are grouped by m_data_pair_sync under m_mutex_buf, completed frames
+    // are passed to process() by m_queue_avail_data.
+    Message_synchronizer<sensor_msgs::PointCloud2ConstPtr, Data_pair::e_pc_num> m_data_pair_sync;
+    Blocking_queue<Data_pair>                                                   m_queue_avail_data;
+    Blocking_queue<Mapping_frame>                                               m_queue_decoded_frame{ 2 }; // decode -> registration
+    Blocking_queue<Publish_frame>                                               m_queue_publish_frame{ 2 }; // registration -> publish
+    Blocking_queue<Publish_map_frame>                                           m_queue_publish_map{ 1 << 20 }; // never dropped, just a bound of the memory
+    size_t                                                                      m_drop_frame_num = 0; // completed frames dropped by m_queue_avail_data
 
     std::queue<nav_msgs::Odometry::ConstPtr> m_odom_que;
     std::mutex                               m_mutex_buf;
@@ -220,10 +345,39 @@ class Laser_mapping
     pcl::VoxelGrid<PointType>                 m_down_sample_filter_surface;
     pcl::StatisticalOutlierRemoval<PointType> m_filter_k_means;
 
-    std::vector<int>   m_point_search_Idx;
-    std::vector<float> m_point_search_sq_dis;
+    // Per thread memory of correspondence search.
+    struct Map_search_buffer
+    {
+        std::vector<PointType>         m_pts;
+        std::vector<float>             m_sq_dis;
+        Map_search_backend::Search_buffer m_backend_buffer;
+        Icp_correspondence_vec         m_correspondences;
+        int                            m_rejection_num = 0;
+        int                            m_search_num = 0; // points associated again, not from cache
+        int                            m_change_num = 0; // points associated again, to another target or state
+    };
+
+    int                            m_para_thread_num = 4;
+    Thread_pool                    m_thread_pool;
+    std::vector<Map_search_buffer> m_search_buffers; // one for each block of m_thread_pool
+    Icp_correspondence_vec         m_icp_correspondences;
+    Icp_correspondence_cache_vec   m_corner_correspondence_caches; // one for each feature point of current frame
+    Icp_correspondence_cache_vec   m_surface_correspondence_caches;
+
+    Batch_transform m_batch_transform; // used by pointcloudAssociateToMap
+    Points_soa      m_batch_points;
+    Icp_lm_solver                  m_icp_lm_solver;
 
-    nav_msgs::Path m_laser_after_mapped_path;
+    // ceres problem reused across ICP iterations and frames, owns nothing, see update_ceres_problem()
+    std::unique_ptr<ceres::LossFunction>                          m_ceres_loss_function;
+    std::unique_ptr<ceres::LocalParameterization>                 m_ceres_q_parameterization;
+    std::vector<std::unique_ptr<ceres_icp_pooled_cost_function>> m_ceres_cost_pool;
+    std::vector<ceres::ResidualBlockId>                           m_ceres_residual_block_ids; // one for each of m_ceres_cost_pool
+    std::unique_ptr<ceres::Problem>                               m_ceres_problem;
+
+    nav_msgs::Path                          m_laser_after_mapped_path; // owned by publish_process
+    std::vector<geometry_msgs::PoseStamped> m_path_poses_to_publish;   // new poses, from process to publish_process
+    std::mutex                              m_mutex_path;
 
     int       m_if_save_to_pcd_files = 1;
     PCL_tools m_pcl_tools_aftmap;
@@ -231,52 +385,62 @@ class Laser_mapping
 
     File_logger m_file_logger;
 
-    ros::Publisher  m_pub_laser_cloud_surround, m_pub_laser_cloud_map, m_pub_laser_cloud_full_res, m_pub_odom_aft_mapped, m_pub_odom_aft_mapped_hight_frec, m_pub_laser_aft_mapped_path;
+    ros::Publisher  m_pub_odom_aft_mapped, m_pub_odom_aft_mapped_hight_frec;
+    // is_due() of the cloud publishers is called by process(), of the path publisher by publish_process().
+    Rate_limited_publisher m_pub_laser_cloud_surround, m_pub_laser_cloud_map, m_pub_laser_cloud_full_res, m_pub_laser_aft_mapped_path;
+    Rate_limited_publisher m_pub_laser_cloud_map_delta;
+    ros::Publisher         m_pub_laser_cloud_map_snapshot; // latched
+    ros::ServiceServer     m_srv_map_snapshot;
+    std::atomic<bool>      m_if_request_map_snapshot{ false };
+    ros::ServiceServer     m_srv_save_map;
+    std::atomic<bool>      m_if_request_save_map{ false };
+    std::string            m_para_map_load_file; // prior map loaded at startup, see Map_file
+    std::string            m_para_map_save_file;
+    int                    m_para_if_save_map_on_shutdown = 0;
     ros::NodeHandle m_ros_node_handle;
     ros::Subscriber m_sub_laser_cloud_corner_last, m_sub_laser_cloud_surf_last, m_sub_laser_odom, m_sub_laser_cloud_full_res;
+    ros::Subscriber m_sub_imu;
 #if PUB_DEBUG_INFO
-    ros::Publisher m_pub_last_corner_pts, m_pub_last_surface_pts;
+    Rate_limited_publisher m_pub_last_corner_pts, m_pub_last_surface_pts;
 #endif
 
-    Laser_mapping()
+    // nh is the node handle of the nodelet when running in a nodelet manager
+    Laser_mapping( ros::NodeHandle nh = ros::NodeHandle() ) : m_ros_node_handle( nh )
     {
-        m_laser_cloud_corner_array = new pcl::PointCloud<PointType>::Ptr[ m_laser_cloud_num ];
-        m_laser_cloud_surface_array = new pcl::PointCloud<PointType>::Ptr[ m_laser_cloud_num ];
-
         m_laser_cloud_corner_last = pcl::PointCloud<PointType>::Ptr( new pcl::PointCloud<PointType>() );
         m_laser_cloud_surf_last = pcl::PointCloud<PointType>::Ptr( new pcl::PointCloud<PointType>() );
         m_laser_cloud_surround = pcl::PointCloud<PointType>::Ptr( new pcl::PointCloud<PointType>() );
 
-        m_laser_cloud_corner_from_map = pcl::PointCloud<PointType>::Ptr( new pcl::PointCloud<PointType>() );
-        m_laser_cloud_surf_from_map = pcl::PointCloud<PointType>::Ptr( new pcl::PointCloud<PointType>() );
         m_laser_cloud_full_res = pcl::PointCloud<PointType>::Ptr( new pcl::PointCloud<PointType>() );
 
-        m_kdtree_corner_from_map = pcl::KdTreeFLANN<PointType>::Ptr( new pcl::KdTreeFLANN<PointType>() );
-        m_kdtree_surf_from_map = pcl::KdTreeFLANN<PointType>::Ptr( new pcl::KdTreeFLANN<PointType>() );
-
-        for ( int i = 0; i < m_laser_cloud_num; i++ )
-        {
-            m_laser_cloud_corner_array[ i ].reset( new pcl::PointCloud<PointType>() );
-            m_laser_cloud_surface_array[ i ].reset( new pcl::PointCloud<PointType>() );
-        }
-
         init_parameters( m_ros_node_handle );
+        load_map();
 
         //livox_corners
         m_sub_laser_cloud_corner_last = m_ros_node_handle.subscribe<sensor_msgs::PointCloud2>( "/pc2_corners", 10000, &Laser_mapping::laserCloudCornerLastHandler, this );
         m_sub_laser_cloud_surf_last = m_ros_node_handle.subscribe<sensor_msgs::PointCloud2>( "/pc2_surface", 10000, &Laser_mapping::laserCloudSurfLastHandler, this );
         m_sub_laser_cloud_full_res = m_ros_node_handle.subscribe<sensor_msgs::PointCloud2>( "/pc2_full", 10000, &Laser_mapping::laserCloudFullResHandler, this );
+        std::string imu_topic;
+        m_ros_node_handle.param<std::string>( "imu_topic", imu_topic, std::string( "" ) );
+        if ( m_para_if_motion_prior && !imu_topic.empty() )
+        {
+            m_sub_imu = m_ros_node_handle.subscribe<sensor_msgs::Imu>( imu_topic, 10000, &Laser_mapping::imuHandler, this );
+        }
 
-        m_pub_laser_cloud_surround = m_ros_node_handle.advertise<sensor_msgs::PointCloud2>( "/laser_cloud_surround", 10000 );
+        m_pub_laser_cloud_surround.m_publisher = m_ros_node_handle.advertise<sensor_msgs::PointCloud2>( "/laser_cloud_surround", 10000 );
 #if PUB_DEBUG_INFO
-        m_pub_last_corner_pts = m_ros_node_handle.advertise<sensor_msgs::PointCloud2>( "/features_corners", 10000 );
-        m_pub_last_surface_pts = m_ros_node_handle.advertise<sensor_msgs::PointCloud2>( "/features_surface", 10000 );
+        m_pub_last_corner_pts.m_publisher = m_ros_node_handle.advertise<sensor_msgs::PointCloud2>( "/features_corners", 10000 );
+        m_pub_last_surface_pts.m_publisher = m_ros_node_handle.advertise<sensor_msgs::PointCloud2>( "/features_surface", 10000 );
 #endif
-        m_pub_laser_cloud_map = m_ros_node_handle.advertise<sensor_msgs::PointCloud2>( "/laser_cloud_map", 10000 );
-        m_pub_laser_cloud_full_res = m_ros_node_handle.advertise<sensor_msgs::PointCloud2>( "/velodyne_cloud_registered", 10000 );
+        m_pub_laser_cloud_map.m_publisher = m_ros_node_handle.advertise<sensor_msgs::PointCloud2>( "/laser_cloud_map", 10000 );
+        m_pub_laser_cloud_full_res.m_publisher = m_ros_node_handle.advertise<sensor_msgs::PointCloud2>( "/velodyne_cloud_registered", 10000 );
         m_pub_odom_aft_mapped = m_ros_node_handle.advertise<nav_msgs::Odometry>( "/aft_mapped_to_init", 10000 );
         m_pub_odom_aft_mapped_hight_frec = m_ros_node_handle.advertise<nav_msgs::Odometry>( "/aft_mapped_to_init_high_frec", 10000 );
-        m_pub_laser_aft_mapped_path = m_ros_node_handle.advertise<nav_msgs::Path>( "/aft_mapped_path", 10000 );
+        m_pub_laser_aft_mapped_path.m_publisher = m_ros_node_handle.advertise<nav_msgs::Path>( "/aft_mapped_path", 10000 );
+        m_pub_laser_cloud_map_delta.m_publisher = m_ros_node_handle.advertise<sensor_msgs::PointCloud2>( "/laser_cloud_map_delta", 10000 );
+        m_pub_laser_cloud_map_snapshot = m_ros_node_handle.advertise<sensor_msgs::PointCloud2>( "/laser_cloud_map_snapshot", 1, true );
+        m_srv_map_snapshot = m_ros_node_handle.advertiseService( "/request_map_snapshot", &Laser_mapping::map_snapshot_service, this );
+        m_srv_save_map = m_ros_node_handle.advertiseService( "/save_map", &Laser_mapping::save_map_service, this );
 
         cout << "Laser_mapping init OK" << endl;
     };
@@ -298,31 +462,54 @@ class Laser_mapping
         hat( 2, 1 ) = angle_axis( 0 );
     }
 
-    Data_pair *get_data_pair( const double &time_stamp )
+    void add_frame_cloud( int pc_type, const sensor_msgs::PointCloud2ConstPtr &ros_pc )
     {
-        std::map<double, Data_pair *>::iterator it = m_map_data_pair.find( time_stamp );
-        if ( it == m_map_data_pair.end() )
+        Data_pair data_pair;
+        bool      if_completed;
+        bool      if_time_jump;
         {
-            Data_pair *date_pair_ptr = new Data_pair();
-            m_map_data_pair.insert( std::make_pair( time_stamp, date_pair_ptr ) );
-            return date_pair_ptr;
+            std::unique_lock<std::mutex> lock( m_mutex_buf );
+            size_t time_jump_num = m_data_pair_sync.m_time_jump_num;
+            if_completed = m_data_pair_sync.add( pc_type, ros_pc->header.stamp.toSec(), ros_pc, data_pair.m_pcs );
+            if_time_jump = m_data_pair_sync.m_time_jump_num != time_jump_num;
         }
-        else
+        if ( if_time_jump )
+        {
+            ROS_WARN( "Lidar time stamp jumped backwards, pending frames are dropped" );
+        }
+        if ( if_completed )
         {
-            return it->second;
+            m_queue_avail_data.push( data_pair );
         }
     }
 
     void init_parameters( ros::NodeHandle &nh )
     {
 
-        float lineRes = 0;
-        float planeRes = 0;
+        float &lineRes = m_line_resolution;
+        float &planeRes = m_plane_resolution;
 
         nh.param<float>( "mapping_line_resolution", lineRes, 0.4 );
         nh.param<float>( "mapping_plane_resolution", planeRes, 0.8 );
         nh.param<int>( "icp_maximum_iteration", m_para_icp_max_iterations, 20 );
         nh.param<int>( "ceres_maximum_iteration", m_para_cere_max_iterations, 20 );
+        nh.param<int>( "if_analytic_jacobian", m_para_if_analytic_jacobian, 1 );
+        nh.param<int>( "if_check_analytic_jacobian", m_para_if_check_analytic_jacobian, 0 );
+        nh.param<int>( "icp_solver_type", m_para_icp_solver_type, 0 );
+        nh.param<float>( "icp_reassociate_distance", m_para_icp_reassociate_distance, 0.05 );
+        nh.param<int>( "icp_if_early_termination", m_para_icp_if_early_termination, 1 );
+        nh.param<int>( "icp_minimum_iteration", m_para_icp_min_iterations, 2 );
+        nh.param<float>( "icp_converge_translation", m_para_icp_converge_translation, 0.001 );
+        nh.param<float>( "icp_converge_rotation", m_para_icp_converge_rotation, 0.01 );
+        nh.param<float>( "icp_converge_cost_ratio", m_para_icp_converge_cost_ratio, 0.001 );
+        nh.param<float>( "icp_converge_correspondence_change", m_para_icp_converge_correspondence_change, 0.02 );
+        nh.param<double>( "solver_function_tolerance", m_para_solver_function_tolerance, 1e-6 );
+        nh.param<double>( "solver_parameter_tolerance", m_para_solver_parameter_tolerance, 1e-8 );
+        nh.param<int>( "icp_max_residual_num", m_icp_residual_selector.m_max_residual_num, 0 );
+        nh.param<int>( "if_voxel_primitive_association", m_para_if_voxel_primitive, 0 );
+        nh.param<int>( "voxel_primitive_min_point_num", m_para_primitive_min_point_num, 5 );
+        nh.param<float>( "voxel_primitive_min_quality", m_para_primitive_min_quality, 0.667 );
+        nh.param<int>( "if_motion_prior", m_para_if_motion_prior, 1 );
         nh.param<int>( "if_motion_deblur", MOTION_DEBLUR, 1 );
 
         //MOTION_DEBLUR = 1;
@@ -330,9 +517,63 @@ class Laser_mapping
         nh.param<float>( "max_allow_incre_T", m_para_max_speed, 100.0 / 50.0 );
         nh.param<float>( "max_allow_final_cost", m_max_final_cost, 1.0 );
         nh.param<int>( "maximum_mapping_buffer", m_max_buffer_size, 5 );
+        // Same as the old drop policy: at most m_max_buffer_size - 1 frames wait for mapping.
+        m_queue_avail_data.set_capacity( std::max( m_max_buffer_size - 1, 1 ) );
+        nh.param<double>( "publish_max_rate_features", m_pub_last_corner_pts.m_max_rate, 0 );
+        m_pub_last_surface_pts.m_max_rate = m_pub_last_corner_pts.m_max_rate;
+        nh.param<double>( "publish_max_rate_registered_cloud", m_pub_laser_cloud_full_res.m_max_rate, 0 );
+        nh.param<double>( "publish_max_rate_surround", m_pub_laser_cloud_surround.m_max_rate, 0 );
+        nh.param<double>( "publish_max_rate_map", m_pub_laser_cloud_map.m_max_rate, 0 );
+        nh.param<double>( "publish_max_rate_path", m_pub_laser_aft_mapped_path.m_max_rate, 0 );
+        nh.param<int>( "map_publish_mode", m_para_map_publish_mode, 0 );
+        m_cube_map.m_if_track_removed_cubes = ( m_para_map_publish_mode == 1 );
+        int sync_slot_num = 10;
+        nh.param<int>( "sync_slot_num", sync_slot_num, 10 );
+        nh.param<double>( "sync_time_tolerance", m_data_pair_sync.m_time_tolerance, 1e-3 );
+        nh.param<double>( "sync_max_delay", m_data_pair_sync.m_max_delay, 1.0 );
+        m_data_pair_sync.set_slot_num( sync_slot_num );
         nh.param<int>( "mapping_init_accumulate_frames", m_mapping_init_accumulate_frames, 50 );//old is 50
         nh.param<double>( "mapping_downsample_para", m_map_downsample_para, 0.5 );//old is 50
 
+        double cube_w, cube_h, cube_d;
+        int    cube_half_width, cube_half_height, cube_half_depth;
+        nh.param<double>( "mapping_cube_width", cube_w, 50.0 );
+        nh.param<double>( "mapping_cube_height", cube_h, 50.0 );
+        nh.param<double>( "mapping_cube_depth", cube_d, 50.0 );
+        nh.param<int>( "mapping_cube_half_num_width", cube_half_width, 50 );
+        nh.param<int>( "mapping_cube_half_num_height", cube_half_height, 50 );
+        nh.param<int>( "mapping_cube_half_num_depth", cube_half_depth, 50 );
+        m_cube_map.init( cube_w, cube_h, cube_d, cube_half_width, cube_half_height, cube_half_depth );
+        nh.param<double>( "mapping_primitive_voxel_size", m_cube_map.m_primitive_voxel_size, 1.0 );
+        nh.param<std::string>( "map_load_file", m_para_map_load_file, std::string( "" ) );
+        nh.param<std::string>( "map_save_file", m_para_map_save_file, std::string( "" ) );
+        nh.param<int>( "if_save_map_on_shutdown", m_para_if_save_map_on_shutdown, 0 );
+        double map_paging_distance, map_prefetch_distance;
+        nh.param<double>( "map_paging_distance", map_paging_distance, 0 ); // in meter, 0 to keep all cubes of the grid in memory
+        nh.param<double>( "map_prefetch_distance", map_prefetch_distance, 0.75 * map_paging_distance );
+        if ( map_paging_distance > 0 )
+        {
+            std::string map_paging_dir;
+            nh.param<std::string>( "map_paging_dir", map_paging_dir, std::string( "./map_tiles/" ) );
+            m_map_tile_store.reset( new Map_tile_store() );
+            nh.param<int>( "map_prefetch_frames", m_map_tile_store->m_prefetch_frames, 20 );
+            m_map_tile_store->m_line_resolution = m_line_resolution;
+            m_map_tile_store->m_plane_resolution = m_plane_resolution;
+            m_map_tile_store->m_if_primitive = m_para_if_voxel_primitive;
+            m_map_tile_store->init( map_paging_dir, m_cube_map, map_paging_distance, map_prefetch_distance );
+        }
+        int if_incremental_kdtree = 1;
+        nh.param<int>( "if_incremental_kdtree", if_incremental_kdtree, 1 );
+        nh.param<int>( "map_search_backend", m_para_map_search_backend,
+                       if_incremental_kdtree ? Map_search_backend::e_incremental_kdtree : Map_search_backend::e_cube_flann );
+        nh.param<float>( "map_search_voxel_size", m_para_map_search_voxel_size, 1.0 );
+        float search_max_sq_dis[ 2 ] = { plane_search_max_sq_dis, line_search_max_sq_dis };
+        m_map_search_backend.reset( Map_search_backend::create( m_para_map_search_backend, m_para_map_search_voxel_size, search_max_sq_dis ) );
+        nh.param<int>( "mapping_thread_num", m_para_thread_num, 4 );
+        m_para_thread_num = std::max( m_para_thread_num, 1 );
+        m_thread_pool.init( m_para_thread_num );
+        m_search_buffers.resize( m_thread_pool.get_thread_num() );
+
         string pcd_save_dir_name;
         nh.param<int>( "if_save_to_pcd_files", m_if_save_to_pcd_files, 0 );
 
@@ -365,8 +606,8 @@ class Laser_mapping
         for ( unsigned int i = 0; i < 3; i++ )
         {
 
-            problem.SetParameterLowerBound( m_para_buffer_incremental + 4, i, -m_para_max_speed );
-            problem.SetParameterUpperBound( m_para_buffer_incremental + 4, i, +m_para_max_speed );
+            problem.SetParameterLowerBound( m_para_buffer_incremental + 4, i, m_t_w_incre_prior( i ) - m_para_max_speed );
+            problem.SetParameterUpperBound( m_para_buffer_incremental + 4, i, m_t_w_incre_prior( i ) + m_para_max_speed );
         }
     }
 
@@ -426,15 +667,29 @@ class Laser_mapping
         po->intensity = pi->intensity;
     }
 
+    // Batch version of pointAssociateToMap, pc_in and pt_out can be the same cloud.
+    // With deblur, a point with interpolate_s == 1.0 goes through the interpolation too, which is the current pose when BLUR_SCALE is 1.
     unsigned int pointcloudAssociateToMap( pcl::PointCloud<PointType> const &pc_in, pcl::PointCloud<PointType> &pt_out, int if_undistore = 0 )
     {
         unsigned int points_size = pc_in.points.size();
-        pt_out.points.resize( points_size );
+        if ( &pt_out != &pc_in )
+        {
+            pt_out.points = pc_in.points;
+        }
 
-        for ( unsigned int i = 0; i < points_size; i++ )
+        if ( MOTION_DEBLUR == 0 || if_undistore == 0 )
+        {
+            m_batch_transform.set_rigid( m_q_w_curr.toRotationMatrix(), m_t_w_curr );
+        }
+        else
         {
-            pointAssociateToMap( &pc_in.points[ i ], &pt_out.points[ i ], pc_in.points[ i ].intensity, if_undistore );
+            m_batch_transform.set_interpolated( m_q_w_last.toRotationMatrix(), m_t_w_last,
+                                                m_interpolatation_omega_hat, m_interpolatation_omega_hat_sq2, m_interpolatation_theta,
+                                                m_t_w_incre * BLUR_SCALE );
         }
+        m_batch_points.from_cloud( pc_in );
+        m_batch_transform.apply( m_batch_points, m_batch_points );
+        m_batch_points.to_cloud( pt_out );
 
         return points_size;
     }
@@ -454,38 +709,26 @@ class Laser_mapping
 
     void laserCloudCornerLastHandler( const sensor_msgs::PointCloud2ConstPtr &laserCloudCornerLast2 )
     {
-        std::unique_lock<std::mutex> lock( m_mutex_buf );
-        Data_pair *                  data_pair = get_data_pair( laserCloudCornerLast2->header.stamp.toSec() );
-        data_pair->add_pc_corner( laserCloudCornerLast2 );
-        if ( data_pair->is_completed() )
-        {
-            m_queue_avail_data.push( data_pair );
-        }
+        add_frame_cloud( Data_pair::e_pc_corner, laserCloudCornerLast2 );
     }
 
     void laserCloudSurfLastHandler( const sensor_msgs::PointCloud2ConstPtr &laserCloudSurfLast2 )
     {
-        std::unique_lock<std::mutex> lock( m_mutex_buf );
-        Data_pair *                  data_pair = get_data_pair( laserCloudSurfLast2->header.stamp.toSec() );
-        data_pair->add_pc_plane( laserCloudSurfLast2 );
-        if ( data_pair->is_completed() )
-        {
-            m_queue_avail_data.push( data_pair );
-        }
+        add_frame_cloud( Data_pair::e_pc_plane, laserCloudSurfLast2 );
     }
 
     void laserCloudFullResHandler( const sensor_msgs::PointCloud2ConstPtr &laserCloudFullRes2 )
     {
-        std::unique_lock<std::mutex> lock( m_mutex_buf );
-        Data_pair *                  data_pair = get_data_pair( laserCloudFullRes2->header.stamp.toSec() );
-        data_pair->add_pc_full( laserCloudFullRes2 );
-        if ( data_pair->is_completed() )
-        {
-            m_queue_avail_data.push( data_pair );
-        }
+        add_frame_cloud( Data_pair::e_pc_full, laserCloudFullRes2 );
+    }
+
+    void imuHandler( const sensor_msgs::Imu::ConstPtr &imu_msg )
+    {
+        m_motion_prior.add_imu( imu_msg->header.stamp.toSec(),
+                                Eigen::Vector3d( imu_msg->angular_velocity.x, imu_msg->angular_velocity.y, imu_msg->angular_velocity.z ) );
     }
 
-    Eigen::Matrix<double, 3, 1> pcl_pt_to_eigend( PointType &pt )
+    Eigen::Matrix<double, 3, 1> pcl_pt_to_eigend( const PointType &pt )
     {
         return Eigen::Matrix<double, 3, 1>( pt.x, pt.y, pt.z );
     }
@@ -525,15 +768,16 @@ class Laser_mapping
         m_pub_odom_aft_mapped_hight_frec.publish( odomAftMapped );
     }
 
-    void find_min_max_intensity( const pcl::PointCloud<PointType>::Ptr pc_ptr, float &min_I, float &max_I )
+    void find_min_max_intensity( const Common_tools::Point_cloud2_view &pc_view, float &min_I, float &max_I )
     {
-        int pt_size = pc_ptr->size();
+        size_t pt_size = pc_view.size();
         min_I = 10000;
         max_I = -min_I;
-        for ( int i = 0; i < pt_size; i++ )
+        for ( size_t i = 0; i < pt_size; i++ )
         {
-            min_I = std::min( pc_ptr->points[ i ].intensity, min_I );
-            max_I = std::max( pc_ptr->points[ i ].intensity, max_I );
+            float intensity = pc_view.get( i, Common_tools::Point_cloud2_view::e_intensity );
+            min_I = std::min( intensity, min_I );
+            max_I = std::max( intensity, max_I );
         }
     }
 
@@ -551,6 +795,7 @@ class Laser_mapping
         m_para_buffer_incremental[ 3 ] = 1.0;
         m_t_w_incre = m_t_w_incre * 0;
         m_q_w_incre = Eigen::Map<Eigen::Quaterniond>( m_para_buffer_incremental );
+        m_t_w_incre_prior.setZero();
 
         m_interpolatation_theta = 0;
         m_interpolatation_omega_hat.setZero();
@@ -563,285 +808,912 @@ class Laser_mapping
         return atan( sq_xy ) * 57.3;
     }
 
-    void process()
+    // Search k nearest map points, the result is saved in buffer.m_pts and buffer.m_sq_dis.
+    int search_map_neighbors( int if_corner, const PointType &pt, int k, Map_search_buffer &buffer )
     {
-        double first_time_stamp = -1;
-        m_last_max_blur = 0.0;
-        while ( 1 )
+        return m_map_search_backend->nearest_search( if_corner, pt, k, buffer.m_pts, buffer.m_sq_dis, buffer.m_backend_buffer );
+    }
+
+    // Find point-to-line correspondences of corner points in [begin, end), save to buffer.m_correspondences.
+    // pc_corners_map holds the same points transformed to map by pointcloudAssociateToMap.
+    // A point that moved less than m_para_icp_reassociate_distance since its last search reuses the result in caches.
+    // Only read the map, can be called from several threads with different buffers and ranges.
+    void find_corner_correspondences( const pcl::PointCloud<PointType> &pc_corners, const pcl::PointCloud<PointType> &pc_corners_map,
+                                      Icp_correspondence_cache *caches, int begin, int end, Map_search_buffer &buffer )
+    {
+        PointType pointOri, pointSel;
+        buffer.m_correspondences.clear();
+        buffer.m_rejection_num = 0;
+        buffer.m_search_num = 0;
+        buffer.m_change_num = 0;
+        for ( int i = begin; i < end; i++ )
         {
-            {
+            pointOri = pc_corners.points[ i ];
+            pointSel = pc_corners_map.points[ i ];
 
-                m_file_logger.printf( "------------------\r\n" );
+            Icp_correspondence_cache &cache = caches[ i ];
+            if ( !cache.is_reusable( pcl_pt_to_eigend( pointSel ), m_para_icp_reassociate_distance ) )
+            {
+                int             last_state = cache.m_state;
+                Eigen::Vector3d last_target = cache.m_correspondence.m_target_pt_a;
+                associate_corner_point( pointOri, pointSel, cache, buffer );
+                buffer.m_search_num++;
+                buffer.m_change_num += ( cache.m_state != last_state ||
+                                         ( cache.m_state == Icp_correspondence_cache::e_matched && cache.m_correspondence.m_target_pt_a != last_target ) );
+            }
+            append_cached_correspondence( cache, buffer );
+        }
+    }
 
-                while ( m_queue_avail_data.empty() )
-                {
-                    sleep( 0.0001 );
-                }
-                m_mutex_buf.lock();
-                while ( m_queue_avail_data.size() >= ( unsigned int ) m_max_buffer_size )
-                {
-                    ROS_WARN( "Drop lidar frame in mapping for real time performance !!!" );
-                    ( *m_file_logger.get_ostream() ) << "Drop lidar frame in mapping for real time performance !!!" << endl;
-                    m_queue_avail_data.pop();
-                }
-                Data_pair *current_data_pair = m_queue_avail_data.front();
-                m_queue_avail_data.pop();
-                m_mutex_buf.unlock();
+    void associate_corner_point( const PointType &pointOri, const PointType &pointSel, Icp_correspondence_cache &cache, Map_search_buffer &buffer )
+    {
+        if ( m_para_if_voxel_primitive )
+        {
+            associate_point_by_primitive( 1, pointOri, pointSel, cache );
+            return;
+        }
+        cache.m_pt_w = pcl_pt_to_eigend( pointSel );
+        cache.m_state = Icp_correspondence_cache::e_no_neighbor;
 
-                m_time_pc_corner_past = current_data_pair->m_pc_corner->header.stamp.toSec();
+        //在MAP中寻找5个最近邻点
+        int found_num = search_map_neighbors( 1, pointSel, line_search_num, buffer );
 
-                if ( first_time_stamp < 0 )
+        //最近邻点的距离平方要求小于2
+        if ( found_num == line_search_num && buffer.m_sq_dis[ line_search_num - 1 ] < line_search_max_sq_dis )
+        {
+            bool                         line_is_avail = true;
+            std::vector<Eigen::Vector3d> nearCorners;
+            Eigen::Vector3d              center( 0, 0, 0 );
+            if ( /*IF_LINE_FEATURE_CHECK*/ 1 )//根据5个邻近点的特征值判断 这五个近邻点首否近似一条直线
+            {
+                for ( int j = 0; j < line_search_num; j++ )
                 {
-                    first_time_stamp = m_time_pc_corner_past;
+                    Eigen::Vector3d tmp( buffer.m_pts[ j ].x,
+                                         buffer.m_pts[ j ].y,
+                                         buffer.m_pts[ j ].z );
+                    center = center + tmp;
+                    nearCorners.push_back( tmp );
                 }
 
-                double begin_time_f = ros::Time::now().toSec();
+                center = center / ( ( float ) line_search_num );//五个邻近点的重心
 
-                ( *m_file_logger.get_ostream() ) << "Messgage time stamp = " << m_time_pc_corner_past - first_time_stamp << endl;
+                Eigen::Matrix3d covMat = Eigen::Matrix3d::Zero();
 
-                m_laser_cloud_corner_last->clear();
-                pcl::fromROSMsg( *( current_data_pair->m_pc_corner ), *m_laser_cloud_corner_last );
+                for ( int j = 0; j < line_search_num; j++ )
+                {
+                    Eigen::Matrix<double, 3, 1> tmpZeroMean = nearCorners[ j ] - center;//五个邻近点的重心和邻近点组成的向量
+                    covMat = covMat + tmpZeroMean * tmpZeroMean.transpose();//五个向量的协方差矩阵的和
+                }
 
-                m_laser_cloud_surf_last->clear();
-                pcl::fromROSMsg( *( current_data_pair->m_pc_plane ), *m_laser_cloud_surf_last );
+                Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> saes( covMat );//特征值
 
-                m_laser_cloud_full_res->clear();
-                pcl::fromROSMsg( *( current_data_pair->m_pc_full ), *m_laser_cloud_full_res );
+                // if is indeed line feature
+                // note Eigen library sort eigenvalues in increasing order
 
-                delete current_data_pair;
-                float min_t, max_t;
-                find_min_max_intensity( m_laser_cloud_full_res, min_t, max_t );
-                if ( m_if_save_to_pcd_files && PCD_SAVE_RAW )
+                if ( saes.eigenvalues()[ 2 ] > 3 * saes.eigenvalues()[ 1 ] )//最大特征值 大于 次大特征值的3倍 则认为是线条
                 {
-                    m_pcl_tools_raw.save_to_pcd_files( "raw", *m_laser_cloud_full_res, 1 );
+                    line_is_avail = true;
                 }
-                m_q_w_last = m_q_w_curr;
-                m_t_w_last = m_t_w_curr;
-                m_minimum_pt_time_stamp = m_last_time_stamp;
-                m_maximum_pt_time_stamp = max_t;
-                m_last_time_stamp = max_t;
-                reset_incremtal_parameter();//m_para_buffer_incremental， m_q_w_incre ， m_t_w_incre初始化为 0
-
-                //100 * 100 * 100的 CUBE， 每个CUBE长宽高都是 50 米
-                //为什么要 加上 m_para_laser_cloud_center_width 这个数值,这是因为计算索引都是正整数，需要统一向右平移50个 CUBE，也即2500米
-                int centerCubeI = int( ( m_t_w_curr.x() + CUBE_W / 2 ) / CUBE_W ) + m_para_laser_cloud_center_width;
-                int centerCubeJ = int( ( m_t_w_curr.y() + CUBE_H / 2 ) / CUBE_H ) + m_para_laser_cloud_center_height;
-                int centerCubeK = int( ( m_t_w_curr.z() + CUBE_D / 2 ) / CUBE_D ) + m_para_laser_cloud_center_depth;
-
-                if ( m_t_w_curr.x() + CUBE_W / 2 < 0 )
-                    centerCubeI--;
+                else
+                {
+                    line_is_avail = false;
+                }
+            }
 
-                if ( m_t_w_curr.y() + CUBE_H / 2 < 0 )
-                    centerCubeJ--;
+            if ( line_is_avail )//近邻点组成了直线
+            {
+                Icp_correspondence &correspondence = cache.m_correspondence;
+                correspondence.m_type = Icp_correspondence::e_point_to_line;
+                correspondence.m_current_pt = Eigen::Vector3d( pointOri.x, pointOri.y, pointOri.z );//原始激光雷达坐标系中的点
+                correspondence.m_target_pt_a = pcl_pt_to_eigend( buffer.m_pts[ 0 ] );
+                correspondence.m_target_pt_b = pcl_pt_to_eigend( buffer.m_pts[ 1 ] );
+                correspondence.m_motion_blur_s = 1.0; //pointOri.intensity * 1.0,
+                cache.m_state = Icp_correspondence_cache::e_matched;
+            }
+            else
+            {
+                cache.m_state = Icp_correspondence_cache::e_rejected;
+            }
+        }
+    }
 
-                if ( m_t_w_curr.z() + CUBE_D / 2 < 0 )
-                    centerCubeK--;
+    // Find point-to-plane correspondences of surface points in [begin, end), save to buffer.m_correspondences.
+    void find_surface_correspondences( const pcl::PointCloud<PointType> &pc_surfaces, const pcl::PointCloud<PointType> &pc_surfaces_map,
+                                       Icp_correspondence_cache *caches, int begin, int end, Map_search_buffer &buffer )
+    {
+        PointType pointOri, pointSel;
+        buffer.m_correspondences.clear();
+        buffer.m_rejection_num = 0;
+        buffer.m_search_num = 0;
+        buffer.m_change_num = 0;
+        for ( int i = begin; i < end; i++ )
+        {
+            pointOri = pc_surfaces.points[ i ];
+            pointSel = pc_surfaces_map.points[ i ];
 
-                //printf( "****** min max timestamp = [%.6f, %.6f] ****** \r\n", m_minimum_pt_time_stamp, m_maximum_pt_time_stamp );
-                printf( "****** min max timestamp = [%.6f, %.6f] [%d %d %d]****** \r\n", m_minimum_pt_time_stamp, m_maximum_pt_time_stamp,centerCubeI, centerCubeJ, centerCubeK);
+            Icp_correspondence_cache &cache = caches[ i ];
+            if ( !cache.is_reusable( pcl_pt_to_eigend( pointSel ), m_para_icp_reassociate_distance ) )
+            {
+                int             last_state = cache.m_state;
+                Eigen::Vector3d last_target = cache.m_correspondence.m_target_pt_a;
+                associate_surface_point( pointOri, pointSel, cache, buffer );
+                buffer.m_search_num++;
+                buffer.m_change_num += ( cache.m_state != last_state ||
+                                         ( cache.m_state == Icp_correspondence_cache::e_matched && cache.m_correspondence.m_target_pt_a != last_target ) );
+            }
+            append_cached_correspondence( cache, buffer );
+        }
+    }
 
-                //这几个循环语句 是作为调整CUBE中心用的， 如果地图增的太大，超出了100 * 100 * 100 CUBE 的范围，那么需要我们将整体CUBE的中心移动一下，删除太老的区域， 添加新的空区域，同时还保证了总体数据量不变
-                while ( centerCubeI < 3 )//如果左下角不够用了，需要删除右上角的区域，给左下角用
+    void associate_surface_point( const PointType &pointOri, const PointType &pointSel, Icp_correspondence_cache &cache, Map_search_buffer &buffer )
+    {
+        if ( m_para_if_voxel_primitive )
+        {
+            associate_point_by_primitive( 0, pointOri, pointSel, cache );
+            return;
+        }
+        int planeValid = true;
+        cache.m_pt_w = pcl_pt_to_eigend( pointSel );
+        cache.m_state = Icp_correspondence_cache::e_no_neighbor;
+
+        //5个最近邻平面点
+        int found_num = search_map_neighbors( 0, pointSel, plane_search_num, buffer );
+        //最近邻平面点距离平方的阈值为 10m
+        if ( found_num == plane_search_num && buffer.m_sq_dis[ plane_search_num - 1 ] < plane_search_max_sq_dis )
+        {
+            std::vector<Eigen::Vector3d> nearCorners;
+            Eigen::Vector3d              center( 0, 0, 0 );
+            if ( IF_PLANE_FEATURE_CHECK )// 0
+            {
+                for ( int j = 0; j < plane_search_num; j++ )
                 {
-                    for ( int j = 0; j < m_para_laser_cloud_height; j++ )
-                    {
-                        for ( int k = 0; k < m_para_laser_cloud_depth; k++ )
-                        {
-                            int                             i = m_para_laser_cloud_width - 1;
-                            pcl::PointCloud<PointType>::Ptr laserCloudCubeCornerPointer =
-                                m_laser_cloud_corner_array[ i + m_para_laser_cloud_width * j + m_para_laser_cloud_width * m_para_laser_cloud_height * k ];
-                            pcl::PointCloud<PointType>::Ptr laserCloudCubeSurfPointer =
-                                m_laser_cloud_surface_array[ i + m_para_laser_cloud_width * j + m_para_laser_cloud_width * m_para_laser_cloud_height * k ];
+                    Eigen::Vector3d tmp( buffer.m_pts[ j ].x,
+                                         buffer.m_pts[ j ].y,
+                                         buffer.m_pts[ j ].z );
+                    center = center + tmp;
+                    nearCorners.push_back( tmp );
+                }
 
-                            for ( ; i >= 1; i-- )
-                            {
-                                m_laser_cloud_corner_array[ i + m_para_laser_cloud_width * j + m_para_laser_cloud_width * m_para_laser_cloud_height * k ] =
-                                    m_laser_cloud_corner_array[ i - 1 + m_para_laser_cloud_width * j + m_para_laser_cloud_width * m_para_laser_cloud_height * k ];
-                                m_laser_cloud_surface_array[ i + m_para_laser_cloud_width * j + m_para_laser_cloud_width * m_para_laser_cloud_height * k ] =
-                                    m_laser_cloud_surface_array[ i - 1 + m_para_laser_cloud_width * j + m_para_laser_cloud_width * m_para_laser_cloud_height * k ];
-                            }
+                center = center / ( float ) ( plane_search_num );
 
-                            m_laser_cloud_corner_array[ i + m_para_laser_cloud_width * j + m_para_laser_cloud_width * m_para_laser_cloud_height * k ] =
-                                laserCloudCubeCornerPointer;
-                            m_laser_cloud_surface_array[ i + m_para_laser_cloud_width * j + m_para_laser_cloud_width * m_para_laser_cloud_height * k ] =
-                                laserCloudCubeSurfPointer;
-                            laserCloudCubeCornerPointer->clear();
-                            laserCloudCubeSurfPointer->clear();
-                        }
-                    }
+                Eigen::Matrix3d covMat = Eigen::Matrix3d::Zero();
 
-                    centerCubeI++;
-                    m_para_laser_cloud_center_width++;
+                for ( int j = 0; j < plane_search_num; j++ )
+                {
+                    Eigen::Matrix<double, 3, 1> tmpZeroMean = nearCorners[ j ] - center;
+                    covMat = covMat + tmpZeroMean * tmpZeroMean.transpose();//协方差矩阵之和
                 }
 
-                while ( centerCubeI >= m_para_laser_cloud_width - 3 )//如果右上角不够用了，需要删除左下角的区域，给右上角用
+                Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> saes( covMat );
+
+                if ( ( saes.eigenvalues()[ 2 ] > 3 * saes.eigenvalues()[ 0 ] ) &&//最大特征值 是 最小特征值的3倍， 并且最大特征值 小于次大特征值的 10 倍
+                     ( saes.eigenvalues()[ 2 ] < 10 * saes.eigenvalues()[ 1 ] ) )
                 {
-                    for ( int j = 0; j < m_para_laser_cloud_height; j++ )
-                    {
-                        for ( int k = 0; k < m_para_laser_cloud_depth; k++ )
-                        {
-                            int                             i = 0;
-                            pcl::PointCloud<PointType>::Ptr laserCloudCubeCornerPointer =
-                                m_laser_cloud_corner_array[ i + m_para_laser_cloud_width * j + m_para_laser_cloud_width * m_para_laser_cloud_height * k ];
-                            pcl::PointCloud<PointType>::Ptr laserCloudCubeSurfPointer =
-                                m_laser_cloud_surface_array[ i + m_para_laser_cloud_width * j + m_para_laser_cloud_width * m_para_laser_cloud_height * k ];
+                    planeValid = true;
+                }
+                else
+                {
+                    planeValid = false;
+                }
+            }
 
-                            for ( ; i < m_para_laser_cloud_width - 1; i++ )
-                            {
-                                m_laser_cloud_corner_array[ i + m_para_laser_cloud_width * j + m_para_laser_cloud_width * m_para_laser_cloud_height * k ] =
-                                    m_laser_cloud_corner_array[ i + 1 + m_para_laser_cloud_width * j + m_para_laser_cloud_width * m_para_laser_cloud_height * k ];
-                                m_laser_cloud_surface_array[ i + m_para_laser_cloud_width * j + m_para_laser_cloud_width * m_para_laser_cloud_height * k ] =
-                                    m_laser_cloud_surface_array[ i + 1 + m_para_laser_cloud_width * j + m_para_laser_cloud_width * m_para_laser_cloud_height * k ];
-                            }
+            if ( planeValid )// 1
+            {
+                Icp_correspondence &correspondence = cache.m_correspondence;
+                correspondence.m_type = Icp_correspondence::e_point_to_plane;
+                correspondence.m_current_pt = Eigen::Vector3d( pointOri.x, pointOri.y, pointOri.z );
+                correspondence.m_target_pt_a = pcl_pt_to_eigend( buffer.m_pts[ 0 ] );
+                correspondence.m_target_pt_b = pcl_pt_to_eigend( buffer.m_pts[ plane_search_num / 2 ] );
+                correspondence.m_target_pt_c = pcl_pt_to_eigend( buffer.m_pts[ plane_search_num - 1 ] );
+                correspondence.m_motion_blur_s = 1.0; //pointOri.intensity * BLUR_SCALE,
+                cache.m_state = Icp_correspondence_cache::e_matched;
+            }
+            else
+            {
+                cache.m_state = Icp_correspondence_cache::e_rejected;
+            }
+        }
+    }
 
-                            m_laser_cloud_corner_array[ i + m_para_laser_cloud_width * j + m_para_laser_cloud_width * m_para_laser_cloud_height * k ] =
-                                laserCloudCubeCornerPointer;
-                            m_laser_cloud_surface_array[ i + m_para_laser_cloud_width * j + m_para_laser_cloud_width * m_para_laser_cloud_height * k ] =
-                                laserCloudCubeSurfPointer;
-                            laserCloudCubeCornerPointer->clear();
-                            laserCloudCubeSurfPointer->clear();
-                        }
-                    }
+    // Associate with the line/plane cached in the map voxel of pointSel, instead of neighbour search and eigen solve.
+    void associate_point_by_primitive( int if_corner, const PointType &pointOri, const PointType &pointSel, Icp_correspondence_cache &cache )
+    {
+        cache.m_pt_w = pcl_pt_to_eigend( pointSel );
+        const Voxel_primitive *primitive = m_cube_map.find_primitive( if_corner, pointSel );
+        if ( primitive == nullptr || primitive->m_point_num < m_para_primitive_min_point_num )
+        {
+            cache.m_state = Icp_correspondence_cache::e_no_neighbor;
+            return;
+        }
+        if ( ( if_corner ? primitive->m_line_quality : primitive->m_plane_quality ) < m_para_primitive_min_quality )
+        {
+            cache.m_state = Icp_correspondence_cache::e_rejected;
+            return;
+        }
 
-                    centerCubeI--;
-                    m_para_laser_cloud_center_width--;
-                }
+        Icp_correspondence &correspondence = cache.m_correspondence;
+        correspondence.m_current_pt = Eigen::Vector3d( pointOri.x, pointOri.y, pointOri.z );
+        correspondence.m_target_pt_a = primitive->m_center;
+        correspondence.m_motion_blur_s = 1.0;
+        if ( if_corner )
+        {
+            correspondence.m_type = Icp_correspondence::e_point_to_line;
+            correspondence.m_target_pt_b = primitive->m_center + primitive->m_line_direction;
+        }
+        else
+        {
+            // ab and ac are orthonormal, so the plane normal of the residual has unit length.
+            correspondence.m_type = Icp_correspondence::e_point_to_plane;
+            correspondence.m_target_pt_b = primitive->m_center + primitive->m_plane_axis_a;
+            correspondence.m_target_pt_c = primitive->m_center + primitive->m_plane_axis_b;
+        }
+        cache.m_state = Icp_correspondence_cache::e_matched;
+    }
 
-                while ( centerCubeJ < 3 )//如果Y负向不够用了，需要删除Y正向的区域，给Y负向用
-                {
-                    for ( int i = 0; i < m_para_laser_cloud_width; i++ )
-                    {
-                        for ( int k = 0; k < m_para_laser_cloud_depth; k++ )
-                        {
-                            int                             j = m_para_laser_cloud_height - 1;
-                            pcl::PointCloud<PointType>::Ptr laserCloudCubeCornerPointer =
-                                m_laser_cloud_corner_array[ i + m_para_laser_cloud_width * j + m_para_laser_cloud_width * m_para_laser_cloud_height * k ];
-                            pcl::PointCloud<PointType>::Ptr laserCloudCubeSurfPointer =
-                                m_laser_cloud_surface_array[ i + m_para_laser_cloud_width * j + m_para_laser_cloud_width * m_para_laser_cloud_height * k ];
+    void append_cached_correspondence( const Icp_correspondence_cache &cache, Map_search_buffer &buffer )
+    {
+        if ( cache.m_state == Icp_correspondence_cache::e_matched )
+        {
+            buffer.m_correspondences.push_back( cache.m_correspondence );
+        }
+        else if ( cache.m_state == Icp_correspondence_cache::e_rejected )
+        {
+            buffer.m_rejection_num++;
+        }
+    }
 
-                            for ( ; j >= 1; j-- )
-                            {
-                                m_laser_cloud_corner_array[ i + m_para_laser_cloud_width * j + m_para_laser_cloud_width * m_para_laser_cloud_height * k ] =
-                                    m_laser_cloud_corner_array[ i + m_para_laser_cloud_width * ( j - 1 ) + m_para_laser_cloud_width * m_para_laser_cloud_height * k ];
-                                m_laser_cloud_surface_array[ i + m_para_laser_cloud_width * j + m_para_laser_cloud_width * m_para_laser_cloud_height * k ] =
-                                    m_laser_cloud_surface_array[ i + m_para_laser_cloud_width * ( j - 1 ) + m_para_laser_cloud_width * m_para_laser_cloud_height * k ];
-                            }
+    ceres::CostFunction *create_icp_cost_function( const Icp_correspondence &correspondence, int if_analytic_jacobian )
+    {
+        Eigen::Matrix<double, 4, 1> q_last( m_q_w_last.w(), m_q_w_last.x(), m_q_w_last.y(), m_q_w_last.z() );
+        if ( correspondence.m_type == Icp_correspondence::e_point_to_line )
+        {
+            if ( if_analytic_jacobian )
+            {
+                return ceres_icp_point2line_analytic::Create( correspondence.m_current_pt,
+                                                              correspondence.m_target_pt_a,
+                                                              correspondence.m_target_pt_b,
+                                                              correspondence.m_motion_blur_s,
+                                                              q_last,
+                                                              m_t_w_last );
+            }
+            return ceres_icp_point2line<double>::Create( correspondence.m_current_pt,
+                                                         correspondence.m_target_pt_a,
+                                                         correspondence.m_target_pt_b,
+                                                         correspondence.m_motion_blur_s,
+                                                         q_last,
+                                                         m_t_w_last );
+        }
+        else
+        {
+            if ( if_analytic_jacobian )
+            {
+                return ceres_icp_point2plane_analytic::Create( correspondence.m_current_pt,
+                                                               correspondence.m_target_pt_a,
+                                                               correspondence.m_target_pt_b,
+                                                               correspondence.m_target_pt_c,
+                                                               correspondence.m_motion_blur_s,
+                                                               q_last,
+                                                               m_t_w_last );
+            }
+            return ceres_icp_point2plane<double>::Create( correspondence.m_current_pt,
+                                                          correspondence.m_target_pt_a,
+                                                          correspondence.m_target_pt_b,
+                                                          correspondence.m_target_pt_c,
+                                                          correspondence.m_motion_blur_s,
+                                                          q_last,
+                                                          m_t_w_last );
+        }
+    }
 
-                            m_laser_cloud_corner_array[ i + m_para_laser_cloud_width * j + m_para_laser_cloud_width * m_para_laser_cloud_height * k ] =
-                                laserCloudCubeCornerPointer;
-                            m_laser_cloud_surface_array[ i + m_para_laser_cloud_width * j + m_para_laser_cloud_width * m_para_laser_cloud_height * k ] =
-                                laserCloudCubeSurfPointer;
-                            laserCloudCubeCornerPointer->clear();
-                            laserCloudCubeSurfPointer->clear();
-                        }
-                    }
+    // Put m_icp_correspondences into the residual blocks of m_ceres_problem, the problem and its blocks are created once and
+    // reused. There is one block per correspondence: the pool grows when there are more of them, and the surplus blocks
+    // are removed, so that the solver never works on the rows of switched off blocks of earlier frames.
+    void update_ceres_problem()
+    {
+        if ( m_ceres_problem == nullptr )
+        {
+            ceres::Problem::Options problem_options;
+            problem_options.cost_function_ownership = ceres::DO_NOT_TAKE_OWNERSHIP;
+            problem_options.loss_function_ownership = ceres::DO_NOT_TAKE_OWNERSHIP;
+            problem_options.local_parameterization_ownership = ceres::DO_NOT_TAKE_OWNERSHIP;
+            problem_options.enable_fast_removal = true;
+            m_ceres_loss_function.reset( new ceres::HuberLoss( 0.1 ) );//Huber Loss 是一个用于回归问题的带参损失函数, 优点是能增强平方误差损失函数(MSE, mean square error)对离群点的鲁棒性。
+            m_ceres_q_parameterization.reset( new ceres::EigenQuaternionParameterization() );
+            m_ceres_problem.reset( new ceres::Problem( problem_options ) );
+            m_ceres_problem->AddParameterBlock( m_para_buffer_incremental, 4, m_ceres_q_parameterization.get() );//前四个参数为旋转四元数(R)
+            m_ceres_problem->AddParameterBlock( m_para_buffer_incremental + 4, 3 );//后三个参数为平移参数(T)
+        }
 
-                    centerCubeJ++;
-                    m_para_laser_cloud_center_height++;
-                }
+        while ( m_ceres_cost_pool.size() < m_icp_correspondences.size() )
+        {
+            m_ceres_cost_pool.emplace_back( new ceres_icp_pooled_cost_function() );
+            m_ceres_residual_block_ids.push_back( m_ceres_problem->AddResidualBlock( m_ceres_cost_pool.back().get(), m_ceres_loss_function.get(),
+                                                                                     m_para_buffer_incremental, m_para_buffer_incremental + 4 ) );//cost, loss, 初始旋转参数， 初始平移参数
+        }
+        while ( m_ceres_cost_pool.size() > m_icp_correspondences.size() )
+        {
+            m_ceres_problem->RemoveResidualBlock( m_ceres_residual_block_ids.back() );
+            m_ceres_residual_block_ids.pop_back();
+            m_ceres_cost_pool.pop_back();
+        }
 
-                while ( centerCubeJ >= m_para_laser_cloud_height - 3 )//如果Y正向不够用了，需要删除Y负向的区域，给Y正向用
+        // 更新残差也是多线程, 每个残差块只由一个线程写
+        Eigen::Matrix<double, 4, 1> q_last( m_q_w_last.w(), m_q_w_last.x(), m_q_w_last.y(), m_q_w_last.z() );
+        std::vector<double>         jacobian_check_err( m_thread_pool.get_thread_num(), 0.0 );
+        m_thread_pool.parallel_for( m_ceres_cost_pool.size(), [&]( int begin, int end, int block_idx ) {
+            for ( int i = begin; i < end; i++ )
+            {
+                m_ceres_cost_pool[ i ]->set( ceres_icp_create_residual( m_icp_correspondences[ i ], q_last, m_t_w_last ),
+                                             m_para_if_analytic_jacobian ? nullptr : create_icp_cost_function( m_icp_correspondences[ i ], 0 ) );
+                if ( m_para_if_check_analytic_jacobian )
                 {
-                    for ( int i = 0; i < m_para_laser_cloud_width; i++ )
-                    {
-                        for ( int k = 0; k < m_para_laser_cloud_depth; k++ )
-                        {
-                            int                             j = 0;
-                            pcl::PointCloud<PointType>::Ptr laserCloudCubeCornerPointer =
-                                m_laser_cloud_corner_array[ i + m_para_laser_cloud_width * j + m_para_laser_cloud_width * m_para_laser_cloud_height * k ];
-                            pcl::PointCloud<PointType>::Ptr laserCloudCubeSurfPointer =
-                                m_laser_cloud_surface_array[ i + m_para_laser_cloud_width * j + m_para_laser_cloud_width * m_para_laser_cloud_height * k ];
+                    ceres::CostFunction *cost_analytic = create_icp_cost_function( m_icp_correspondences[ i ], 1 );
+                    ceres::CostFunction *cost_autodiff = create_icp_cost_function( m_icp_correspondences[ i ], 0 );
+                    jacobian_check_err[ block_idx ] = std::max( jacobian_check_err[ block_idx ],
+                                                                ceres_icp_compare_cost_function( cost_analytic, cost_autodiff, m_para_buffer_incremental, m_para_buffer_incremental + 4 ) );
+                    delete cost_analytic;
+                    delete cost_autodiff;
+                }
+            }
+        } );
+        if ( m_para_if_check_analytic_jacobian )
+        {
+            m_file_logger.printf( "Analytic jacobian max error = %g\r\n", *std::max_element( jacobian_check_err.begin(), jacobian_check_err.end() ) );
+        }
+    }
 
-                            for ( ; j < m_para_laser_cloud_height - 1; j++ )
-                            {
-                                m_laser_cloud_corner_array[ i + m_para_laser_cloud_width * j + m_para_laser_cloud_width * m_para_laser_cloud_height * k ] =
-                                    m_laser_cloud_corner_array[ i + m_para_laser_cloud_width * ( j + 1 ) + m_para_laser_cloud_width * m_para_laser_cloud_height * k ];
-                                m_laser_cloud_surface_array[ i + m_para_laser_cloud_width * j + m_para_laser_cloud_width * m_para_laser_cloud_height * k ] =
-                                    m_laser_cloud_surface_array[ i + m_para_laser_cloud_width * ( j + 1 ) + m_para_laser_cloud_width * m_para_laser_cloud_height * k ];
-                            }
+    // Solve m_ceres_problem with m_icp_correspondences, switch off outliers and solve again.
+    // Return the number of residual blocks used in the last solve.
+    int solve_icp_with_ceres( ceres::Solver::Summary &summary, int iterCount )
+    {
+        update_ceres_problem();
+        ceres::Problem &problem = *m_ceres_problem;
 
-                            m_laser_cloud_corner_array[ i + m_para_laser_cloud_width * j + m_para_laser_cloud_width * m_para_laser_cloud_height * k ] =
-                                laserCloudCubeCornerPointer;
-                            m_laser_cloud_surface_array[ i + m_para_laser_cloud_width * j + m_para_laser_cloud_width * m_para_laser_cloud_height * k ] =
-                                laserCloudCubeSurfPointer;
-                            laserCloudCubeCornerPointer->clear();
-                            laserCloudCubeSurfPointer->clear();
-                        }
-                    }
+        std::vector<int> active_idx( m_icp_correspondences.size() ); // index of m_ceres_cost_pool
+        for ( size_t i = 0; i < active_idx.size(); i++ )
+        {
+            active_idx[ i ] = i;
+        }
 
-                    centerCubeJ--;
-                    m_para_laser_cloud_center_height--;
-                }
+        ceres::Solver::Options options;
 
-                while ( centerCubeK < 3 )//如果Z负向不够用了，需要删除Z正向的区域，给Z负向用
-                {
-                    for ( int i = 0; i < m_para_laser_cloud_width; i++ )
-                    {
-                        for ( int j = 0; j < m_para_laser_cloud_height; j++ )
-                        {
-                            int                             k = m_para_laser_cloud_depth - 1;
-                            pcl::PointCloud<PointType>::Ptr laserCloudCubeCornerPointer =
-                                m_laser_cloud_corner_array[ i + m_para_laser_cloud_width * j + m_para_laser_cloud_width * m_para_laser_cloud_height * k ];
-                            pcl::PointCloud<PointType>::Ptr laserCloudCubeSurfPointer =
-                                m_laser_cloud_surface_array[ i + m_para_laser_cloud_width * j + m_para_laser_cloud_width * m_para_laser_cloud_height * k ];
+        std::vector<int> active_idx_bak;
+        for ( size_t ii = 0; ii < 1; ii++ )
+        {
+            options.linear_solver_type = ceres::DENSE_QR;
+            options.max_num_iterations = m_para_cere_max_iterations;
+            options.max_num_iterations = 5;
+            options.minimizer_progress_to_stdout = false;
+            options.check_gradients = false;
+            //options.gradient_check_relative_precision = 1e-10;
+            options.function_tolerance = m_para_solver_function_tolerance;
+            options.parameter_tolerance = m_para_solver_parameter_tolerance;
+
+            if ( 0 )
+            {
+                // NOTE Optimize T first and than R
+                if ( iterCount < ( m_para_icp_max_iterations - 2 ) / 2 )
+                    problem.SetParameterBlockConstant( m_para_buffer_incremental + 4 );
+                else if ( iterCount < m_para_icp_max_iterations - 2 )
+                    problem.SetParameterBlockConstant( m_para_buffer_incremental );
+            }
 
-                            for ( ; k >= 1; k-- )
-                            {
-                                m_laser_cloud_corner_array[ i + m_para_laser_cloud_width * j + m_para_laser_cloud_width * m_para_laser_cloud_height * k ] =
-                                    m_laser_cloud_corner_array[ i + m_para_laser_cloud_width * j + m_para_laser_cloud_width * m_para_laser_cloud_height * ( k - 1 ) ];
-                                m_laser_cloud_surface_array[ i + m_para_laser_cloud_width * j + m_para_laser_cloud_width * m_para_laser_cloud_height * k ] =
-                                    m_laser_cloud_surface_array[ i + m_para_laser_cloud_width * j + m_para_laser_cloud_width * m_para_laser_cloud_height * ( k - 1 ) ];
-                            }
+            set_ceres_solver_bound( problem );//平移限制在相邻两帧数据不超过0.2米(10m/s  /  50Hz)
 
-                            m_laser_cloud_corner_array[ i + m_para_laser_cloud_width * j + m_para_laser_cloud_width * m_para_laser_cloud_height * k ] =
-                                laserCloudCubeCornerPointer;
-                            m_laser_cloud_surface_array[ i + m_para_laser_cloud_width * j + m_para_laser_cloud_width * m_para_laser_cloud_height * k ] =
-                                laserCloudCubeSurfPointer;
-                            laserCloudCubeCornerPointer->clear();
-                            laserCloudCubeSurfPointer->clear();
-                        }
-                    }
+            //double bef_solver = ros::Time::now().toSec();
+            ceres::Solve( options, &problem, &summary );
+            m_icp_solver_iteration_num += summary.num_successful_steps + summary.num_unsuccessful_steps;
+            //printf("sol1[%f]", ros::Time::now().toSec() - bef_solver);
 
-                    centerCubeK++;
-                    m_para_laser_cloud_center_depth++;
+            // Remove outliers, the residual blocks are switched off instead of removed
+            active_idx_bak.clear();
+
+            //if ( summary.final_cost > m_max_final_cost * 0.001 )
+            //评估残差点， 删除残差较大的点（移除残差绝对值之和 大于 std::min( 0.1, 10 * avr_cost ) 的点）
+            if ( active_idx.size() )
+            {
+                ceres::Problem::EvaluateOptions eval_options;
+                for ( size_t i = 0; i < active_idx.size(); i++ )
+                {
+                    eval_options.residual_blocks.push_back( m_ceres_residual_block_ids[ active_idx[ i ] ] );
                 }
+                double         total_cost = 0.0;
+                double         avr_cost;
+                vector<double> residuals;
+                problem.Evaluate( eval_options, &total_cost, &residuals, nullptr, nullptr );
+                avr_cost = total_cost / active_idx.size();//平均cost值
 
-                while ( centerCubeK >= m_para_laser_cloud_depth - 3 )//如果Z正向不够用了，需要删除Z负向的区域，给Z正向用
+                for ( unsigned int i = 0; i < active_idx.size(); i++ )
                 {
-                    for ( int i = 0; i < m_para_laser_cloud_width; i++ )
+                    if ( ( fabs( residuals[ 3 * i + 0 ] ) + fabs( residuals[ 3 * i + 1 ] ) + fabs( residuals[ 3 * i + 2 ] ) ) > std::min( 0.1, 10 * avr_cost ) ) // std::min( 1.0, 10 * avr_cost )
                     {
-                        for ( int j = 0; j < m_para_laser_cloud_height; j++ )
-                        {
-                            int                             k = 0;
-                            pcl::PointCloud<PointType>::Ptr laserCloudCubeCornerPointer =
-                                m_laser_cloud_corner_array[ i + m_para_laser_cloud_width * j + m_para_laser_cloud_width * m_para_laser_cloud_height * k ];
-                            pcl::PointCloud<PointType>::Ptr laserCloudCubeSurfPointer =
-                                m_laser_cloud_surface_array[ i + m_para_laser_cloud_width * j + m_para_laser_cloud_width * m_para_laser_cloud_height * k ];
-
-                            for ( ; k < m_para_laser_cloud_depth - 1; k++ )
-                            {
-                                m_laser_cloud_corner_array[ i + m_para_laser_cloud_width * j + m_para_laser_cloud_width * m_para_laser_cloud_height * k ] =
-                                    m_laser_cloud_corner_array[ i + m_para_laser_cloud_width * j + m_para_laser_cloud_width * m_para_laser_cloud_height * ( k + 1 ) ];
-                                m_laser_cloud_surface_array[ i + m_para_laser_cloud_width * j + m_para_laser_cloud_width * m_para_laser_cloud_height * k ] =
-                                    m_laser_cloud_surface_array[ i + m_para_laser_cloud_width * j + m_para_laser_cloud_width * m_para_laser_cloud_height * ( k + 1 ) ];
-                            }
-
-                            m_laser_cloud_corner_array[ i + m_para_laser_cloud_width * j + m_para_laser_cloud_width * m_para_laser_cloud_height * k ] =
-                                laserCloudCubeCornerPointer;
-                            m_laser_cloud_surface_array[ i + m_para_laser_cloud_width * j + m_para_laser_cloud_width * m_para_laser_cloud_height * k ] =
-                                laserCloudCubeSurfPointer;
-                            laserCloudCubeCornerPointer->clear();
-                            laserCloudCubeSurfPointer->clear();
-                        }
+                        m_ceres_cost_pool[ active_idx[ i ] ]->switch_off();
+                    }
+                    else
+                    {
+                        active_idx_bak.push_back( active_idx[ i ] );
                     }
-
-                    centerCubeK--;
-                    m_para_laser_cloud_center_depth--;
                 }
+            }
+
+            active_idx = active_idx_bak;
+        }
+        options.max_num_iterations = m_para_cere_max_iterations;//5
+        set_ceres_solver_bound( problem );// 平移限制在相邻两帧数据不超过0.2米(10m/s  /  50Hz)
+
+        //double bef_solver_2 = ros::Time::now().toSec();
+        ceres::Solve( options, &problem, &summary );
+        m_icp_solver_iteration_num += summary.num_successful_steps + summary.num_unsuccessful_steps;
+        //printf("sol2[%f]", ros::Time::now().toSec() - bef_solver_2);
+        return active_idx.size();
+    }
+
+    // Same procedure as solve_icp_with_ceres, with the built-in Levenberg-Marquardt solver.
+    void solve_icp_with_lm( Icp_lm_solver::Summary &summary )
+    {
+        m_icp_lm_solver.m_max_translation = m_para_max_speed;
+        m_icp_lm_solver.m_translation_center = m_t_w_incre_prior;
+        m_icp_lm_solver.m_function_tolerance = m_para_solver_function_tolerance;
+        m_icp_lm_solver.m_parameter_tolerance = m_para_solver_parameter_tolerance;
+        m_icp_lm_solver.m_thread_pool = &m_thread_pool;
+        m_icp_lm_solver.set_problem( m_icp_correspondences, m_q_w_last, m_t_w_last );
+        m_icp_lm_solver.solve( m_para_buffer_incremental, 5, summary );
+        m_icp_solver_iteration_num += summary.m_iterations;
+
+        // Remove outliers, the same threshold as solve_icp_with_ceres
+        std::vector<double> residuals;
+        int                 residual_num = m_icp_lm_solver.get_active_residual_num();
+        if ( residual_num != 0 )
+        {
+            double avr_cost = m_icp_lm_solver.evaluate( m_para_buffer_incremental, &residuals ) / residual_num;
+            for ( size_t i = 0; i < m_icp_lm_solver.m_residuals.size(); i++ )
+            {
+                if ( ( fabs( residuals[ 3 * i + 0 ] ) + fabs( residuals[ 3 * i + 1 ] ) + fabs( residuals[ 3 * i + 2 ] ) ) > std::min( 0.1, 10 * avr_cost ) )
+                {
+                    m_icp_lm_solver.m_residual_active[ i ] = 0;
+                }
+            }
+        }
+
+        m_icp_lm_solver.solve( m_para_buffer_incremental, m_para_cere_max_iterations, summary );
+        m_icp_solver_iteration_num += summary.m_iterations;
+    }
+
+    // One-shot full map for late joiners of /laser_cloud_map_delta, published on the latched /laser_cloud_map_snapshot.
+    bool map_snapshot_service( std_srvs::Trigger::Request &req, std_srvs::Trigger::Response &res )
+    {
+        m_if_request_map_snapshot = true;
+        res.success = true;
+        res.message = "Map snapshot will be published on /laser_cloud_map_snapshot after next frame";
+        return true;
+    }
+
+    // The map is copied by process() after the current frame, and written by the publish thread.
+    bool save_map_service( std_srvs::Trigger::Request &req, std_srvs::Trigger::Response &res )
+    {
+        if ( m_para_map_save_file.empty() )
+        {
+            res.success = false;
+            res.message = "Parameter map_save_file is not set";
+            return true;
+        }
+        m_if_request_save_map = true;
+        res.success = true;
+        res.message = "Map will be saved to " + m_para_map_save_file + " after next frame";
+        return true;
+    }
+
+    void load_map()
+    {
+        if ( m_para_map_load_file.empty() )
+        {
+            return;
+        }
+        double                      begin_time_f = ros::Time::now().toSec();
+        Map_file                    map_file;
+        std::vector<Map_file::Tile> outside_tiles; // paged out at once if m_map_tile_store is enabled, dropped otherwise
+        long                        skipped_pt_num = 0;
+        long                        pt_num = map_file.load( m_cube_map, m_line_resolution, m_plane_resolution, m_para_if_voxel_primitive,
+                                                            m_para_map_load_file, m_map_tile_store ? &outside_tiles : nullptr, &skipped_pt_num );
+        if ( pt_num < 0 )
+        {
+            m_file_logger.printf( "Fail to load map %s: %s \r\n", m_para_map_load_file.c_str(), map_file.m_last_error.c_str() );
+            ROS_WARN( "Fail to load map %s: %s", m_para_map_load_file.c_str(), map_file.m_last_error.c_str() );
+            return;
+        }
+        if ( m_map_tile_store )
+        {
+            m_map_tile_store->add_tiles( outside_tiles );
+        }
+        if ( skipped_pt_num )
+        {
+            m_file_logger.printf( "Skip %ld points of map %s outside of the cube grid \r\n", skipped_pt_num, m_para_map_load_file.c_str() );
+            ROS_WARN( "Skip %ld points of map %s outside of the cube grid, set map_paging_dir to keep them", skipped_pt_num, m_para_map_load_file.c_str() );
+        }
+        // The prior map is in the frame of the first pose, so matching starts from the first frame.
+        m_mapping_init_accumulate_frames = -1;
+        printf( "Load %ld points from map %s, cost %f s \n", pt_num, m_para_map_load_file.c_str(), ros::Time::now().toSec() - begin_time_f );
+        m_file_logger.printf( "Load %ld points from map %s, cost %f s \r\n", pt_num, m_para_map_load_file.c_str(), ros::Time::now().toSec() - begin_time_f );
+    }
+
+    // Copy the map to map_frame, which is cheap enough for the registration thread, save_map() does the disk I/O.
+    void get_map_to_save( Publish_map_frame &map_frame )
+    {
+        map_frame.m_if_save_map = true;
+        Map_file::get_tiles( m_cube_map, map_frame.m_save_tiles );
+        if ( m_map_tile_store )
+        {
+            m_map_tile_store->get_tiles( map_frame.m_save_tiles, map_frame.m_save_on_disk_ids );
+        }
+    }
+
+    void save_map( Publish_map_frame &map_frame )
+    {
+        double   begin_time_f = ros::Time::now().toSec();
+        Map_file map_file;
+        double   cube_size[ 3 ] = { m_cube_map.m_cube_w, m_cube_map.m_cube_h, m_cube_map.m_cube_d };
+        if ( m_map_tile_store )
+        {
+            m_map_tile_store->read_tiles( map_frame.m_save_on_disk_ids, map_frame.m_save_tiles );
+        }
+        if ( !map_file.write( map_frame.m_save_tiles, cube_size, m_line_resolution, m_plane_resolution, m_para_map_save_file ) )
+        {
+            m_file_logger.printf( "%s \r\n", map_file.m_last_error.c_str() );
+            ROS_WARN( "%s", map_file.m_last_error.c_str() );
+            return;
+        }
+        printf( "Save map to %s, cost %f s \n", m_para_map_save_file.c_str(), ros::Time::now().toSec() - begin_time_f );
+        m_file_logger.printf( "Save map to %s, cost %f s \r\n", m_para_map_save_file.c_str(), ros::Time::now().toSec() - begin_time_f );
+    }
+
+    // Stop process() after the frames in queue, e.g. on shutdown of ROS.
+    void stop()
+    {
+        m_queue_avail_data.stop();
+    }
+
+    Publish_map_frame::Cube_snapshot get_cube_snapshot( const Points_cube &cube )
+    {
+        Publish_map_frame::Cube_snapshot snapshot;
+        pcl::PointCloud<PointType>::Ptr pts( new pcl::PointCloud<PointType>( *cube.m_corner_pts ) );
+        *pts += *cube.m_surface_pts;
+        snapshot.m_id = cube.m_id;
+        snapshot.m_version = cube.m_version;
+        snapshot.m_pts = pts;
+        return snapshot;
+    }
+
+    // Points of the cubes with fields x, y, z, intensity, cube_i, cube_j, cube_k, version.
+    // ( cube_i, cube_j, cube_k ) is the world index of the cube, a receiver replaces all points of a cube by the
+    // points of the same cube in a newer message. A removed cube is sent as one NaN point with version -1.
+    void cubes_to_ros_msg( const std::vector<Publish_map_frame::Cube_snapshot> &cubes, const std::vector<Points_cube_map::Cube_id> &removed_ids,
+                           sensor_msgs::PointCloud2 &msg )
+    {
+        const char *field_names[ 8 ] = { "x", "y", "z", "intensity", "cube_i", "cube_j", "cube_k", "version" };
+        msg.fields.resize( 8 );
+        for ( int i = 0; i < 8; i++ )
+        {
+            msg.fields[ i ].name = field_names[ i ];
+            msg.fields[ i ].offset = 4 * i;
+            msg.fields[ i ].datatype = i < 4 ? sensor_msgs::PointField::FLOAT32 : sensor_msgs::PointField::INT32;
+            msg.fields[ i ].count = 1;
+        }
+
+        size_t pt_num = removed_ids.size();
+        for ( size_t i = 0; i < cubes.size(); i++ )
+        {
+            pt_num += cubes[ i ].m_pts->size();
+        }
+        msg.header.frame_id = "/camera_init";
+        msg.height = 1;
+        msg.width = pt_num;
+        msg.is_bigendian = false;
+        msg.point_step = 32;
+        msg.row_step = msg.point_step * msg.width;
+        msg.is_dense = removed_ids.empty();
+        msg.data.resize( msg.row_step );
+
+        unsigned char *data = msg.data.data();
+        float          pt_data[ 4 ];
+        int32_t        tag_data[ 4 ];
+        for ( size_t i = 0; i < cubes.size() + removed_ids.size(); i++ )
+        {
+            bool if_removed = i >= cubes.size();
+            m_cube_map.get_world_index( if_removed ? removed_ids[ i - cubes.size() ] : cubes[ i ].m_id, tag_data[ 0 ], tag_data[ 1 ], tag_data[ 2 ] );
+            tag_data[ 3 ] = if_removed ? -1 : cubes[ i ].m_version;
+            size_t cube_pt_num = if_removed ? 1 : cubes[ i ].m_pts->size();
+            for ( size_t j = 0; j < cube_pt_num; j++ )
+            {
+                if ( if_removed )
+                {
+                    pt_data[ 0 ] = pt_data[ 1 ] = pt_data[ 2 ] = pt_data[ 3 ] = std::numeric_limits<float>::quiet_NaN();
+                }
+                else
+                {
+                    const PointType &pt = cubes[ i ].m_pts->points[ j ];
+                    pt_data[ 0 ] = pt.x;
+                    pt_data[ 1 ] = pt.y;
+                    pt_data[ 2 ] = pt.z;
+                    pt_data[ 3 ] = pt.intensity;
+                }
+                memcpy( data, pt_data, 16 );
+                memcpy( data + 16, tag_data, 16 );
+                data += msg.point_step;
+            }
+        }
+    }
+
+    // Decode stage: clouds from ROS messages, and the down sampled feature points used in registration.
+    void decode_process()
+    {
+        pcl::VoxelGrid<PointType> down_sample_filter_corner = m_down_sample_filter_corner;
+        pcl::VoxelGrid<PointType> down_sample_filter_surface = m_down_sample_filter_surface;
+        while ( 1 )
+        {
+            Data_pair data_pair;
+            size_t    drop_num = 0;
+            if ( !m_queue_avail_data.pop( data_pair, &drop_num ) )
+            {
+                break;
+            }
+            for ( size_t i = 0; i < drop_num; i++ )
+            {
+                ROS_WARN( "Drop lidar frame in mapping for real time performance !!!" );
+            }
+
+            Mapping_frame frame;
+            frame.m_drop_num = drop_num;
+            frame.m_time_stamp = data_pair.pc_corner()->header.stamp.toSec();
+            Common_tools::Point_cloud2_view( *data_pair.pc_corner() ).copy_to( *frame.m_corner );
+            Common_tools::Point_cloud2_view( *data_pair.pc_plane() ).copy_to( *frame.m_surface );
+            frame.m_full_msg = data_pair.pc_full();
+
+            Common_tools::Point_cloud2_view full_view( *frame.m_full_msg );
+            float                           min_t;
+            find_min_max_intensity( full_view, min_t, frame.m_max_intensity );
+            if ( m_if_save_to_pcd_files && PCD_SAVE_RAW )
+            {
+                pcl::PointCloud<PointType> full_raw;
+                full_view.copy_to( full_raw );
+                m_pcl_tools_raw.save_to_pcd_files( "raw", full_raw, 1 );
+            }
+
+            down_sample_filter_corner.setInputCloud( frame.m_corner );
+            down_sample_filter_corner.filter( *frame.m_corner_stack );
+            down_sample_filter_surface.setInputCloud( frame.m_surface );
+            down_sample_filter_surface.filter( *frame.m_surface_stack );
+
+            if ( !m_queue_decoded_frame.push_wait( frame ) )
+            {
+                break;
+            }
+        }
+        m_queue_decoded_frame.stop();
+    }
+
+    // Publish stage: serialization and disk I/O of clouds which are already transformed to map.
+    void publish_process()
+    {
+        while ( 1 )
+        {
+            Publish_frame frame;
+            if ( !m_queue_publish_frame.pop( frame ) )
+            {
+                break;
+            }
+            ros::Time time_stamp = ros::Time().fromSec( frame.m_time_stamp );
+
+            sensor_msgs::PointCloud2 laserCloudMsg;
+            if ( frame.m_surface != nullptr )
+            {
+                pcl::toROSMsg( *frame.m_surface, laserCloudMsg );
+                laserCloudMsg.header.stamp = time_stamp;
+                laserCloudMsg.header.frame_id = "/camera_init";
+                m_pub_last_surface_pts.publish( laserCloudMsg );
+            }
+            if ( frame.m_corner != nullptr )
+            {
+                pcl::toROSMsg( *frame.m_corner, laserCloudMsg );
+                laserCloudMsg.header.stamp = time_stamp;
+                laserCloudMsg.header.frame_id = "/camera_init";
+                m_pub_last_corner_pts.publish( laserCloudMsg ); //feature corners
+            }
+
+            if ( frame.m_surround != nullptr )
+            {
+                if ( frame.m_if_publish_surround )
+                {
+                    pcl::toROSMsg( *frame.m_surround, laserCloudMsg );
+                    laserCloudMsg.header.stamp = time_stamp;
+                    laserCloudMsg.header.frame_id = "/camera_init";
+                    m_pub_laser_cloud_surround.publish( laserCloudMsg );
+                }
+
+                if ( m_if_save_to_pcd_files )
+                {
+                    m_pcl_tools_aftmap.save_to_pcd_files( "surround", *frame.m_surround );
+                }
+            }
+
+            if ( frame.m_map != nullptr )
+            {
+                pcl::toROSMsg( *frame.m_map, laserCloudMsg );
+                laserCloudMsg.header.stamp = time_stamp;
+                laserCloudMsg.header.frame_id = "/camera_init";
+                m_pub_laser_cloud_map.publish( laserCloudMsg );
+            }
+
+            // Queued before the frame of the same registration, so nothing is left behind when the frame is dropped.
+            Publish_map_frame map_frame;
+            while ( m_queue_publish_map.try_pop( map_frame ) )
+            {
+                ros::Time map_time_stamp = ros::Time().fromSec( map_frame.m_time_stamp );
+                if ( map_frame.m_if_map_delta )
+                {
+                    cubes_to_ros_msg( map_frame.m_map_delta, map_frame.m_map_removed_ids, laserCloudMsg );
+                    laserCloudMsg.header.stamp = map_time_stamp;
+                    m_pub_laser_cloud_map_delta.publish( laserCloudMsg );
+                }
+
+                if ( map_frame.m_if_map_snapshot )
+                {
+                    cubes_to_ros_msg( map_frame.m_map_snapshot, std::vector<Points_cube_map::Cube_id>(), laserCloudMsg );
+                    laserCloudMsg.header.stamp = map_time_stamp;
+                    m_pub_laser_cloud_map_snapshot.publish( laserCloudMsg );
+                }
+
+                if ( map_frame.m_if_save_map )
+                {
+                    save_map( map_frame );
+                }
+            }
+
+            if ( frame.m_full != nullptr )
+            {
+                pcl::PointCloud<PointType>      full_res_filtered;
+                pcl::UniformSampling<PointType> filter;
+                filter.setInputCloud( frame.m_full );
+                filter.setRadiusSearch( m_map_downsample_para );
+                filter.filter( full_res_filtered );
+                printf( "after fileter %d\n", ( int ) full_res_filtered.points.size() );
+
+                if ( frame.m_if_publish_full )
+                {
+                    pcl::toROSMsg( full_res_filtered, laserCloudMsg );
+                    laserCloudMsg.header.stamp = time_stamp;
+                    laserCloudMsg.header.frame_id = "/camera_init";
+                    m_pub_laser_cloud_full_res.publish( laserCloudMsg ); //single_frame_with_pose_tranfromed
+                }
+
+                if ( m_if_save_to_pcd_files )
+                {
+                    m_pcl_tools_aftmap.save_to_pcd_files( "aft_mapp", full_res_filtered, 1 );
+                }
+            }
+
+            {
+                std::unique_lock<std::mutex> lock( m_mutex_path );
+                m_laser_after_mapped_path.poses.insert( m_laser_after_mapped_path.poses.end(), m_path_poses_to_publish.begin(), m_path_poses_to_publish.end() );
+                m_path_poses_to_publish.clear();
+            }
+            if ( m_pub_laser_aft_mapped_path.is_due( ros::Time::now().toSec() ) )
+            {
+                m_laser_after_mapped_path.header.stamp = frame.m_odom.header.stamp;
+                m_laser_after_mapped_path.header.frame_id = "/camera_init";
+                m_pub_laser_aft_mapped_path.publish( m_laser_after_mapped_path );
+            }
+        }
+    }
+
+    // Mapping runs in three stages connected by bounded queues: decode_process() -> registration and
+    // map update in this thread -> publish_process(), so that decoding of the next frame and publishing
+    // of the last frame overlap with registration. Odometry and tf are published here right after
+    // registration, never behind cloud publishing or disk I/O.
+    void process()
+    {
+        std::thread decode_thread( &Laser_mapping::decode_process, this );
+        std::thread publish_thread( &Laser_mapping::publish_process, this );
+        double first_time_stamp = -1;
+        m_last_max_blur = 0.0;
+        while ( 1 )
+        {
+            {
+                Mapping_frame frame;
+                if ( !m_queue_decoded_frame.pop( frame ) )
+                {
+                    break;
+                }
+
+                m_file_logger.printf( "------------------\r\n" );
+
+                for ( size_t i = 0; i < frame.m_drop_num; i++ )
+                {
+                    ( *m_file_logger.get_ostream() ) << "Drop lidar frame in mapping for real time performance !!!" << endl;
+                }
+                m_drop_frame_num += frame.m_drop_num;
+                {
+                    std::unique_lock<std::mutex> lock( m_mutex_buf );
+                    m_file_logger.printf( "Frames completed %d, dropped %d, incomplete evicted %d, duplicated clouds %d, pending %d, time jumps %d \r\n",
+                                          ( int ) m_data_pair_sync.m_complete_num, ( int ) m_drop_frame_num, ( int ) m_data_pair_sync.m_evict_num,
+                                          ( int ) m_data_pair_sync.m_duplicate_num, m_data_pair_sync.get_pending_num(), ( int ) m_data_pair_sync.m_time_jump_num );
+                }
+
+                m_time_pc_corner_past = frame.m_time_stamp;
+
+                if ( first_time_stamp < 0 )
+                {
+                    first_time_stamp = m_time_pc_corner_past;
+                }
+
+                double begin_time_f = ros::Time::now().toSec();
+
+                ( *m_file_logger.get_ostream() ) << "Messgage time stamp = " << m_time_pc_corner_past - first_time_stamp << endl;
+
+                m_laser_cloud_corner_last = frame.m_corner;
+                m_laser_cloud_surf_last = frame.m_surface;
+                Common_tools::Point_cloud2_view full_view( *frame.m_full_msg );
+                float max_t = frame.m_max_intensity;
+
+                Publish_frame publish_frame;
+                publish_frame.m_time_stamp = m_time_odom;
+                Publish_map_frame map_frame;
+                map_frame.m_time_stamp = m_time_odom;
+
+                m_q_w_last = m_q_w_curr;
+                m_t_w_last = m_t_w_curr;
+                m_minimum_pt_time_stamp = m_last_time_stamp;
+                m_maximum_pt_time_stamp = max_t;
+                m_last_time_stamp = max_t;
+                reset_incremtal_parameter();//m_para_buffer_incremental， m_q_w_incre ， m_t_w_incre初始化为 0
+
+                //100 * 100 * 100的 CUBE， 每个CUBE长宽高都是 50 米
+                //为什么要 加上 m_cube_map.m_center_width 这个数值,这是因为计算索引都是正整数，需要统一向右平移50个 CUBE，也即2500米
+                int centerCubeI, centerCubeJ, centerCubeK;
+                m_cube_map.get_cube_index( m_t_w_curr.x(), m_t_w_curr.y(), m_t_w_curr.z(), centerCubeI, centerCubeJ, centerCubeK );
+
+                //printf( "****** min max timestamp = [%.6f, %.6f] ****** \r\n", m_minimum_pt_time_stamp, m_maximum_pt_time_stamp );
+                printf( "****** min max timestamp = [%.6f, %.6f] [%d %d %d]****** \r\n", m_minimum_pt_time_stamp, m_maximum_pt_time_stamp,centerCubeI, centerCubeJ, centerCubeK);
+
+                //这几个循环语句 是作为调整CUBE中心用的， 如果地图增的太大，超出了100 * 100 * 100 CUBE 的范围，那么需要我们将整体CUBE的中心移动一下，删除太老的区域， 添加新的空区域，同时还保证了总体数据量不变
+                while ( centerCubeI < 3 )//如果左下角不够用了，需要删除右上角的区域，给左下角用
+                {
+                    m_cube_map.shift_cubes( 1, 0, 0 );
+                    centerCubeI++;
+                }
+
+                while ( centerCubeI >= m_cube_map.m_width - 3 )//如果右上角不够用了，需要删除左下角的区域，给右上角用
+                {
+                    m_cube_map.shift_cubes( -1, 0, 0 );
+                    centerCubeI--;
+                }
+
+                while ( centerCubeJ < 3 )//如果Y负向不够用了，需要删除Y正向的区域，给Y负向用
+                {
+                    m_cube_map.shift_cubes( 0, 1, 0 );
+                    centerCubeJ++;
+                }
+
+                while ( centerCubeJ >= m_cube_map.m_height - 3 )//如果Y正向不够用了，需要删除Y负向的区域，给Y正向用
+                {
+                    m_cube_map.shift_cubes( 0, -1, 0 );
+                    centerCubeJ--;
+                }
+
+                while ( centerCubeK < 3 )//如果Z负向不够用了，需要删除Z正向的区域，给Z负向用
+                {
+                    m_cube_map.shift_cubes( 0, 0, 1 );
+                    centerCubeK++;
+                }
+
+                while ( centerCubeK >= m_cube_map.m_depth - 3 )//如果Z正向不够用了，需要删除Z负向的区域，给Z正向用
+                {
+                    m_cube_map.shift_cubes( 0, 0, -1 );
+                    centerCubeK--;
+                }
+
+                int laserCloudValidNum = 0;
+                int laserCloudSurroundNum = 0;
 
-                int laserCloudValidNum = 0;
-                int laserCloudSurroundNum = 0;
-
                 // CUBE(I,J,K)周围 5 x 5 x 3范围的为相邻CUBE
                 for ( int i = centerCubeI - 2; i <= centerCubeI + 2; i++ )
                 {
@@ -849,59 +1721,78 @@ class Laser_mapping
                     {
                         for ( int k = centerCubeK - 1; k <= centerCubeK + 1; k++ )
                         {
-                            if ( i >= 0 && i < m_para_laser_cloud_width &&
-                                 j >= 0 && j < m_para_laser_cloud_height &&
-                                 k >= 0 && k < m_para_laser_cloud_depth )
+                            if ( m_cube_map.is_in_grid( i, j, k ) )
                             {
-                                m_laser_cloud_valid_Idx[ laserCloudValidNum ] = i + m_para_laser_cloud_width * j + m_para_laser_cloud_width * m_para_laser_cloud_height * k;
+                                m_laser_cloud_valid_Idx[ laserCloudValidNum ] = m_cube_map.get_cube_id( i, j, k );
                                 laserCloudValidNum++;
-                                m_laser_cloud_surround_Idx[ laserCloudSurroundNum ] = i + m_para_laser_cloud_width * j + m_para_laser_cloud_width * m_para_laser_cloud_height * k;
+                                m_laser_cloud_surround_Idx[ laserCloudSurroundNum ] = m_cube_map.get_cube_id( i, j, k );
                                 laserCloudSurroundNum++;
                             }
                         }
                     }
                 }
 
-                //MAP中的角点和平面点,从相邻的cube中取出所有的角点和面点，认为是MAP点
-                m_laser_cloud_corner_from_map->clear();
-                m_laser_cloud_surf_from_map->clear();
-
-                for ( int i = 0; i < laserCloudValidNum; i++ )
+                if ( m_map_tile_store )
                 {
-                    *m_laser_cloud_corner_from_map += *m_laser_cloud_corner_array[ m_laser_cloud_valid_Idx[ i ] ];
-                    *m_laser_cloud_surf_from_map += *m_laser_cloud_surface_array[ m_laser_cloud_valid_Idx[ i ] ];
+                    double                         paging_time = ros::Time::now().toSec();
+                    std::vector<Voxel_primitive *> paged_in_primitives;
+                    m_map_tile_store->update( m_cube_map, m_t_w_curr, m_laser_cloud_valid_Idx, laserCloudValidNum, paged_in_primitives );
+                    m_thread_pool.parallel_for( paged_in_primitives.size(), [&]( int begin, int end, int block_idx ) {
+                        for ( int i = begin; i < end; i++ )
+                        {
+                            paged_in_primitives[ i ]->fit();
+                        }
+                    } );
+                    m_file_logger.printf( "Map paging: %d cubes in memory, %d on disk, paged out %d, in %d ( %d not prefetched ), io error %d, cost %f \r\n",
+                                          ( int ) m_cube_map.size(), ( int ) m_map_tile_store->size(), ( int ) m_map_tile_store->m_page_out_num,
+                                          ( int ) m_map_tile_store->m_page_in_num, ( int ) m_map_tile_store->m_sync_page_in_num,
+                                          ( int ) m_map_tile_store->m_io_error_num, ros::Time::now().toSec() - paging_time );
                 }
 
-                int laserCloudCornerFromMapNum = m_laser_cloud_corner_from_map->points.size();
-                int laserCloudSurfFromMapNum = m_laser_cloud_surf_from_map->points.size();
-
-                //对最新数据帧的角点 滤波
-                pcl::PointCloud<PointType>::Ptr laserCloudCornerStack( new pcl::PointCloud<PointType>() );
-                m_down_sample_filter_corner.setInputCloud( m_laser_cloud_corner_last );
-                m_down_sample_filter_corner.filter( *laserCloudCornerStack );
-                //laserCloudCornerStack = m_laser_cloud_corner_last;
+                //MAP中的角点和平面点,从相邻的cube中取出所有的角点和面点，认为是MAP点
+                double map_search_build_time = ros::Time::now().toSec();
+                m_map_search_backend->update_window( m_cube_map, m_laser_cloud_valid_Idx, laserCloudValidNum );
+                map_search_build_time = ros::Time::now().toSec() - map_search_build_time;
+                int laserCloudCornerFromMapNum = m_map_search_backend->size( 1 );
+                int laserCloudSurfFromMapNum = m_map_search_backend->size( 0 );
+                double map_search_query_time = 0;
+
+                //最新数据帧的角点和平面点, 已在 decode_process 中滤波
+                pcl::PointCloud<PointType>::Ptr laserCloudCornerStack = frame.m_corner_stack;
                 int laser_corner_pt_num = laserCloudCornerStack->points.size();
 
-
-                //对最新数据帧中的平面点 滤波
-                pcl::PointCloud<PointType>::Ptr laserCloudSurfStack( new pcl::PointCloud<PointType>() );
-                m_down_sample_filter_surface.setInputCloud( m_laser_cloud_surf_last );
-                m_down_sample_filter_surface.filter( *laserCloudSurfStack );
-                //laserCloudSurfStack = m_laser_cloud_surf_last;
+                pcl::PointCloud<PointType>::Ptr laserCloudSurfStack = frame.m_surface_stack;
                 int laser_surface_pt_num = laserCloudSurfStack->points.size();
 
+                // 特征点在MAP中的坐标
+                pcl::PointCloud<PointType>::Ptr laserCloudCornerStackMap( new pcl::PointCloud<PointType>() );
+                pcl::PointCloud<PointType>::Ptr laserCloudSurfStackMap( new pcl::PointCloud<PointType>() );
+
+                // Associations of last frame are meaningless for new points.
+                m_corner_correspondence_caches.assign( laser_corner_pt_num, Icp_correspondence_cache() );
+                m_surface_correspondence_caches.assign( laser_surface_pt_num, Icp_correspondence_cache() );
+
                 printf( "map corner num %d  surf num %d \n", laserCloudCornerFromMapNum, laserCloudSurfFromMapNum );
 
                 int                    surf_avail_num = 0;
                 int                    corner_avail_num = 0;
                 ceres::Solver::Summary summary;
+                Icp_lm_solver::Summary lm_summary;
+                int                    residual_block_num = 0;
                 float                  angular_diff = 0;
                 float                  t_diff = 0;
                 float                  minimize_cost = summary.final_cost;
                 PointType              pointOri, pointSel;
                 int                    corner_rejection_num = 0;
                 int                    surface_rejecetion_num = 0;
+                int                    corner_search_num = 0; // points associated again in all ICP iterations
+                int                    surface_search_num = 0;
                 int                    if_undistore_in_matching = 1;
+                int                    icp_iteration_num = 0;
+                int                    correspondence_change_num = 0; // in the last ICP iteration
+                int                    residual_found_num = 0; // correspondences before and after Icp_residual_selector
+                int                    residual_select_num = 0;
+                m_icp_solver_iteration_num = 0;
 
 
                 double map_get_time_f = ros::Time::now().toSec();
@@ -909,284 +1800,97 @@ class Laser_mapping
                 //局部MAP中的角点和平面点数量满足阈值时，计算
                 if ( laserCloudCornerFromMapNum > CORNER_MIN_MAP_NUM && laserCloudSurfFromMapNum > SURFACE_MIN_MAP_NUM && frameCount > m_mapping_init_accumulate_frames )
                 {
-                    m_kdtree_corner_from_map->setInputCloud( m_laser_cloud_corner_from_map );
-                    m_kdtree_surf_from_map->setInputCloud( m_laser_cloud_surf_from_map );
+                    if ( m_para_if_motion_prior )
+                    {
+                        Eigen::Quaterniond q_prior;
+                        Eigen::Vector3d    t_prior;
+                        int                prior_source = m_motion_prior.predict( frame.m_time_stamp, q_prior, t_prior );
+                        m_q_w_incre = q_prior;
+                        m_t_w_incre = t_prior;
+                        m_t_w_incre_prior = t_prior;
+                        m_t_w_curr = m_q_w_last * m_t_w_incre + m_t_w_last;
+                        m_q_w_curr = m_q_w_last * m_q_w_incre;
+                        m_file_logger.printf( "Motion prior %s, angle = %.3f deg, T = %.3f \r\n",
+                                              prior_source == Motion_prior::e_imu ? "imu" : ( prior_source == Motion_prior::e_constant_velocity ? "constant velocity" : "none" ),
+                                              Eigen::AngleAxisd( q_prior ).angle() * 57.3, t_prior.norm() );
+                    }
 
                     //ICP最大迭代次数
                     for ( int iterCount = 0; iterCount < m_para_icp_max_iterations; iterCount++ )
                     {
+                        icp_iteration_num = iterCount + 1;
+                        correspondence_change_num = 0;
                         corner_avail_num = 0;
                         surf_avail_num = 0;
                         corner_rejection_num = 0;
                         surface_rejecetion_num = 0;
 
-                        ceres::LossFunction *               loss_function = new ceres::HuberLoss( 0.1 );//Huber Loss 是一个用于回归问题的带参损失函数, 优点是能增强平方误差损失函数(MSE, mean square error)对离群点的鲁棒性。
-                        ceres::LocalParameterization *      q_parameterization = new ceres::EigenQuaternionParameterization();
-                        ceres::Problem::Options             problem_options;
-                        ceres::ResidualBlockId              block_id;
-                        ceres::Problem                      problem( problem_options );
-                        std::vector<ceres::ResidualBlockId> residual_block_ids;
-
-                        problem.AddParameterBlock( m_para_buffer_incremental, 4, q_parameterization );//前四个参数为旋转四元数(R)
-                        problem.AddParameterBlock( m_para_buffer_incremental + 4, 3 );//后三个参数为平移参数(T)
-
-                        //计算角点残茶
-                        for ( int i = 0; i < laser_corner_pt_num; i++ )
+                        #if 1//点的顺序没错，因此时间戳在整帧中归一化之后还是对的
+                        static bool printflag_ = true;
+                        if ( printflag_ && ( 674 < laser_corner_pt_num ) )
                         {
-                            pointOri = laserCloudCornerStack->points[ i ];
-                            //通过平移旋转消除 运动失真
-                            pointAssociateToMap( &pointOri, &pointSel, pointOri.intensity, 0/*if_undistore_in_matching*/ );//last parameter allways 1
-
-                            #if 1//点的顺序没错，因此时间戳在整帧中归一化之后还是对的
-                            static bool printflag_ = true;
-                            if(printflag_ && (i == 674))
-                            {
-                                printf("cornerid:%d ath:%f ele:%f int:%f total:%d\n", i, atan2(pointOri.y, pointOri.x)/3.1416 * 180, atan2(pointOri.z, sqrt(pointOri.x * pointOri.x + pointOri.y * pointOri.y))/3.1416 * 180,
-                                       pointOri.intensity, laser_corner_pt_num);
-                            }
-                            if(i == (laser_corner_pt_num - 1))
-                            {
-                                printflag_ = false;
-                            }
-                            #endif
-                            //在MAP中寻找5个最近邻点
-                            m_kdtree_corner_from_map->nearestKSearch( pointSel, line_search_num, m_point_search_Idx, m_point_search_sq_dis );
-
-                            //最近邻点的距离平方要求小于2
-                            if ( m_point_search_sq_dis[ line_search_num - 1 ] < 2.0 )
-                            {
-                                bool                         line_is_avail = true;
-                                std::vector<Eigen::Vector3d> nearCorners;
-                                Eigen::Vector3d              center( 0, 0, 0 );
-                                if ( /*IF_LINE_FEATURE_CHECK*/ 1 )//根据5个邻近点的特征值判断 这五个近邻点首否近似一条直线
-                                {
-                                    for ( int j = 0; j < line_search_num; j++ )
-                                    {
-                                        Eigen::Vector3d tmp( m_laser_cloud_corner_from_map->points[ m_point_search_Idx[ j ] ].x,
-                                                             m_laser_cloud_corner_from_map->points[ m_point_search_Idx[ j ] ].y,
-                                                             m_laser_cloud_corner_from_map->points[ m_point_search_Idx[ j ] ].z );
-                                        center = center + tmp;
-                                        nearCorners.push_back( tmp );
-                                    }
-
-                                    center = center / ( ( float ) line_search_num );//五个邻近点的重心
-
-                                    Eigen::Matrix3d covMat = Eigen::Matrix3d::Zero();
-
-                                    for ( int j = 0; j < line_search_num; j++ )
-                                    {
-                                        Eigen::Matrix<double, 3, 1> tmpZeroMean = nearCorners[ j ] - center;//五个邻近点的重心和邻近点组成的向量
-                                        covMat = covMat + tmpZeroMean * tmpZeroMean.transpose();//五个向量的协方差矩阵的和
-                                    }
-
-                                    Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> saes( covMat );//特征值
-
-                                    // if is indeed line feature
-                                    // note Eigen library sort eigenvalues in increasing order
-
-                                    if ( saes.eigenvalues()[ 2 ] > 3 * saes.eigenvalues()[ 1 ] )//最大特征值 大于 次大特征值的3倍 则认为是线条
-                                    {
-                                        line_is_avail = true;
-                                    }
-                                    else
-                                    {
-                                        line_is_avail = false;
-                                    }
-                                }
-
-                                Eigen::Vector3d curr_point( pointOri.x, pointOri.y, pointOri.z );
-
-                                if ( line_is_avail )//近邻点组成了直线
-                                {
-                                    if ( ICP_LINE )// 1
-                                    {
-                                        ceres::CostFunction *cost_function;
-                                        if ( MOTION_DEBLUR )// 1, 是否运动补偿
-                                        {
-                                            cost_function = ceres_icp_point2line<double>::Create( curr_point,//原始激光雷达坐标系中的点
-                                                                                                  pcl_pt_to_eigend( m_laser_cloud_corner_from_map->points[ m_point_search_Idx[ 0 ] ] ),
-                                                                                                  pcl_pt_to_eigend( m_laser_cloud_corner_from_map->points[ m_point_search_Idx[ 1 ] ] ),
-                                                                                                  1.0, //pointOri.intensity * 1.0,
-                                                                                                  Eigen::Matrix<double, 4, 1>( m_q_w_last.w(), m_q_w_last.x(), m_q_w_last.y(), m_q_w_last.z() ),
-                                                                                                  m_t_w_last ); //pointOri.intensity );
-                                        }
-                                        else
-                                        {
-                                            cost_function = ceres_icp_point2line<double>::Create( curr_point,
-                                                                                                  pcl_pt_to_eigend( m_laser_cloud_corner_from_map->points[ m_point_search_Idx[ 0 ] ] ),
-                                                                                                  pcl_pt_to_eigend( m_laser_cloud_corner_from_map->points[ m_point_search_Idx[ 1 ] ] ),
-                                                                                                  1.0,
-                                                                                                  Eigen::Matrix<double, 4, 1>( m_q_w_last.w(), m_q_w_last.x(), m_q_w_last.y(), m_q_w_last.z() ),
-                                                                                                  m_t_w_last );
-                                        }
-                                        block_id = problem.AddResidualBlock( cost_function, loss_function, m_para_buffer_incremental, m_para_buffer_incremental + 4 );//cost, loss, 初始旋转参数， 初始平移参数
-                                        residual_block_ids.push_back( block_id );
-                                    }
-                                    corner_avail_num++;
-                                }
-                                else
-                                {
-                                    corner_rejection_num++;
-                                }
-                            }
+                            pointOri = laserCloudCornerStack->points[ 674 ];
+                            printf("cornerid:%d ath:%f ele:%f int:%f total:%d\n", 674, atan2(pointOri.y, pointOri.x)/3.1416 * 180, atan2(pointOri.z, sqrt(pointOri.x * pointOri.x + pointOri.y * pointOri.y))/3.1416 * 180,
+                                   pointOri.intensity, laser_corner_pt_num);
+                        }
+                        printflag_ = false;
+                        #endif
+
+                        // 当前位姿下所有特征点的MAP坐标, 一次批量计算
+                        pointcloudAssociateToMap( *laserCloudCornerStack, *laserCloudCornerStackMap, 0/*if_undistore_in_matching*/ );
+                        pointcloudAssociateToMap( *laserCloudSurfStack, *laserCloudSurfStackMap, 0/*if_undistore_in_matching*/ );
+
+                        double map_search_start_time = ros::Time::now().toSec();
+                        //计算角点残茶, 各线程在自己的buffer中搜索最近邻, 再按点的顺序合并, 结果与单线程一致
+                        m_thread_pool.parallel_for( laser_corner_pt_num, [&]( int begin, int end, int block_idx ) {
+                            find_corner_correspondences( *laserCloudCornerStack, *laserCloudCornerStackMap, m_corner_correspondence_caches.data(), begin, end, m_search_buffers[ block_idx ] );
+                        } );
+                        m_icp_correspondences.clear();
+                        for ( size_t block_idx = 0; block_idx < m_search_buffers.size(); block_idx++ )
+                        {
+                            m_icp_correspondences.insert( m_icp_correspondences.end(), m_search_buffers[ block_idx ].m_correspondences.begin(), m_search_buffers[ block_idx ].m_correspondences.end() );
+                            corner_rejection_num += m_search_buffers[ block_idx ].m_rejection_num;
+                            corner_search_num += m_search_buffers[ block_idx ].m_search_num;
+                            correspondence_change_num += m_search_buffers[ block_idx ].m_change_num;
                         }
+                        corner_avail_num = m_icp_correspondences.size();
 
                         //计算平面点残茶
-                        for ( int i = 0; i < laser_surface_pt_num; i++ )
+                        m_thread_pool.parallel_for( laser_surface_pt_num, [&]( int begin, int end, int block_idx ) {
+                            find_surface_correspondences( *laserCloudSurfStack, *laserCloudSurfStackMap, m_surface_correspondence_caches.data(), begin, end, m_search_buffers[ block_idx ] );
+                        } );
+                        for ( size_t block_idx = 0; block_idx < m_search_buffers.size(); block_idx++ )
                         {
-
-                            pointOri = laserCloudSurfStack->points[ i ];
-                            int planeValid = true;
-                            pointAssociateToMap( &pointOri, &pointSel, pointOri.intensity, 0/*if_undistore_in_matching*/ );//last parameter allways 1
-
-                            //5个最近邻平面点
-                            m_kdtree_surf_from_map->nearestKSearch( pointSel, plane_search_num, m_point_search_Idx, m_point_search_sq_dis );
-                            //最近邻平面点距离平方的阈值为 10m
-                            if ( m_point_search_sq_dis[ plane_search_num - 1 ] < 10.0 )
-                            {
-                                std::vector<Eigen::Vector3d> nearCorners;
-                                Eigen::Vector3d              center( 0, 0, 0 );
-                                if ( IF_PLANE_FEATURE_CHECK )// 0
-                                {
-                                    for ( int j = 0; j < plane_search_num; j++ )
-                                    {
-                                        Eigen::Vector3d tmp( m_laser_cloud_corner_from_map->points[ m_point_search_Idx[ j ] ].x,
-                                                             m_laser_cloud_corner_from_map->points[ m_point_search_Idx[ j ] ].y,
-                                                             m_laser_cloud_corner_from_map->points[ m_point_search_Idx[ j ] ].z );
-                                        center = center + tmp;
-                                        nearCorners.push_back( tmp );
-                                    }
-
-                                    center = center / ( float ) ( plane_search_num );
-
-                                    Eigen::Matrix3d covMat = Eigen::Matrix3d::Zero();
-
-                                    for ( int j = 0; j < plane_search_num; j++ )
-                                    {
-                                        Eigen::Matrix<double, 3, 1> tmpZeroMean = nearCorners[ j ] - center;
-                                        covMat = covMat + tmpZeroMean * tmpZeroMean.transpose();//协方差矩阵之和
-                                    }
-
-                                    Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> saes( covMat );
-
-                                    if ( ( saes.eigenvalues()[ 2 ] > 3 * saes.eigenvalues()[ 0 ] ) &&//最大特征值 是 最小特征值的3倍， 并且最大特征值 小于次大特征值的 10 倍
-                                         ( saes.eigenvalues()[ 2 ] < 10 * saes.eigenvalues()[ 1 ] ) )
-                                    {
-                                        planeValid = true;
-                                    }
-                                    else
-                                    {
-                                        planeValid = false;
-                                    }
-                                }
-
-                                Eigen::Vector3d curr_point( pointOri.x, pointOri.y, pointOri.z );
-
-                                if ( planeValid )// 1
-                                {
-                                    if ( ICP_PLANE )// 1
-                                    {
-                                        ceres::CostFunction *cost_function;
-
-                                        if ( MOTION_DEBLUR )//1
-                                        {
-                                            cost_function = ceres_icp_point2plane<double>::Create(
-                                                curr_point,
-                                                pcl_pt_to_eigend( m_laser_cloud_surf_from_map->points[ m_point_search_Idx[ 0 ] ] ),
-                                                pcl_pt_to_eigend( m_laser_cloud_surf_from_map->points[ m_point_search_Idx[ plane_search_num / 2 ] ] ),
-                                                pcl_pt_to_eigend( m_laser_cloud_surf_from_map->points[ m_point_search_Idx[ plane_search_num - 1 ] ] ),
-                                                1.0, //pointOri.intensity * BLUR_SCALE,
-                                                Eigen::Matrix<double, 4, 1>( m_q_w_last.w(), m_q_w_last.x(), m_q_w_last.y(), m_q_w_last.z() ),
-                                                m_t_w_last ); //pointOri.intensity );
-                                        }
-                                        else
-                                        {
-                                            cost_function = ceres_icp_point2plane<double>::Create(
-                                                curr_point,
-                                                pcl_pt_to_eigend( m_laser_cloud_surf_from_map->points[ m_point_search_Idx[ 0 ] ] ),
-                                                pcl_pt_to_eigend( m_laser_cloud_surf_from_map->points[ m_point_search_Idx[ plane_search_num / 2 ] ] ),
-                                                pcl_pt_to_eigend( m_laser_cloud_surf_from_map->points[ m_point_search_Idx[ plane_search_num - 1 ] ] ),
-                                                1.0,
-                                                Eigen::Matrix<double, 4, 1>( m_q_w_last.w(), m_q_w_last.x(), m_q_w_last.y(), m_q_w_last.z() ),
-                                                m_t_w_last );
-                                        }
-                                        block_id = problem.AddResidualBlock( cost_function, loss_function, m_para_buffer_incremental, m_para_buffer_incremental + 4 );
-                                        residual_block_ids.push_back( block_id );
-                                    }
-                                    surf_avail_num++;
-                                }
-                                else
-                                {
-                                    surface_rejecetion_num++;
-                                }
-                            }
+                            m_icp_correspondences.insert( m_icp_correspondences.end(), m_search_buffers[ block_idx ].m_correspondences.begin(), m_search_buffers[ block_idx ].m_correspondences.end() );
+                            surface_rejecetion_num += m_search_buffers[ block_idx ].m_rejection_num;
+                            surface_search_num += m_search_buffers[ block_idx ].m_search_num;
+                            correspondence_change_num += m_search_buffers[ block_idx ].m_change_num;
                         }
-
-                        ceres::Solver::Options options;
-
-                        std::vector<ceres::ResidualBlockId> residual_block_ids_bak;
-                        residual_block_ids_bak = residual_block_ids;
-                        for ( size_t ii = 0; ii < 1; ii++ )
+                        residual_found_num = m_icp_correspondences.size();
+                        residual_select_num = residual_found_num - m_icp_residual_selector.select( m_icp_correspondences, m_q_w_curr );
+                        // Of the selected ones, which are used by the solver
+                        corner_avail_num = 0;
+                        for ( size_t i = 0; i < m_icp_correspondences.size(); i++ )
                         {
-                            options.linear_solver_type = ceres::DENSE_QR;
-                            options.max_num_iterations = m_para_cere_max_iterations;
-                            options.max_num_iterations = 5;
-                            options.minimizer_progress_to_stdout = false;
-                            options.check_gradients = false;
-                            //options.gradient_check_relative_precision = 1e-10;
-                            //options.function_tolerance = 1e-100; // default 1e-6
-
-                            if ( 0 )
-                            {
-                                // NOTE Optimize T first and than R
-                                if ( iterCount < ( m_para_icp_max_iterations - 2 ) / 2 )
-                                    problem.SetParameterBlockConstant( m_para_buffer_incremental + 4 );
-                                else if ( iterCount < m_para_icp_max_iterations - 2 )
-                                    problem.SetParameterBlockConstant( m_para_buffer_incremental );
-                            }
-
-                            set_ceres_solver_bound( problem );//平移限制在相邻两帧数据不超过0.2米(10m/s  /  50Hz)
-
-                            //double bef_solver = ros::Time::now().toSec();
-                            ceres::Solve( options, &problem, &summary );
-                            //printf("sol1[%f]", ros::Time::now().toSec() - bef_solver);
-
-                            // Remove outliers
-                            residual_block_ids_bak.clear();
-
-                            //if ( summary.final_cost > m_max_final_cost * 0.001 )
-                            //评估残差点， 删除残差较大的点（移除残差绝对值之和 大于 std::min( 0.1, 10 * avr_cost ) 的点）
-                            if ( 1 )
-                            {
-                                ceres::Problem::EvaluateOptions eval_options;
-                                eval_options.residual_blocks = residual_block_ids;
-                                double         total_cost = 0.0;
-                                double         avr_cost;
-                                vector<double> residuals;
-                                problem.Evaluate( eval_options, &total_cost, &residuals, nullptr, nullptr );
-                                avr_cost = total_cost / residual_block_ids.size();//平均cost值
-
-                                for ( unsigned int i = 0; i < residual_block_ids.size(); i++ )
-                                {
-                                    if ( ( fabs( residuals[ 3 * i + 0 ] ) + fabs( residuals[ 3 * i + 1 ] ) + fabs( residuals[ 3 * i + 2 ] ) ) > std::min( 0.1, 10 * avr_cost ) ) // std::min( 1.0, 10 * avr_cost )
-                                    {
-                                        problem.RemoveResidualBlock( residual_block_ids[ i ] );
-                                    }
-                                    else
-                                    {
-                                        residual_block_ids_bak.push_back( residual_block_ids[ i ] );
-                                    }
-                                }
-                            }
-
-                            residual_block_ids = residual_block_ids_bak;
+                            corner_avail_num += m_icp_correspondences[ i ].m_type == Icp_correspondence::e_point_to_line;
                         }
-                        options.max_num_iterations = m_para_cere_max_iterations;//5
-                        set_ceres_solver_bound( problem );// 平移限制在相邻两帧数据不超过0.2米(10m/s  /  50Hz)
+                        surf_avail_num = residual_select_num - corner_avail_num;
+                        map_search_query_time += ros::Time::now().toSec() - map_search_start_time;
 
-                        //double bef_solver_2 = ros::Time::now().toSec();
-                        ceres::Solve( options, &problem, &summary );
-                        //printf("sol2[%f]", ros::Time::now().toSec() - bef_solver_2);
+                        Eigen::Quaterniond q_w_iter_last = m_q_w_curr;
+                        Eigen::Vector3d    t_w_iter_last = m_t_w_curr;
+                        float              iter_last_cost = minimize_cost;
+                        if ( m_para_icp_solver_type == 1 )
+                        {
+                            solve_icp_with_lm( lm_summary );
+                            minimize_cost = lm_summary.m_final_cost;
+                            residual_block_num = lm_summary.m_residual_num;
+                        }
+                        else
+                        {
+                            residual_block_num = solve_icp_with_ceres( summary, iterCount );
+                            minimize_cost = summary.final_cost;
+                        }
 
                         if ( MOTION_DEBLUR )
                         {
@@ -1200,34 +1904,59 @@ class Laser_mapping
 
                         angular_diff = ( float ) m_q_w_curr.angularDistance( m_q_w_last ) * 57.3;//57.3 is degree/rad
                         t_diff = ( m_t_w_curr - m_t_w_last ).norm();
-                        minimize_cost = summary.final_cost;
+
+                        // Converged: the correspondences are stable, and the pose or the cost stop changing
+                        if ( m_para_icp_if_early_termination && icp_iteration_num >= m_para_icp_min_iterations )
+                        {
+                            bool if_correspondence_stable = correspondence_change_num <= m_para_icp_converge_correspondence_change * std::max( laser_corner_pt_num + laser_surface_pt_num, 1 );
+                            bool if_pose_converged = ( m_t_w_curr - t_w_iter_last ).norm() < m_para_icp_converge_translation &&
+                                                     m_q_w_curr.angularDistance( q_w_iter_last ) * 57.3 < m_para_icp_converge_rotation;
+                            bool if_cost_converged = fabs( iter_last_cost - minimize_cost ) < m_para_icp_converge_cost_ratio * iter_last_cost;
+                            if ( if_correspondence_stable && ( if_pose_converged || if_cost_converged ) )
+                            {
+                                break;
+                            }
+                        }
                     }
 
                     printf( "===== corner factor num %d , surf factor num %d=====\n", corner_avail_num, surf_avail_num );
+                    m_file_logger.printf( "ICP iterations %d / %d, solver iterations %d, correspondences changed in last iteration %d \r\n",
+                                          icp_iteration_num, m_para_icp_max_iterations, m_icp_solver_iteration_num, correspondence_change_num );
+                    if ( residual_select_num < residual_found_num )
+                    {
+                        m_file_logger.printf( "Select %d of %d residuals, min information of rotation %g -> %g, translation %g -> %g \r\n",
+                                              residual_select_num, residual_found_num,
+                                              m_icp_residual_selector.m_min_info_rotation[ 0 ], m_icp_residual_selector.m_min_info_rotation[ 1 ],
+                                              m_icp_residual_selector.m_min_info_translation[ 0 ], m_icp_residual_selector.m_min_info_translation[ 1 ] );
+                    }
 
                     if ( laser_corner_pt_num != 0 && laser_surface_pt_num != 0 )
                     {
                         m_file_logger.printf( "Corner  total num %d |  use %d | rate = %d \% \r\n", laser_corner_pt_num, corner_avail_num, ( corner_avail_num ) *100 / laser_corner_pt_num );
                         m_file_logger.printf( "Surface total num %d |  use %d | rate = %d \% \r\n", laser_surface_pt_num, surf_avail_num, ( surf_avail_num ) *100 / laser_surface_pt_num );
+                        m_file_logger.printf( "Associate corner %d times, surface %d times \r\n", corner_search_num, surface_search_num );
+                        m_file_logger.printf( "Map search %s, build %.3f ms, query %.3f ms, %.3f us per query \r\n", m_map_search_backend->name(),
+                                              map_search_build_time * 1000.0, map_search_query_time * 1000.0,
+                                              map_search_query_time * 1e6 / std::max( corner_search_num + surface_search_num, 1 ) );
                     }
 
-                    *( m_file_logger.get_ostream() ) << summary.BriefReport() << endl;
+                    *( m_file_logger.get_ostream() ) << ( m_para_icp_solver_type == 1 ? lm_summary.brief_report() : summary.BriefReport() ) << endl;
                     //*( m_file_logger.get_ostream() ) << m_q_w_incre.toRotationMatrix().eulerAngles( 0, 1, 2 ).transpose() * 57.3 << endl;
                     //*( m_file_logger.get_ostream() ) << m_t_w_incre.transpose() << endl;
                     *( m_file_logger.get_ostream() ) << "Last R:" << m_q_w_last.toRotationMatrix().eulerAngles( 0, 1, 2 ).transpose() * 57.3 << " ,T = " << m_t_w_last.transpose() << endl;
                     *( m_file_logger.get_ostream() ) << "Curr R:" << m_q_w_curr.toRotationMatrix().eulerAngles( 0, 1, 2 ).transpose() * 57.3 << " ,T = " << m_t_w_curr.transpose() << endl;
                     //*(g_file_logger.get_ostream()) << summary.FullReport() << endl;
-                    *( m_file_logger.get_ostream() ) << "Full pointcloud size: " << m_laser_cloud_full_res->points.size() << endl;
+                    *( m_file_logger.get_ostream() ) << "Full pointcloud size: " << full_view.size() << endl;
 
                     m_file_logger.printf( "Motion blur = %d | ", MOTION_DEBLUR );
                     m_file_logger.printf( "Cost = %.2f| blk_size = %d | corner_num = %d | surf_num = %d | angle dis = %.2f | T dis = %.2f \r\n",
-                                          minimize_cost, summary.num_residual_blocks, corner_avail_num, surf_avail_num, angular_diff, t_diff );
+                                          minimize_cost, residual_block_num, corner_avail_num, surf_avail_num, angular_diff, t_diff );
 
                     //计算值不合理，不采用
                     if ( angular_diff > m_para_max_angular_rate || minimize_cost > m_max_final_cost )
                     {
                         *( m_file_logger.get_ostream() ) << "**** Reject update **** " << endl;
-                        *( m_file_logger.get_ostream() ) << summary.FullReport() << endl;
+                        *( m_file_logger.get_ostream() ) << ( m_para_icp_solver_type == 1 ? lm_summary.brief_report() : summary.FullReport() ) << endl;
                         for ( int i = 0; i < 7; i++ )
                         {
                             m_para_buffer_RT[ i ] = m_para_buffer_RT_last[ i ];
@@ -1236,59 +1965,140 @@ class Laser_mapping
                         m_last_time_stamp = m_minimum_pt_time_stamp;
                         m_q_w_curr = m_q_w_last;
                         m_t_w_curr = m_t_w_last;
+                        m_motion_prior.reset( frame.m_time_stamp );
                         continue;
                     }
+                    m_motion_prior.update( frame.m_time_stamp, m_q_w_incre, m_t_w_incre );
                 }
                 else
                 {
                     ROS_WARN( "time Map corner and surf num are not enough" );
+                    m_motion_prior.reset( frame.m_time_stamp );
                 }
 
                 double iterator_end_time_f = ros::Time::now().toSec();
 
-                if ( 1/*!PUB_DEBUG_INFO*/ )
+                //时间为 零， ？？？
+                nav_msgs::Odometry odomAftMapped;
+                odomAftMapped.header.frame_id = "/camera_init";
+                odomAftMapped.child_frame_id = "/aft_mapped";
+                //odomAftMapped.header.stamp = ros::Time().fromSec( m_time_odom );
+                odomAftMapped.header.stamp = ros::Time::now();
+                if ( 1 )
                 {
-                    pcl::PointCloud<PointType> pc_feature_pub_corners, pc_feature_pub_surface;
-                    sensor_msgs::PointCloud2   laserCloudMsg;
+                    odomAftMapped.pose.pose.orientation.x = m_q_w_curr.x();
+                    odomAftMapped.pose.pose.orientation.y = m_q_w_curr.y();
+                    odomAftMapped.pose.pose.orientation.z = m_q_w_curr.z();
+                    odomAftMapped.pose.pose.orientation.w = m_q_w_curr.w();
 
-                    pointcloudAssociateToMap( *m_laser_cloud_surf_last, pc_feature_pub_surface, 0/*g_if_undistore*/ );
-                    pcl::toROSMsg( pc_feature_pub_surface, laserCloudMsg );
-                    laserCloudMsg.header.stamp = ros::Time().fromSec( m_time_odom );
-                    laserCloudMsg.header.frame_id = "/camera_init";
-                    m_pub_last_surface_pts.publish( laserCloudMsg );
-                    pointcloudAssociateToMap( *m_laser_cloud_corner_last, pc_feature_pub_corners, 0/*g_if_undistore*/ );
-                    pcl::toROSMsg( pc_feature_pub_corners, laserCloudMsg );
-                    laserCloudMsg.header.stamp = ros::Time().fromSec( m_time_odom );
-                    laserCloudMsg.header.frame_id = "/camera_init";
-                    m_pub_last_corner_pts.publish( laserCloudMsg );//feature corners
+                    odomAftMapped.pose.pose.position.x = m_t_w_curr.x();
+                    odomAftMapped.pose.pose.position.y = m_t_w_curr.y();
+                    odomAftMapped.pose.pose.position.z = m_t_w_curr.z();
+                }
+                else
+                {
+                    Eigen::Quaterniond q_s_half, q_pub;
+                    Eigen::Vector3d    t_s_half, t_pub;
+                    t_s_half = m_t_w_incre * 0.5;
+                    q_s_half = m_q_I.slerp( 0.5, m_q_w_incre );
+
+                    t_pub = m_q_w_last * t_s_half + m_t_w_last;
+                    q_pub = m_q_w_last * q_s_half;
+                    odomAftMapped.pose.pose.orientation.x = q_pub.x();
+                    odomAftMapped.pose.pose.orientation.y = q_pub.y();
+                    odomAftMapped.pose.pose.orientation.z = q_pub.z();
+                    odomAftMapped.pose.pose.orientation.w = q_pub.w();
+
+                    odomAftMapped.pose.pose.position.x = t_pub.x();
+                    odomAftMapped.pose.pose.position.y = t_pub.y();
+                    odomAftMapped.pose.pose.position.z = t_pub.z();
+                }
+                m_pub_odom_aft_mapped.publish( odomAftMapped ); // name: Odometry aft_mapped_to_init
+                publish_frame.m_odom = odomAftMapped;
+                {
+                    // Poses are never dropped with publish_frame, the path is complete.
+                    geometry_msgs::PoseStamped laserAfterMappedPose;
+                    laserAfterMappedPose.header = odomAftMapped.header;
+                    laserAfterMappedPose.pose = odomAftMapped.pose.pose;
+                    std::unique_lock<std::mutex> lock( m_mutex_path );
+                    m_path_poses_to_publish.push_back( laserAfterMappedPose );
                 }
 
+                static tf::TransformBroadcaster br;
+                tf::Transform                   transform;
+                tf::Quaternion                  q;
+                transform.setOrigin( tf::Vector3( m_t_w_curr( 0 ),
+                                                  m_t_w_curr( 1 ),
+                                                  m_t_w_curr( 2 ) ) );
+                q.setW( m_q_w_curr.w() );
+                q.setX( m_q_w_curr.x() );
+                q.setY( m_q_w_curr.y() );
+                q.setZ( m_q_w_curr.z() );
+                transform.setRotation( q );
+                br.sendTransform( tf::StampedTransform( transform, odomAftMapped.header.stamp, "/camera_init", "/aft_mapped" ) );
+
+                // Only build the clouds which somebody subscribes and are due by the rate limits
+                double publish_time = ros::Time::now().toSec();
+                if ( 1/*!PUB_DEBUG_INFO*/ )
+                {
+                    if ( m_pub_last_surface_pts.is_due( publish_time ) )
+                    {
+                        pcl::PointCloud<PointType>::Ptr pc_feature_pub_surface( new pcl::PointCloud<PointType>() );
+                        pointcloudAssociateToMap( *m_laser_cloud_surf_last, *pc_feature_pub_surface, 0/*g_if_undistore*/ );
+                        publish_frame.m_surface = pc_feature_pub_surface;
+                    }
+                    if ( m_pub_last_corner_pts.is_due( publish_time ) )
+                    {
+                        pcl::PointCloud<PointType>::Ptr pc_feature_pub_corners( new pcl::PointCloud<PointType>() );
+                        pointcloudAssociateToMap( *m_laser_cloud_corner_last, *pc_feature_pub_corners, 0/*g_if_undistore*/ );
+                        publish_frame.m_corner = pc_feature_pub_corners;
+                    }
+                }
+
+                // Voxels of the window cubes changed by this frame, the search backend gets their centroids afterwards
+                std::vector<std::pair<Points_cube *, int>> changed_voxels[ 2 ]; // surface, corner
+                std::unordered_set<int64_t>                changed_voxel_keys[ 2 ];
+                std::vector<PointType>                     old_centroids[ 2 ];
+                std::vector<Voxel_primitive *>             changed_primitives;
+                int                                        pt_idx;
+                PointType                                  old_centroid;
+
+                pointcloudAssociateToMap( *laserCloudCornerStack, *laserCloudCornerStackMap, 0/*g_if_undistore*/ );
+                pointcloudAssociateToMap( *laserCloudSurfStack, *laserCloudSurfStackMap, 0/*g_if_undistore*/ );
+
                 //对每个角点计算点的cube 编号，然后将点放入 cube中
                 for ( int i = 0; i < laser_corner_pt_num; i++ )
                 {
                     //if ( MOTION_DEBLUR && ( laserCloudSurfStack->points[ i ].intensity < m_para_min_match_blur ) )
                     //*( m_file_logger.get_ostream() ) << __FILE__ << " --- " << __LINE__ << endl;
-                    pointAssociateToMap( &laserCloudCornerStack->points[ i ], &pointSel, laserCloudCornerStack->points[ i ].intensity, 0/*g_if_undistore*/ );
-
-                    int cubeI = int( ( pointSel.x + CUBE_W / 2 ) / CUBE_W ) + m_para_laser_cloud_center_width;
-                    int cubeJ = int( ( pointSel.y + CUBE_H / 2 ) / CUBE_H ) + m_para_laser_cloud_center_height;
-                    int cubeK = int( ( pointSel.z + CUBE_D / 2 ) / CUBE_D ) + m_para_laser_cloud_center_depth;
-
-                    if ( pointSel.x + CUBE_W / 2 < 0 )
-                        cubeI--;
-
-                    if ( pointSel.y + CUBE_H / 2 < 0 )
-                        cubeJ--;
+                    pointSel = laserCloudCornerStackMap->points[ i ];
 
-                    if ( pointSel.z + CUBE_D / 2 < 0 )
-                        cubeK--;
+                    int cubeI, cubeJ, cubeK;
+                    m_cube_map.get_cube_index( pointSel.x, pointSel.y, pointSel.z, cubeI, cubeJ, cubeK );
 
-                    if ( cubeI >= 0 && cubeI < m_para_laser_cloud_width &&
-                         cubeJ >= 0 && cubeJ < m_para_laser_cloud_height &&
-                         cubeK >= 0 && cubeK < m_para_laser_cloud_depth )
+                    if ( m_cube_map.is_in_grid( cubeI, cubeJ, cubeK ) )
                     {
-                        int cubeInd = cubeI + m_para_laser_cloud_width * cubeJ + m_para_laser_cloud_width * m_para_laser_cloud_height * cubeK;
-                        m_laser_cloud_corner_array[ cubeInd ]->push_back( pointSel );
+                        Points_cube *cube = m_cube_map.get_cube( m_cube_map.get_cube_id( cubeI, cubeJ, cubeK ) );
+                        // Merged into the map resolution at insertion, no down sampling of the cube afterwards
+                        bool if_new_voxel = cube->add_point( 1, pointSel, m_line_resolution, &pt_idx, &old_centroid );
+                        if ( m_para_if_voxel_primitive )
+                        {
+                            Voxel_primitive *primitive = cube->m_corner_primitives.add_point( pcl_pt_to_eigend( pointSel ), m_cube_map.m_primitive_voxel_size );
+                            if ( primitive != nullptr )
+                            {
+                                changed_primitives.push_back( primitive );
+                            }
+                        }
+                        // Only the first change of a voxel in this frame knows its centroid in the backend
+                        if ( abs( cubeI - centerCubeI ) <= 2 && abs( cubeJ - centerCubeJ ) <= 2 && abs( cubeK - centerCubeK ) <= 1 &&
+                             changed_voxel_keys[ 1 ].insert( ( m_cube_map.get_slot_index( cube->m_id ) << 32 ) | pt_idx ).second )
+                        {
+                            changed_voxels[ 1 ].push_back( std::make_pair( cube, pt_idx ) );
+                            if ( !if_new_voxel )
+                            {
+                                old_centroids[ 1 ].push_back( old_centroid );
+                            }
+                        }
                     }
                 }
 
@@ -1296,119 +2106,152 @@ class Laser_mapping
                 for ( int i = 0; i < laser_surface_pt_num; i++ )
                 {
                     //*( m_file_logger.get_ostream() ) << __FILE__ << " --- " << __LINE__ << endl;
-                    pointAssociateToMap( &laserCloudSurfStack->points[ i ], &pointSel, laserCloudSurfStack->points[ i ].intensity, 0/*g_if_undistore*/);
-
-                    int cubeI = int( ( pointSel.x + CUBE_W / 2 ) / CUBE_W ) + m_para_laser_cloud_center_width;
-                    int cubeJ = int( ( pointSel.y + CUBE_H / 2 ) / CUBE_H ) + m_para_laser_cloud_center_height;
-                    int cubeK = int( ( pointSel.z + CUBE_D / 2 ) / CUBE_D ) + m_para_laser_cloud_center_depth;
-
-                    if ( pointSel.x + CUBE_W / 2 < 0 )
-                        cubeI--;
-
-                    if ( pointSel.y + CUBE_H / 2 < 0 )
-                        cubeJ--;
+                    pointSel = laserCloudSurfStackMap->points[ i ];
 
-                    if ( pointSel.z + CUBE_D / 2 < 0 )
-                        cubeK--;
+                    int cubeI, cubeJ, cubeK;
+                    m_cube_map.get_cube_index( pointSel.x, pointSel.y, pointSel.z, cubeI, cubeJ, cubeK );
 
-                    if ( cubeI >= 0 && cubeI < m_para_laser_cloud_width &&
-                         cubeJ >= 0 && cubeJ < m_para_laser_cloud_height &&
-                         cubeK >= 0 && cubeK < m_para_laser_cloud_depth )
+                    if ( m_cube_map.is_in_grid( cubeI, cubeJ, cubeK ) )
                     {
-                        int cubeInd = cubeI + m_para_laser_cloud_width * cubeJ + m_para_laser_cloud_width * m_para_laser_cloud_height * cubeK;
-                        m_laser_cloud_surface_array[ cubeInd ]->push_back( pointSel );
+                        Points_cube *cube = m_cube_map.get_cube( m_cube_map.get_cube_id( cubeI, cubeJ, cubeK ) );
+                        bool if_new_voxel = cube->add_point( 0, pointSel, m_plane_resolution, &pt_idx, &old_centroid );
+                        if ( m_para_if_voxel_primitive )
+                        {
+                            Voxel_primitive *primitive = cube->m_surface_primitives.add_point( pcl_pt_to_eigend( pointSel ), m_cube_map.m_primitive_voxel_size );
+                            if ( primitive != nullptr )
+                            {
+                                changed_primitives.push_back( primitive );
+                            }
+                        }
+                        if ( abs( cubeI - centerCubeI ) <= 2 && abs( cubeJ - centerCubeJ ) <= 2 && abs( cubeK - centerCubeK ) <= 1 &&
+                             changed_voxel_keys[ 0 ].insert( ( m_cube_map.get_slot_index( cube->m_id ) << 32 ) | pt_idx ).second )
+                        {
+                            changed_voxels[ 0 ].push_back( std::make_pair( cube, pt_idx ) );
+                            if ( !if_new_voxel )
+                            {
+                                old_centroids[ 0 ].push_back( old_centroid );
+                            }
+                        }
                     }
                 }
 
-                //对每一个邻近点 cube 降采样
-                for ( int i = 0; i < laserCloudValidNum; i++ )
+                // 只重新拟合有新点的体素
+                m_thread_pool.parallel_for( changed_primitives.size(), [&]( int begin, int end, int block_idx ) {
+                    for ( int i = begin; i < end; i++ )
+                    {
+                        changed_primitives[ i ]->fit();
+                    }
+                } );
+
+                // The backend holds the same merged points as the cubes, not the raw points of the frame
+                for ( int if_corner = 0; if_corner < 2; if_corner++ )
                 {
-                    int ind = m_laser_cloud_valid_Idx[ i ];
-
-                    pcl::PointCloud<PointType>::Ptr tmpCorner( new pcl::PointCloud<PointType>() );
-                    // m_filter_k_means.setInputCloud( m_laser_cloud_corner_array[ ind ]);
-                    // m_filter_k_means.filter( *tmpCorner);
-                    // m_down_sample_filter_corner.setInputCloud( tmpCorner );
-                    m_down_sample_filter_corner.setInputCloud( m_laser_cloud_corner_array[ ind ] );
-                    m_down_sample_filter_corner.filter( *tmpCorner );
-                    m_laser_cloud_corner_array[ ind ] = tmpCorner;
-
-                    pcl::PointCloud<PointType>::Ptr tmpSurf( new pcl::PointCloud<PointType>() );
-                    // m_filter_k_means.setInputCloud( m_laser_cloud_surface_array[ ind ] );
-                    // m_filter_k_means.filter( *tmpSurf);
-                    // m_down_sample_filter_surface.setInputCloud(tmpSurf );
-                    m_down_sample_filter_surface.setInputCloud( m_laser_cloud_surface_array[ ind ] );
-                    m_down_sample_filter_surface.filter( *tmpSurf );
-                    m_laser_cloud_surface_array[ ind ] = tmpSurf;
+                    std::vector<PointType> new_centroids( changed_voxels[ if_corner ].size() );
+                    for ( size_t i = 0; i < new_centroids.size(); i++ )
+                    {
+                        Points_cube *cube = changed_voxels[ if_corner ][ i ].first;
+                        new_centroids[ i ] = ( if_corner ? cube->m_corner_pts : cube->m_surface_pts )->points[ changed_voxels[ if_corner ][ i ].second ];
+                    }
+                    m_map_search_backend->update_points( if_corner, old_centroids[ if_corner ], new_centroids );
                 }
 
                 double coner_surface_tomap_time_f = ros::Time::now().toSec();
 
-                //publish surround map for every 5 frame
+                //publish surround map for every 5 frame, the points are copied here and published by publish_process
                 if ( /*PUB_SURROUND_PTS*/1 )
                 {
-                    if ( frameCount % 500 == 0 )
+                    publish_frame.m_if_publish_surround = frameCount % 500 == 0 && m_pub_laser_cloud_surround.is_due( publish_time );
+                    if ( frameCount % 500 == 0 && ( m_if_save_to_pcd_files || publish_frame.m_if_publish_surround ) )
                     {
                         m_laser_cloud_surround->clear();
 
                         for ( int i = 0; i < laserCloudSurroundNum; i++ )
                         {
-                            int ind = m_laser_cloud_surround_Idx[ i ];
-                            *m_laser_cloud_surround += *m_laser_cloud_corner_array[ ind ];
-                            *m_laser_cloud_surround += *m_laser_cloud_surface_array[ ind ];
-                        }
-
-                        sensor_msgs::PointCloud2 laserCloudSurround3;
-                        pcl::toROSMsg( *m_laser_cloud_surround, laserCloudSurround3 );
-                        laserCloudSurround3.header.stamp = ros::Time().fromSec( m_time_odom );
-                        laserCloudSurround3.header.frame_id = "/camera_init";
-                        m_pub_laser_cloud_surround.publish( laserCloudSurround3 );
-
-                        if ( m_if_save_to_pcd_files )
-                        {
-                            m_pcl_tools_aftmap.save_to_pcd_files( "surround", *m_laser_cloud_surround );
+                            Points_cube *cube = m_cube_map.find_cube( m_laser_cloud_surround_Idx[ i ] );
+                            if ( cube == nullptr )
+                            {
+                                continue;
+                            }
+                            *m_laser_cloud_surround += *cube->m_corner_pts;
+                            *m_laser_cloud_surround += *cube->m_surface_pts;
                         }
+                        publish_frame.m_surround = pcl::PointCloud<PointType>::ConstPtr( new pcl::PointCloud<PointType>( *m_laser_cloud_surround ) );
                     }
 
-                    if ( frameCount % 20 == 0 )
+                    if ( m_para_map_publish_mode == 0 && frameCount % 20 == 0 && m_pub_laser_cloud_map.is_due( publish_time ) )
                     {
-                        pcl::PointCloud<PointType> laserCloudMap;
+                        pcl::PointCloud<PointType>::Ptr laser_cloud_map_ptr( new pcl::PointCloud<PointType>() );
+                        pcl::PointCloud<PointType> &    laserCloudMap = *laser_cloud_map_ptr;
 
-                        for ( int i = 0; i < 4851; i++ )
+                        m_cube_map.for_each_cube( [&]( Points_cube &cube ) {
+                            laserCloudMap += *cube.m_corner_pts;
+                            laserCloudMap += *cube.m_surface_pts;
+                        } );
+                        m_file_logger.printf("publish lasermappoints %d\n", laserCloudMap.size());
+                        publish_frame.m_map = laser_cloud_map_ptr;
+                    }
+                }
+
+                if ( m_para_map_publish_mode == 1 && frameCount % 20 == 0 && m_pub_laser_cloud_map_delta.is_due( publish_time ) )
+                {
+                    map_frame.m_if_map_delta = true;
+                    m_cube_map.take_removed_cube_ids( map_frame.m_map_removed_ids );
+                    m_cube_map.for_each_cube( [&]( Points_cube &cube ) {
+                        if ( cube.m_version != cube.m_published_version )
                         {
-                            laserCloudMap += *m_laser_cloud_corner_array[ i ];
-                            laserCloudMap += *m_laser_cloud_surface_array[ i ];
+                            map_frame.m_map_delta.push_back( get_cube_snapshot( cube ) );
+                            cube.m_published_version = cube.m_version;
                         }
+                    } );
+                    m_file_logger.printf( "publish map delta, %d cubes changed, %d removed\n", ( int ) map_frame.m_map_delta.size(), ( int ) map_frame.m_map_removed_ids.size() );
+                }
+                else if ( m_para_map_publish_mode == 1 && m_pub_laser_cloud_map_delta.m_publisher.getNumSubscribers() == 0 )
+                {
+                    // Nobody holds the cubes to remove, a new subscriber starts from a snapshot.
+                    std::vector<Points_cube_map::Cube_id> removed_ids;
+                    m_cube_map.take_removed_cube_ids( removed_ids );
+                }
 
-                        sensor_msgs::PointCloud2 laserCloudMsg;
-                        pcl::toROSMsg( laserCloudMap, laserCloudMsg );
-                        laserCloudMsg.header.stamp = ros::Time().fromSec( m_time_odom );
-                        laserCloudMsg.header.frame_id = "/camera_init";
-                        m_pub_laser_cloud_map.publish( laserCloudMsg );
-                        m_file_logger.printf("publish lasermappoints %d\n", laserCloudMap.size());
-                    }
+                if ( m_if_request_map_snapshot.exchange( false ) )
+                {
+                    map_frame.m_if_map_snapshot = true;
+                    m_cube_map.for_each_cube( [&]( Points_cube &cube ) {
+                        map_frame.m_map_snapshot.push_back( get_cube_snapshot( cube ) );
+                    } );
+                }
+
+                if ( m_if_request_save_map.exchange( false ) )
+                {
+                    get_map_to_save( map_frame );
                 }
 
                 //配准到全局坐标系之后发布出去
-                int laserCloudFullResNum = m_laser_cloud_full_res->points.size();
+                int laserCloudFullResNum = full_view.size();
 
                 compute_interpolatation_rodrigue( m_q_w_incre, m_interpolatation_omega, m_interpolatation_theta, m_interpolatation_omega_hat );
                 m_interpolatation_omega_hat_sq2 = m_interpolatation_omega_hat * m_interpolatation_omega_hat;
 
                 static bool print_once = true;
                 static FILE *ptest = NULL;
-                //插值计算每个点的偏移数量
-                for ( int i = 0; i < laserCloudFullResNum; i++ )
+                publish_frame.m_if_publish_full = m_pub_laser_cloud_full_res.is_due( publish_time );
+                if ( print_once || m_if_save_to_pcd_files || publish_frame.m_if_publish_full )
                 {
-                    if(print_once)
-                    {
-                        //if(ptest)
-                          //  fprintf(ptest, );
-                        float angle = atan2( m_laser_cloud_full_res->points[ i ].y, m_laser_cloud_full_res->points[ i ].x );
-                        angle = angle * 180 / 3.1416;
-                        m_file_logger.printf("%d %f %f\n", i, angle, m_laser_cloud_full_res->points[ i ].intensity);
-                    }
-                    pointAssociateToMap( &m_laser_cloud_full_res->points[ i ], &m_laser_cloud_full_res->points[ i ], m_laser_cloud_full_res->points[ i ].intensity, 1 );
+                    full_view.copy_to( *m_laser_cloud_full_res );
+                }
+                for ( int i = 0; print_once && i < laserCloudFullResNum; i++ )
+                {
+                    //if(ptest)
+                      //  fprintf(ptest, );
+                    float angle = atan2( m_laser_cloud_full_res->points[ i ].y, m_laser_cloud_full_res->points[ i ].x );
+                    angle = angle * 180 / 3.1416;
+                    m_file_logger.printf("%d %f %f\n", i, angle, m_laser_cloud_full_res->points[ i ].intensity);
+                }
+                //插值计算每个点的偏移数量, 保存pcd文件时需要
+                if ( m_if_save_to_pcd_files || publish_frame.m_if_publish_full )
+                {
+                    pcl::PointCloud<PointType>::Ptr laser_cloud_full_res_map( new pcl::PointCloud<PointType>() );
+                    pointcloudAssociateToMap( *m_laser_cloud_full_res, *laser_cloud_full_res_map, 1 );
+                    publish_frame.m_full = laser_cloud_full_res_map;
                 }
                 print_once = false;
                 //printf
@@ -1433,92 +2276,34 @@ class Laser_mapping
                 #endif
                 //endprint
 
-                pcl::UniformSampling<PointType> filter;
-                filter.setInputCloud(m_laser_cloud_full_res);
-                filter.setRadiusSearch(m_map_downsample_para);
-                filter.filter(*m_laser_cloud_full_res);
-                printf("after fileter %d\n", m_laser_cloud_full_res->points.size());
-
-                sensor_msgs::PointCloud2 laserCloudFullRes3;
-                pcl::toROSMsg( *m_laser_cloud_full_res, laserCloudFullRes3 );
-                laserCloudFullRes3.header.stamp = ros::Time().fromSec( m_time_odom );
-                laserCloudFullRes3.header.frame_id = "/camera_init";
-                m_pub_laser_cloud_full_res.publish( laserCloudFullRes3 ); //single_frame_with_pose_tranfromed
-
-                if ( m_if_save_to_pcd_files )
+                // Drop the oldest frame if publishing falls behind, registration never waits for it.
+                // A map delta, snapshot or save goes to its own queue which keeps all of them, as the cube versions are
+                // already marked as published, losing one would leave the subscribers with a stale map for good.
+                if ( map_frame.m_if_map_delta || map_frame.m_if_map_snapshot || map_frame.m_if_save_map )
                 {
-                    m_pcl_tools_aftmap.save_to_pcd_files( "aft_mapp", *m_laser_cloud_full_res, 1 );
+                    m_queue_publish_map.push( map_frame );
                 }
+                m_queue_publish_frame.push( publish_frame );
 
                 double full_registered_time_f = ros::Time::now().toSec();
 
 
-                //时间为 零， ？？？
-                nav_msgs::Odometry odomAftMapped;
-                odomAftMapped.header.frame_id = "/camera_init";
-                odomAftMapped.child_frame_id = "/aft_mapped";
-                //odomAftMapped.header.stamp = ros::Time().fromSec( m_time_odom );
-                odomAftMapped.header.stamp = ros::Time::now();
-                if ( 1 )
-                {
-                    odomAftMapped.pose.pose.orientation.x = m_q_w_curr.x();
-                    odomAftMapped.pose.pose.orientation.y = m_q_w_curr.y();
-                    odomAftMapped.pose.pose.orientation.z = m_q_w_curr.z();
-                    odomAftMapped.pose.pose.orientation.w = m_q_w_curr.w();
-
-                    odomAftMapped.pose.pose.position.x = m_t_w_curr.x();
-                    odomAftMapped.pose.pose.position.y = m_t_w_curr.y();
-                    odomAftMapped.pose.pose.position.z = m_t_w_curr.z();
-                }
-                else
-                {
-                    Eigen::Quaterniond q_s_half, q_pub;
-                    Eigen::Vector3d    t_s_half, t_pub;
-                    t_s_half = m_t_w_incre * 0.5;
-                    q_s_half = m_q_I.slerp( 0.5, m_q_w_incre );
-
-                    t_pub = m_q_w_last * t_s_half + m_t_w_last;
-                    q_pub = m_q_w_last * q_s_half;
-                    odomAftMapped.pose.pose.orientation.x = q_pub.x();
-                    odomAftMapped.pose.pose.orientation.y = q_pub.y();
-                    odomAftMapped.pose.pose.orientation.z = q_pub.z();
-                    odomAftMapped.pose.pose.orientation.w = q_pub.w();
-
-                    odomAftMapped.pose.pose.position.x = t_pub.x();
-                    odomAftMapped.pose.pose.position.y = t_pub.y();
-                    odomAftMapped.pose.pose.position.z = t_pub.z();
-                }
-                m_pub_odom_aft_mapped.publish( odomAftMapped ); // name: Odometry aft_mapped_to_init
-
-                geometry_msgs::PoseStamped laserAfterMappedPose;
-                laserAfterMappedPose.header = odomAftMapped.header;
-                laserAfterMappedPose.pose = odomAftMapped.pose.pose;
-                m_laser_after_mapped_path.header.stamp = odomAftMapped.header.stamp;
-                m_laser_after_mapped_path.header.frame_id = "/camera_init";
-                m_laser_after_mapped_path.poses.push_back( laserAfterMappedPose );
-                m_pub_laser_aft_mapped_path.publish( m_laser_after_mapped_path );
-
-                static tf::TransformBroadcaster br;
-                tf::Transform                   transform;
-                tf::Quaternion                  q;
-                transform.setOrigin( tf::Vector3( m_t_w_curr( 0 ),
-                                                  m_t_w_curr( 1 ),
-                                                  m_t_w_curr( 2 ) ) );
-                q.setW( m_q_w_curr.w() );
-                q.setX( m_q_w_curr.x() );
-                q.setY( m_q_w_curr.y() );
-                q.setZ( m_q_w_curr.z() );
-                transform.setRotation( q );
-                br.sendTransform( tf::StampedTransform( transform, odomAftMapped.header.stamp, "/camera_init", "/aft_mapped" ) );
-
                 double end_time_f = ros::Time::now().toSec();
 
                 printf("beg_cube:[%f] [%f] [%f] [%f]\n", map_get_time_f - begin_time_f, iterator_end_time_f- map_get_time_f, coner_surface_tomap_time_f-iterator_end_time_f,
                        full_registered_time_f - coner_surface_tomap_time_f);
                 frameCount++;
             }
-            std::chrono::nanoseconds dura( 1 );
-            std::this_thread::sleep_for( dura );
+        }
+        m_queue_avail_data.stop();
+        m_queue_publish_frame.stop();
+        decode_thread.join();
+        publish_thread.join();
+        if ( m_para_if_save_map_on_shutdown && !m_para_map_save_file.empty() )
+        {
+            Publish_map_frame map_frame;
+            get_map_to_save( map_frame );
+            save_map( map_frame );
         }
     }
 };
@@ -0,0 +1,35 @@
+// Developer: Lin Jiarong  ziv.lin.ljr@gmail.com
+
+// Laser_mapping as a nodelet, see laser_feature_extractor_nodelet.cpp.
+
+#include <memory>
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+#include <thread>
+
+#include "laser_mapping.hpp"
+
+class Laser_mapping_nodelet : public nodelet::Nodelet
+{
+  public:
+    ~Laser_mapping_nodelet()
+    {
+        if ( m_laser_mapping != nullptr )
+        {
+            m_laser_mapping->stop();
+            m_mapping_process.join();
+        }
+    }
+
+  private:
+    std::unique_ptr<Laser_mapping> m_laser_mapping;
+    std::thread                    m_mapping_process;
+
+    void onInit()
+    {
+        m_laser_mapping.reset( new Laser_mapping( getNodeHandle() ) );
+        m_mapping_process = std::thread( &Laser_mapping::process, m_laser_mapping.get() );
+    }
+};
+
+PLUGINLIB_EXPORT_CLASS( Laser_mapping_nodelet, nodelet::Nodelet )
@@ -0,0 +1,332 @@
+// Author: Lin Jiarong          ziv.lin.ljr@gmail.com
+
+#ifndef __MAP_FILE_HPP__
+#define __MAP_FILE_HPP__
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "points_cube_map.hpp"
+
+// Binary file of Points_cube_map, laid out to be read through mmap:
+//
+//     Header | Cube_entry[ m_cube_num ] | Point[ m_point_num ]
+//
+// All sections are 8 bytes aligned, little endian. The points of a cube are contiguous,
+// corner points first, so a reader can use the point block in place without parsing.
+class Map_file
+{
+  public:
+    static const uint32_t m_file_version = 1;
+
+    struct Header
+    {
+        char     m_magic[ 8 ]; // "LOAMMAP"
+        uint32_t m_version;
+        uint32_t m_header_size;
+        double   m_cube_size[ 3 ];
+        double   m_line_resolution;
+        double   m_plane_resolution;
+        uint64_t m_cube_num;
+        uint64_t m_cube_table_offset; // in bytes, from the beginning of file
+        uint64_t m_point_num;
+        uint64_t m_point_offset;
+    };
+
+    struct Cube_entry
+    {
+        int64_t  m_id; // Points_cube_map::Cube_id
+        int32_t  m_version;
+        uint32_t m_corner_num;
+        uint64_t m_first_point; // index in the point block
+        uint32_t m_surface_num;
+        uint32_t m_reserved;
+    };
+
+    struct Point
+    {
+        float m_x, m_y, m_z, m_intensity;
+    };
+
+    // Points of one cube, also the unit of Map_tile_store.
+    struct Tile
+    {
+        int64_t            m_id = -1;
+        int32_t            m_version = 0;
+        std::vector<Point> m_corner_pts;
+        std::vector<Point> m_surface_pts;
+    };
+
+    std::string m_last_error;
+
+    static void cube_to_tile( const Points_cube &cube, Tile &tile )
+    {
+        tile.m_id = cube.m_id;
+        tile.m_version = cube.m_version;
+        append_points( *cube.m_corner_pts, tile.m_corner_pts );
+        append_points( *cube.m_surface_pts, tile.m_surface_pts );
+    }
+
+    // Add the points of tile to its cube in cube_map, the cube must be in the grid.
+    // Primitives which get new points are appended to changed_primitives ( if not nullptr ) and need fit().
+    static void insert_tile( Points_cube_map &cube_map, const Tile &tile, float line_resolution, float plane_resolution,
+                             std::vector<Voxel_primitive *> *changed_primitives )
+    {
+        Points_cube *cube = cube_map.get_cube( tile.m_id );
+        cube->m_corner_pts->reserve( cube->m_corner_pts->size() + tile.m_corner_pts.size() );
+        cube->m_surface_pts->reserve( cube->m_surface_pts->size() + tile.m_surface_pts.size() );
+        for ( int if_corner = 0; if_corner < 2; if_corner++ )
+        {
+            const std::vector<Point> &points = if_corner ? tile.m_corner_pts : tile.m_surface_pts;
+            for ( size_t i = 0; i < points.size(); i++ )
+            {
+                PointType pcl_pt;
+                pcl_pt.x = points[ i ].m_x;
+                pcl_pt.y = points[ i ].m_y;
+                pcl_pt.z = points[ i ].m_z;
+                pcl_pt.intensity = points[ i ].m_intensity;
+                cube->add_point( if_corner, pcl_pt, if_corner ? line_resolution : plane_resolution );
+                if ( changed_primitives != nullptr )
+                {
+                    Voxel_primitive *primitive = ( if_corner ? cube->m_corner_primitives : cube->m_surface_primitives )
+                                                     .add_point( Eigen::Vector3d( pcl_pt.x, pcl_pt.y, pcl_pt.z ), cube_map.m_primitive_voxel_size );
+                    if ( primitive != nullptr )
+                    {
+                        changed_primitives->push_back( primitive );
+                    }
+                }
+            }
+        }
+    }
+
+    static bool is_tile_in_grid( const Points_cube_map &cube_map, int64_t id )
+    {
+        return cube_map.is_cube_in_grid( id );
+    }
+
+    // Write to file_name.tmp first and rename, so that a crash never leaves a broken map.
+    bool write( const std::vector<Tile> &tiles, const double *cube_size, float line_resolution, float plane_resolution, const std::string &file_name )
+    {
+        std::vector<Cube_entry> cubes( tiles.size() );
+        uint64_t                point_num = 0;
+        for ( size_t i = 0; i < tiles.size(); i++ )
+        {
+            memset( &cubes[ i ], 0, sizeof( Cube_entry ) );
+            cubes[ i ].m_id = tiles[ i ].m_id;
+            cubes[ i ].m_version = tiles[ i ].m_version;
+            cubes[ i ].m_corner_num = tiles[ i ].m_corner_pts.size();
+            cubes[ i ].m_surface_num = tiles[ i ].m_surface_pts.size();
+            cubes[ i ].m_first_point = point_num;
+            point_num += cubes[ i ].m_corner_num + cubes[ i ].m_surface_num;
+        }
+
+        Header header;
+        memset( &header, 0, sizeof( header ) );
+        strcpy( header.m_magic, "LOAMMAP" );
+        header.m_version = m_file_version;
+        header.m_header_size = sizeof( Header );
+        for ( int i = 0; i < 3; i++ )
+        {
+            header.m_cube_size[ i ] = cube_size[ i ];
+        }
+        header.m_line_resolution = line_resolution;
+        header.m_plane_resolution = plane_resolution;
+        header.m_cube_num = cubes.size();
+        header.m_cube_table_offset = sizeof( Header );
+        header.m_point_num = point_num;
+        header.m_point_offset = header.m_cube_table_offset + cubes.size() * sizeof( Cube_entry );
+
+        std::string tmp_name = file_name + ".tmp";
+        FILE *      fp = fopen( tmp_name.c_str(), "wb" );
+        if ( fp == nullptr )
+        {
+            m_last_error = "Can not open " + tmp_name;
+            return false;
+        }
+        bool if_ok = fwrite( &header, sizeof( Header ), 1, fp ) == 1 &&
+                     fwrite( cubes.data(), sizeof( Cube_entry ), cubes.size(), fp ) == cubes.size();
+        for ( size_t i = 0; if_ok && i < tiles.size(); i++ )
+        {
+            if_ok = fwrite( tiles[ i ].m_corner_pts.data(), sizeof( Point ), tiles[ i ].m_corner_pts.size(), fp ) == tiles[ i ].m_corner_pts.size() &&
+                    fwrite( tiles[ i ].m_surface_pts.data(), sizeof( Point ), tiles[ i ].m_surface_pts.size(), fp ) == tiles[ i ].m_surface_pts.size();
+        }
+        if_ok = ( fclose( fp ) == 0 ) && if_ok;
+        if ( !if_ok || rename( tmp_name.c_str(), file_name.c_str() ) != 0 )
+        {
+            m_last_error = "Fail to write " + file_name;
+            remove( tmp_name.c_str() );
+            return false;
+        }
+        return true;
+    }
+
+    // Append the tiles of file to tiles, header is filled if not nullptr.
+    bool read( const std::string &file_name, std::vector<Tile> &tiles, Header *header = nullptr )
+    {
+        int fd = open( file_name.c_str(), O_RDONLY );
+        if ( fd < 0 )
+        {
+            m_last_error = "Can not open " + file_name;
+            return false;
+        }
+        struct stat file_stat;
+        if ( fstat( fd, &file_stat ) != 0 || ( size_t ) file_stat.st_size < sizeof( Header ) )
+        {
+            m_last_error = "Not a map file: " + file_name;
+            close( fd );
+            return false;
+        }
+        size_t file_size = file_stat.st_size;
+        void * file_data = mmap( nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+        close( fd );
+        if ( file_data == MAP_FAILED )
+        {
+            m_last_error = "Can not mmap " + file_name;
+            return false;
+        }
+
+        bool if_ok = read_from_memory( ( const char * ) file_data, file_size, tiles );
+        if ( if_ok && header != nullptr )
+        {
+            *header = *( const Header * ) file_data;
+        }
+        munmap( file_data, file_size );
+        return if_ok;
+    }
+
+    // Append a copy of all cubes of cube_map to tiles, e.g. to write them by another thread.
+    static void get_tiles( Points_cube_map &cube_map, std::vector<Tile> &tiles )
+    {
+        cube_map.for_each_cube( [&]( Points_cube &cube ) {
+            tiles.push_back( Tile() );
+            cube_to_tile( cube, tiles.back() );
+        } );
+    }
+
+    // Save all cubes of cube_map, and extra_tiles ( if not nullptr ), e.g. the cubes paged out to Map_tile_store.
+    bool save( Points_cube_map &cube_map, float line_resolution, float plane_resolution, const std::string &file_name,
+               const std::vector<Tile> *extra_tiles = nullptr )
+    {
+        std::vector<Tile> tiles;
+        get_tiles( cube_map, tiles );
+        if ( extra_tiles != nullptr )
+        {
+            tiles.insert( tiles.end(), extra_tiles->begin(), extra_tiles->end() );
+        }
+        double cube_size[ 3 ] = { cube_map.m_cube_w, cube_map.m_cube_h, cube_map.m_cube_d };
+        return write( tiles, cube_size, line_resolution, plane_resolution, file_name );
+    }
+
+    // Put the cubes of the file into cube_map, through Points_cube::add_point() so that the
+    // voxel occupancy ( and the voxel primitives, if if_primitive ) is restored.
+    // Cubes outside of the grid are moved to outside_tiles, or skipped if it is nullptr, skipped_pt_num
+    // ( if not nullptr ) is set to the number of skipped points.
+    // Return the number of loaded points ( including those in outside_tiles ), -1 if failed.
+    long load( Points_cube_map &cube_map, float line_resolution, float plane_resolution, bool if_primitive, const std::string &file_name,
+               std::vector<Tile> *outside_tiles = nullptr, long *skipped_pt_num = nullptr )
+    {
+        std::vector<Tile> tiles;
+        Header            header;
+        if ( !read( file_name, tiles, &header ) )
+        {
+            return -1;
+        }
+        if ( fabs( header.m_cube_size[ 0 ] - cube_map.m_cube_w ) > 1e-6 || fabs( header.m_cube_size[ 1 ] - cube_map.m_cube_h ) > 1e-6 ||
+             fabs( header.m_cube_size[ 2 ] - cube_map.m_cube_d ) > 1e-6 )
+        {
+            m_last_error = "Cube size of map file differs from mapping_cube_width/height/depth";
+            return -1;
+        }
+
+        long                           pt_num = 0, skipped_num = 0;
+        std::vector<Voxel_primitive *> changed_primitives;
+        for ( size_t i = 0; i < tiles.size(); i++ )
+        {
+            long tile_pt_num = tiles[ i ].m_corner_pts.size() + tiles[ i ].m_surface_pts.size();
+            if ( is_tile_in_grid( cube_map, tiles[ i ].m_id ) )
+            {
+                insert_tile( cube_map, tiles[ i ], line_resolution, plane_resolution, if_primitive ? &changed_primitives : nullptr );
+                pt_num += tile_pt_num;
+            }
+            else if ( outside_tiles == nullptr )
+            {
+                skipped_num += tile_pt_num;
+            }
+            else
+            {
+                pt_num += tile_pt_num;
+                outside_tiles->push_back( Tile() );
+                outside_tiles->back().m_id = tiles[ i ].m_id;
+                outside_tiles->back().m_version = tiles[ i ].m_version;
+                outside_tiles->back().m_corner_pts.swap( tiles[ i ].m_corner_pts );
+                outside_tiles->back().m_surface_pts.swap( tiles[ i ].m_surface_pts );
+            }
+        }
+        for ( size_t i = 0; i < changed_primitives.size(); i++ )
+        {
+            changed_primitives[ i ]->fit();
+        }
+        if ( skipped_pt_num != nullptr )
+        {
+            *skipped_pt_num = skipped_num;
+        }
+        return pt_num;
+    }
+
+  private:
+    static void append_points( const pcl::PointCloud<PointType> &cloud, std::vector<Point> &points )
+    {
+        points.reserve( points.size() + cloud.points.size() );
+        for ( size_t i = 0; i < cloud.points.size(); i++ )
+        {
+            Point pt = { cloud.points[ i ].x, cloud.points[ i ].y, cloud.points[ i ].z, cloud.points[ i ].intensity };
+            points.push_back( pt );
+        }
+    }
+
+    bool read_from_memory( const char *data, size_t size, std::vector<Tile> &tiles )
+    {
+        const Header *header = ( const Header * ) data;
+        if ( strncmp( header->m_magic, "LOAMMAP", 8 ) != 0 || header->m_version != m_file_version || header->m_header_size != sizeof( Header ) )
+        {
+            m_last_error = "Unknown map file format or version";
+            return false;
+        }
+        if ( header->m_cube_table_offset + header->m_cube_num * sizeof( Cube_entry ) > size ||
+             header->m_point_offset + header->m_point_num * sizeof( Point ) > size )
+        {
+            m_last_error = "Map file is truncated";
+            return false;
+        }
+
+        const Cube_entry *cubes = ( const Cube_entry * ) ( data + header->m_cube_table_offset );
+        const Point *     points = ( const Point * ) ( data + header->m_point_offset );
+        for ( uint64_t i = 0; i < header->m_cube_num; i++ )
+        {
+            const Cube_entry &entry = cubes[ i ];
+            if ( entry.m_first_point + entry.m_corner_num + entry.m_surface_num > header->m_point_num )
+            {
+                m_last_error = "Map file is corrupted";
+                return false;
+            }
+            const Point *corner_begin = points + entry.m_first_point;
+            const Point *surface_begin = corner_begin + entry.m_corner_num;
+            tiles.push_back( Tile() );
+            tiles.back().m_id = entry.m_id;
+            tiles.back().m_version = entry.m_version;
+            tiles.back().m_corner_pts.assign( corner_begin, surface_begin );
+            tiles.back().m_surface_pts.assign( surface_begin, surface_begin + entry.m_surface_num );
+        }
+        return true;
+    }
+};
+
+#endif
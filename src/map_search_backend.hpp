@@ -0,0 +1,420 @@
+// Author: Lin Jiarong          ziv.lin.ljr@gmail.com
+
+#ifndef __MAP_SEARCH_BACKEND_HPP__
+#define __MAP_SEARCH_BACKEND_HPP__
+
+#include <algorithm>
+#include <math.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "flat_kdtree.hpp"
+#include "incremental_kdtree.hpp"
+#include "points_cube_map.hpp"
+#include "voxel_primitive.hpp"
+
+// Nearest neighbour search over the corner and surface points of the map cubes around the sensor.
+// Per frame, update_window() is called with the cubes around the sensor before matching,
+// and update_points() with the voxel centroids of those cubes changed by the points inserted after matching.
+// nearest_search() only reads the backend, it can be called from several threads with different buffers.
+class Map_search_backend
+{
+  public:
+    enum Backend_type
+    {
+        e_cube_flann = 0,         // pcl::KdTreeFLANN in every cube, rebuilt when the cube changes
+        e_incremental_kdtree = 1, // one Incremental_kdtree over the window
+        e_flat_kdtree = 2,        // one Flat_kdtree over the window, rebuilt every frame
+        e_voxel_hash = 3,         // scan the voxels within the matching distance around the query point
+    };
+
+    // Scratch memory of nearest_search, use one per thread.
+    struct Search_buffer
+    {
+        Points_cube_map::Search_buffer                   m_cube_buffer;
+        Flat_kdtree<PointType>::Knn_buffer               m_knn;
+        std::vector<std::pair<float, const PointType *>> m_candidates;
+    };
+
+    virtual ~Map_search_backend(){};
+
+    virtual const char *name() const = 0;
+
+    virtual void update_window( Points_cube_map &cube_map, const Points_cube_map::Cube_id *window_ids, int window_size ) = 0;
+
+    // Voxel centroids of the window cubes changed by one frame, so that the backend holds the same points as the cubes:
+    // old_pts are the previous centroids of the merged voxels, new_pts the current centroids of all changed voxels.
+    // Backends which read the cubes directly need not implement it.
+    virtual void update_points( int if_corner, const std::vector<PointType> &old_pts, const std::vector<PointType> &new_pts ){};
+
+    virtual int size( int if_corner ) const = 0;
+
+    // Result is sorted by distance, like pcl::KdTreeFLANN::nearestKSearch.
+    virtual int nearest_search( int if_corner, const PointType &pt, int k,
+                                std::vector<PointType> &nearest_pts, std::vector<float> &nearest_sq_dis, Search_buffer &buffer ) = 0;
+
+    // max_sq_dis: surface, corner, largest squared distance of a neighbour accepted by the matching
+    static Map_search_backend *create( int type, float voxel_size, const float *max_sq_dis );
+};
+
+class Map_search_cube_flann : public Map_search_backend
+{
+    Points_cube_map *                     m_cube_map = nullptr;
+    std::vector<Points_cube_map::Cube_id> m_window_ids;
+    int                                   m_size[ 2 ] = { 0, 0 };
+
+  public:
+    const char *name() const
+    {
+        return "cube_flann";
+    }
+
+    void update_window( Points_cube_map &cube_map, const Points_cube_map::Cube_id *window_ids, int window_size )
+    {
+        // Only the cubes changed since last frame rebuild their kd-trees, queries fan out to the cubes.
+        m_cube_map = &cube_map;
+        m_window_ids.assign( window_ids, window_ids + window_size );
+        cube_map.update_kdtrees( window_ids, window_size );
+        m_size[ 0 ] = m_size[ 1 ] = 0;
+        for ( int i = 0; i < window_size; i++ )
+        {
+            Points_cube *cube = cube_map.find_cube( window_ids[ i ] );
+            if ( cube != nullptr )
+            {
+                m_size[ 0 ] += cube->m_surface_pts->size();
+                m_size[ 1 ] += cube->m_corner_pts->size();
+            }
+        }
+    }
+
+    int size( int if_corner ) const
+    {
+        return m_size[ if_corner ? 1 : 0 ];
+    }
+
+    int nearest_search( int if_corner, const PointType &pt, int k,
+                        std::vector<PointType> &nearest_pts, std::vector<float> &nearest_sq_dis, Search_buffer &buffer )
+    {
+        return m_cube_map->nearest_search( m_window_ids.data(), m_window_ids.size(), if_corner, pt, k,
+                                           nearest_pts, nearest_sq_dis, buffer.m_cube_buffer );
+    }
+};
+
+class Map_search_incremental_kdtree : public Map_search_backend
+{
+    Incremental_kdtree<PointType>         m_kdtree[ 2 ]; // surface, corner
+    std::vector<Points_cube_map::Cube_id> m_window_ids;
+
+  public:
+    const char *name() const
+    {
+        return "incremental_kdtree";
+    }
+
+    // Remove points of cubes which leave the window and add points of cubes which enter it.
+    void update_window( Points_cube_map &cube_map, const Points_cube_map::Cube_id *window_ids, int window_size )
+    {
+        float box_min[ 3 ], box_max[ 3 ];
+        for ( size_t i = 0; i < m_window_ids.size(); i++ )
+        {
+            if ( std::find( window_ids, window_ids + window_size, m_window_ids[ i ] ) == window_ids + window_size )
+            {
+                cube_map.get_cube_box( m_window_ids[ i ], box_min, box_max );
+                m_kdtree[ 0 ].delete_points_in_box( box_min, box_max );
+                m_kdtree[ 1 ].delete_points_in_box( box_min, box_max );
+            }
+        }
+
+        for ( int i = 0; i < window_size; i++ )
+        {
+            if ( std::find( m_window_ids.begin(), m_window_ids.end(), window_ids[ i ] ) == m_window_ids.end() )
+            {
+                Points_cube *cube = cube_map.find_cube( window_ids[ i ] );
+                if ( cube != nullptr )
+                {
+                    m_kdtree[ 0 ].add_points( *cube->m_surface_pts );
+                    m_kdtree[ 1 ].add_points( *cube->m_corner_pts );
+                }
+            }
+        }
+
+        m_window_ids.assign( window_ids, window_ids + window_size );
+    }
+
+    void update_points( int if_corner, const std::vector<PointType> &old_pts, const std::vector<PointType> &new_pts )
+    {
+        Incremental_kdtree<PointType> &kdtree = m_kdtree[ if_corner ? 1 : 0 ];
+        for ( size_t i = 0; i < old_pts.size(); i++ )
+        {
+            kdtree.delete_point( old_pts[ i ] );
+        }
+        kdtree.add_points( new_pts );
+    }
+
+    int size( int if_corner ) const
+    {
+        return m_kdtree[ if_corner ? 1 : 0 ].size();
+    }
+
+    int nearest_search( int if_corner, const PointType &pt, int k,
+                        std::vector<PointType> &nearest_pts, std::vector<float> &nearest_sq_dis, Search_buffer &buffer )
+    {
+        return m_kdtree[ if_corner ? 1 : 0 ].nearest_search( pt, k, nearest_pts, nearest_sq_dis );
+    }
+};
+
+class Map_search_flat_kdtree : public Map_search_backend
+{
+    Flat_kdtree<PointType>                                    m_kdtree[ 2 ]; // surface, corner
+    std::vector<std::pair<Points_cube_map::Cube_id, int>>     m_window_versions;
+    std::vector<PointType>                                    m_pts;
+
+  public:
+    const char *name() const
+    {
+        return "flat_kdtree";
+    }
+
+    // Rebuild both trees over the window, unless no cube of the window changed.
+    void update_window( Points_cube_map &cube_map, const Points_cube_map::Cube_id *window_ids, int window_size )
+    {
+        std::vector<std::pair<Points_cube_map::Cube_id, int>> window_versions( window_size );
+        for ( int i = 0; i < window_size; i++ )
+        {
+            Points_cube *cube = cube_map.find_cube( window_ids[ i ] );
+            window_versions[ i ] = std::make_pair( window_ids[ i ], cube == nullptr ? -1 : cube->m_version );
+        }
+        if ( window_versions == m_window_versions )
+        {
+            return;
+        }
+        m_window_versions.swap( window_versions );
+
+        for ( int if_corner = 0; if_corner < 2; if_corner++ )
+        {
+            m_pts.clear();
+            for ( int i = 0; i < window_size; i++ )
+            {
+                Points_cube *cube = cube_map.find_cube( window_ids[ i ] );
+                if ( cube != nullptr )
+                {
+                    pcl::PointCloud<PointType>::Ptr cube_pts = if_corner ? cube->m_corner_pts : cube->m_surface_pts;
+                    m_pts.insert( m_pts.end(), cube_pts->points.begin(), cube_pts->points.end() );
+                }
+            }
+            m_kdtree[ if_corner ].build( m_pts );
+        }
+    }
+
+    int size( int if_corner ) const
+    {
+        return m_kdtree[ if_corner ? 1 : 0 ].size();
+    }
+
+    int nearest_search( int if_corner, const PointType &pt, int k,
+                        std::vector<PointType> &nearest_pts, std::vector<float> &nearest_sq_dis, Search_buffer &buffer )
+    {
+        return m_kdtree[ if_corner ? 1 : 0 ].nearest_search( pt, k, nearest_pts, nearest_sq_dis, buffer.m_knn );
+    }
+};
+
+// Points are hashed into voxels of m_voxel_size, a query scans the voxels within m_max_sq_dis around it.
+// All neighbours within sqrt( m_max_sq_dis ) are found, farther ones may be missed. So if the matching rejects a k-th
+// neighbour farther than that, it accepts and rejects the same queries with the same neighbours as the exact backends.
+class Map_search_voxel_hash : public Map_search_backend
+{
+    typedef std::unordered_map<Voxel_primitive_map::Voxel_key, std::vector<PointType>> Voxel_hash_map;
+
+    Voxel_hash_map                        m_voxels[ 2 ]; // surface, corner
+    int                                   m_size[ 2 ] = { 0, 0 };
+    std::vector<Points_cube_map::Cube_id> m_window_ids;
+
+    static Eigen::Vector3d to_eigen( const PointType &pt )
+    {
+        return Eigen::Vector3d( pt.x, pt.y, pt.z );
+    }
+
+    void delete_points_in_box( int if_corner, const float *box_min, const float *box_max )
+    {
+        for ( Voxel_hash_map::iterator it = m_voxels[ if_corner ].begin(); it != m_voxels[ if_corner ].end(); )
+        {
+            std::vector<PointType> &pts = it->second;
+            size_t                  old_size = pts.size();
+            pts.erase( std::remove_if( pts.begin(), pts.end(), [&]( const PointType &pt ) {
+                           return pt.x >= box_min[ 0 ] && pt.x < box_max[ 0 ] &&
+                                  pt.y >= box_min[ 1 ] && pt.y < box_max[ 1 ] &&
+                                  pt.z >= box_min[ 2 ] && pt.z < box_max[ 2 ];
+                       } ),
+                       pts.end() );
+            m_size[ if_corner ] -= old_size - pts.size();
+            if ( pts.empty() )
+            {
+                it = m_voxels[ if_corner ].erase( it );
+            }
+            else
+            {
+                it++;
+            }
+        }
+    }
+
+    // Delete one point equal to pt.
+    void delete_point( int if_corner, const PointType &pt )
+    {
+        int i, j, k;
+        Voxel_primitive_map::get_voxel_index( to_eigen( pt ), m_voxel_size, i, j, k );
+        Voxel_hash_map::iterator it = m_voxels[ if_corner ].find( Voxel_primitive_map::get_voxel_key( i, j, k ) );
+        if ( it == m_voxels[ if_corner ].end() )
+        {
+            return;
+        }
+        std::vector<PointType> &pts = it->second;
+        for ( size_t idx = 0; idx < pts.size(); idx++ )
+        {
+            if ( pts[ idx ].x == pt.x && pts[ idx ].y == pt.y && pts[ idx ].z == pt.z )
+            {
+                pts[ idx ] = pts.back();
+                pts.pop_back();
+                m_size[ if_corner ]--;
+                break;
+            }
+        }
+        if ( pts.empty() )
+        {
+            m_voxels[ if_corner ].erase( it );
+        }
+    }
+
+    template <typename T_cloud>
+    void add_points_to_voxels( int if_corner, const T_cloud &pts )
+    {
+        int i, j, k;
+        for ( typename T_cloud::const_iterator it = pts.begin(); it != pts.end(); it++ )
+        {
+            Voxel_primitive_map::get_voxel_index( to_eigen( *it ), m_voxel_size, i, j, k );
+            m_voxels[ if_corner ][ Voxel_primitive_map::get_voxel_key( i, j, k ) ].push_back( *it );
+            m_size[ if_corner ]++;
+        }
+    }
+
+  public:
+    float m_voxel_size = 1.0;
+    float m_max_sq_dis[ 2 ] = { 10.0, 2.0 }; // surface, corner, largest squared distance of a neighbour used by the matching
+
+    const char *name() const
+    {
+        return "voxel_hash";
+    }
+
+    void update_window( Points_cube_map &cube_map, const Points_cube_map::Cube_id *window_ids, int window_size )
+    {
+        float box_min[ 3 ], box_max[ 3 ];
+        for ( size_t i = 0; i < m_window_ids.size(); i++ )
+        {
+            if ( std::find( window_ids, window_ids + window_size, m_window_ids[ i ] ) == window_ids + window_size )
+            {
+                cube_map.get_cube_box( m_window_ids[ i ], box_min, box_max );
+                delete_points_in_box( 0, box_min, box_max );
+                delete_points_in_box( 1, box_min, box_max );
+            }
+        }
+
+        for ( int i = 0; i < window_size; i++ )
+        {
+            if ( std::find( m_window_ids.begin(), m_window_ids.end(), window_ids[ i ] ) == m_window_ids.end() )
+            {
+                Points_cube *cube = cube_map.find_cube( window_ids[ i ] );
+                if ( cube != nullptr )
+                {
+                    add_points_to_voxels( 0, *cube->m_surface_pts );
+                    add_points_to_voxels( 1, *cube->m_corner_pts );
+                }
+            }
+        }
+
+        m_window_ids.assign( window_ids, window_ids + window_size );
+    }
+
+    void update_points( int if_corner, const std::vector<PointType> &old_pts, const std::vector<PointType> &new_pts )
+    {
+        for ( size_t i = 0; i < old_pts.size(); i++ )
+        {
+            delete_point( if_corner ? 1 : 0, old_pts[ i ] );
+        }
+        add_points_to_voxels( if_corner ? 1 : 0, new_pts );
+    }
+
+    int size( int if_corner ) const
+    {
+        return m_size[ if_corner ? 1 : 0 ];
+    }
+
+    int nearest_search( int if_corner, const PointType &pt, int k,
+                        std::vector<PointType> &nearest_pts, std::vector<float> &nearest_sq_dis, Search_buffer &buffer )
+    {
+        const Voxel_hash_map &voxels = m_voxels[ if_corner ? 1 : 0 ];
+        int                   i, j, l;
+        Voxel_primitive_map::get_voxel_index( to_eigen( pt ), m_voxel_size, i, j, l );
+        // A point within the distance is at most this many voxels away along each axis
+        int ring = std::max( ( int ) ceil( sqrt( m_max_sq_dis[ if_corner ? 1 : 0 ] ) / m_voxel_size ), 1 );
+        buffer.m_candidates.clear();
+        for ( int di = -ring; di <= ring; di++ )
+        {
+            for ( int dj = -ring; dj <= ring; dj++ )
+            {
+                for ( int dl = -ring; dl <= ring; dl++ )
+                {
+                    Voxel_hash_map::const_iterator it = voxels.find( Voxel_primitive_map::get_voxel_key( i + di, j + dj, l + dl ) );
+                    if ( it == voxels.end() )
+                    {
+                        continue;
+                    }
+                    for ( size_t idx = 0; idx < it->second.size(); idx++ )
+                    {
+                        const PointType &map_pt = it->second[ idx ];
+                        float            dx = map_pt.x - pt.x;
+                        float            dy = map_pt.y - pt.y;
+                        float            dz = map_pt.z - pt.z;
+                        buffer.m_candidates.push_back( std::make_pair( dx * dx + dy * dy + dz * dz, &map_pt ) );
+                    }
+                }
+            }
+        }
+
+        int found_num = std::min( k, ( int ) buffer.m_candidates.size() );
+        std::partial_sort( buffer.m_candidates.begin(), buffer.m_candidates.begin() + found_num, buffer.m_candidates.end(),
+                           []( const std::pair<float, const PointType *> &a, const std::pair<float, const PointType *> &b ) { return a.first < b.first; } );
+        nearest_pts.resize( found_num );
+        nearest_sq_dis.resize( found_num );
+        for ( int idx = 0; idx < found_num; idx++ )
+        {
+            nearest_sq_dis[ idx ] = buffer.m_candidates[ idx ].first;
+            nearest_pts[ idx ] = *buffer.m_candidates[ idx ].second;
+        }
+        return found_num;
+    }
+};
+
+inline Map_search_backend *Map_search_backend::create( int type, float voxel_size, const float *max_sq_dis )
+{
+    switch ( type )
+    {
+    case e_incremental_kdtree:
+        return new Map_search_incremental_kdtree();
+    case e_flat_kdtree:
+        return new Map_search_flat_kdtree();
+    case e_voxel_hash:
+    {
+        Map_search_voxel_hash *backend = new Map_search_voxel_hash();
+        backend->m_voxel_size = voxel_size;
+        backend->m_max_sq_dis[ 0 ] = max_sq_dis[ 0 ];
+        backend->m_max_sq_dis[ 1 ] = max_sq_dis[ 1 ];
+        return backend;
+    }
+    default:
+        return new Map_search_cube_flann();
+    }
+}
+
+#endif
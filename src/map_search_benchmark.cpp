@@ -0,0 +1,623 @@
+// Author: Lin Jiarong          ziv.lin.ljr@gmail.com
+
+// Offline comparison of the map search backends ( see map_search_backend.hpp ) on recorded data.
+// The feature clouds /pc2_corners and /pc2_surface of a bag, e.g. recorded while running livox_scanRegistration, are
+// replayed frame by frame. Every frame is registered with cube_flann, and the map is built from these reference poses,
+// so all backends search the same window of the same map. Per backend it reports:
+//   build:     update_window() and update_points(), per frame
+//   query:     k nearest search of all feature points at the reference pose, per query
+//   recall:    of the cube_flann neighbours, over the queries accepted by the distance check of the matching
+//   agreement: queries accepted or rejected by the distance check like with cube_flann
+//   pose:      difference to the reference pose, when the frame is registered with this backend from the same initial guess
+// Then the correspondences of the last ICP iteration of every reference registration are solved again from the initial guess,
+// with Icp_lm_solver, and with ceres::Solve on the analytic and on the autodiff cost functions ( icp_solver_type 1 and 0 ),
+// to report the time of each solver and the pose difference to ceres with analytic jacobian.
+// Usage: livox_map_search_benchmark bag_file [ line_resolution plane_resolution max_frame_num ]
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <map>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include <pcl/filters/voxel_grid.h>
+#include <ros/ros.h>
+#include <rosbag/bag.h>
+#include <rosbag/view.h>
+#include <sensor_msgs/PointCloud2.h>
+
+#include "icp_lm_solver.hpp"
+#include "map_search_backend.hpp"
+#include "tools/point_cloud2_view.hpp"
+
+// The same as Laser_mapping with launch/rosbag.launch
+static const int    g_search_num = 5;                     // line_search_num, plane_search_num
+static const float  g_max_sq_dis[ 2 ] = { 10.0, 2.0 };    // plane_search_max_sq_dis, line_search_max_sq_dis
+static const int    g_init_frame_num = 50;                // mapping_init_accumulate_frames
+static const int    g_icp_max_iterations = 6;             // icp_maximum_iteration
+static const int    g_solver_max_iterations = 100;        // ceres_maximum_iteration
+static const double g_max_translation = 10.0;             // max_allow_incre_T
+static const double g_converge_translation = 0.001;       // icp_converge_translation
+static const double g_converge_rotation = 0.01;           // icp_converge_rotation, in degree
+static const int    g_backend_num = 4;                    // Map_search_backend::Backend_type, the first one is the reference
+
+enum Solver_type
+{
+    e_solver_lm = 0,
+    e_solver_ceres_analytic = 1, // the reference of the solver comparison
+    e_solver_ceres_autodiff = 2,
+    g_solver_num = 3,
+};
+static const char *g_solver_names[ g_solver_num ] = { "icp_lm_solver", "ceres_analytic", "ceres_autodiff" };
+
+struct Feature_frame
+{
+    pcl::PointCloud<PointType> m_pts[ 2 ]; // surface, corner, in lidar frame
+};
+
+struct Search_buffer
+{
+    std::vector<PointType>            m_pts;
+    std::vector<float>                m_sq_dis;
+    Map_search_backend::Search_buffer m_backend_buffer;
+};
+
+struct Solver_statistic
+{
+    double m_solve_time = 0;
+    int    m_solve_num = 0;
+    double m_angle_diff_sum = 0;
+    double m_angle_diff_max = 0;
+    double m_t_diff_sum = 0;
+    double m_t_diff_max = 0;
+};
+
+struct Backend_statistic
+{
+    double m_build_time = 0;
+    double m_query_time = 0;
+    double m_register_time = 0;
+    long   m_query_num = 0;
+    long   m_accepted_num = 0; // queries accepted by the reference
+    long   m_recall_num = 0;   // neighbours of the reference found, in accepted queries
+    long   m_agree_num = 0;
+    int    m_register_num = 0;
+    double m_angle_diff_sum = 0;
+    double m_angle_diff_max = 0;
+    double m_t_diff_sum = 0;
+    double m_t_diff_max = 0;
+};
+
+static void transform_to_map( const pcl::PointCloud<PointType> &pts, const Eigen::Quaterniond &q, const Eigen::Vector3d &t, pcl::PointCloud<PointType> &pts_map )
+{
+    pts_map.points.resize( pts.points.size() );
+    for ( size_t i = 0; i < pts.points.size(); i++ )
+    {
+        Eigen::Vector3d pt = q * Eigen::Vector3d( pts.points[ i ].x, pts.points[ i ].y, pts.points[ i ].z ) + t;
+        pts_map.points[ i ] = pts.points[ i ];
+        pts_map.points[ i ].x = pt( 0 );
+        pts_map.points[ i ].y = pt( 1 );
+        pts_map.points[ i ].z = pt( 2 );
+    }
+}
+
+static Eigen::Vector3d pcl_pt_to_eigend( const PointType &pt )
+{
+    return Eigen::Vector3d( pt.x, pt.y, pt.z );
+}
+
+// The same checks as Laser_mapping::associate_corner_point and associate_surface_point.
+static bool associate_point( Map_search_backend *backend, int if_corner, const PointType &pt, const PointType &pt_map,
+                             Icp_correspondence &correspondence, Search_buffer &buffer )
+{
+    int found_num = backend->nearest_search( if_corner, pt_map, g_search_num, buffer.m_pts, buffer.m_sq_dis, buffer.m_backend_buffer );
+    if ( found_num < g_search_num || buffer.m_sq_dis[ g_search_num - 1 ] >= g_max_sq_dis[ if_corner ] )
+    {
+        return false;
+    }
+    correspondence.m_current_pt = pcl_pt_to_eigend( pt );
+    correspondence.m_motion_blur_s = 1.0;
+    correspondence.m_target_pt_a = pcl_pt_to_eigend( buffer.m_pts[ 0 ] );
+    if ( !if_corner )
+    {
+        correspondence.m_type = Icp_correspondence::e_point_to_plane;
+        correspondence.m_target_pt_b = pcl_pt_to_eigend( buffer.m_pts[ g_search_num / 2 ] );
+        correspondence.m_target_pt_c = pcl_pt_to_eigend( buffer.m_pts[ g_search_num - 1 ] );
+        return true;
+    }
+
+    Eigen::Vector3d center( 0, 0, 0 );
+    for ( int j = 0; j < g_search_num; j++ )
+    {
+        center += pcl_pt_to_eigend( buffer.m_pts[ j ] );
+    }
+    center = center / ( ( float ) g_search_num );
+    Eigen::Matrix3d cov_mat = Eigen::Matrix3d::Zero();
+    for ( int j = 0; j < g_search_num; j++ )
+    {
+        Eigen::Vector3d zero_mean = pcl_pt_to_eigend( buffer.m_pts[ j ] ) - center;
+        cov_mat += zero_mean * zero_mean.transpose();
+    }
+    Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> saes( cov_mat );
+    if ( !( saes.eigenvalues()[ 2 ] > 3 * saes.eigenvalues()[ 1 ] ) )
+    {
+        return false;
+    }
+    correspondence.m_type = Icp_correspondence::e_point_to_line;
+    correspondence.m_target_pt_b = pcl_pt_to_eigend( buffer.m_pts[ 1 ] );
+    return true;
+}
+
+// Laser_mapping::solve_icp_with_lm, para is { q_x, q_y, q_z, q_w, t_x, t_y, t_z } of the increment, t_prior the center of its bound.
+static void solve_with_lm( const Icp_correspondence_vec &correspondences, const Eigen::Quaterniond &q_last, const Eigen::Vector3d &t_last,
+                           const Eigen::Vector3d &t_prior, double *para )
+{
+    Icp_lm_solver          solver;
+    Icp_lm_solver::Summary summary;
+    solver.m_max_translation = g_max_translation;
+    solver.m_translation_center = t_prior;
+    solver.set_problem( correspondences, q_last, t_last );
+    solver.solve( para, 5, summary );
+    std::vector<double> residuals;
+    int                 residual_num = solver.get_active_residual_num();
+    if ( residual_num != 0 )
+    {
+        double avr_cost = solver.evaluate( para, &residuals ) / residual_num;
+        for ( size_t i = 0; i < solver.m_residuals.size(); i++ )
+        {
+            if ( ( fabs( residuals[ 3 * i + 0 ] ) + fabs( residuals[ 3 * i + 1 ] ) + fabs( residuals[ 3 * i + 2 ] ) ) > std::min( 0.1, 10 * avr_cost ) )
+            {
+                solver.m_residual_active[ i ] = 0;
+            }
+        }
+    }
+    solver.solve( para, g_solver_max_iterations, summary );
+}
+
+// Laser_mapping::create_icp_cost_function
+static ceres::CostFunction *create_icp_cost_function( const Icp_correspondence &correspondence, const Eigen::Matrix<double, 4, 1> &q_last,
+                                                      const Eigen::Vector3d &t_last, int if_analytic_jacobian )
+{
+    if ( correspondence.m_type == Icp_correspondence::e_point_to_line )
+    {
+        if ( if_analytic_jacobian )
+        {
+            return ceres_icp_point2line_analytic::Create( correspondence.m_current_pt, correspondence.m_target_pt_a, correspondence.m_target_pt_b,
+                                                          correspondence.m_motion_blur_s, q_last, t_last );
+        }
+        return ceres_icp_point2line<double>::Create( correspondence.m_current_pt, correspondence.m_target_pt_a, correspondence.m_target_pt_b,
+                                                     correspondence.m_motion_blur_s, q_last, t_last );
+    }
+    if ( if_analytic_jacobian )
+    {
+        return ceres_icp_point2plane_analytic::Create( correspondence.m_current_pt, correspondence.m_target_pt_a, correspondence.m_target_pt_b,
+                                                       correspondence.m_target_pt_c, correspondence.m_motion_blur_s, q_last, t_last );
+    }
+    return ceres_icp_point2plane<double>::Create( correspondence.m_current_pt, correspondence.m_target_pt_a, correspondence.m_target_pt_b,
+                                                  correspondence.m_target_pt_c, correspondence.m_motion_blur_s, q_last, t_last );
+}
+
+// Laser_mapping::solve_icp_with_ceres, the outliers are left out of a new problem instead of switched off.
+static void solve_with_ceres( const Icp_correspondence_vec &correspondences, const Eigen::Quaterniond &q_last, const Eigen::Vector3d &t_last,
+                              const Eigen::Vector3d &t_prior, int if_analytic_jacobian, double *para )
+{
+    Eigen::Matrix<double, 4, 1> q_last_vec( q_last.w(), q_last.x(), q_last.y(), q_last.z() );
+    std::vector<int>            active_idx( correspondences.size() );
+    for ( size_t i = 0; i < active_idx.size(); i++ )
+    {
+        active_idx[ i ] = i;
+    }
+    for ( int pass = 0; pass < 2 && !active_idx.empty(); pass++ )
+    {
+        ceres::Problem                      problem;
+        ceres::LossFunction *               loss_function = new ceres::HuberLoss( 0.1 );
+        std::vector<ceres::ResidualBlockId> residual_block_ids;
+        problem.AddParameterBlock( para, 4, new ceres::EigenQuaternionParameterization() );
+        problem.AddParameterBlock( para + 4, 3 );
+        for ( size_t i = 0; i < active_idx.size(); i++ )
+        {
+            residual_block_ids.push_back( problem.AddResidualBlock( create_icp_cost_function( correspondences[ active_idx[ i ] ], q_last_vec, t_last, if_analytic_jacobian ),
+                                                                    loss_function, para, para + 4 ) );
+        }
+        for ( int i = 0; i < 3; i++ )
+        {
+            problem.SetParameterLowerBound( para + 4, i, t_prior( i ) - g_max_translation );
+            problem.SetParameterUpperBound( para + 4, i, t_prior( i ) + g_max_translation );
+        }
+
+        ceres::Solver::Options  options;
+        ceres::Solver::Summary  summary;
+        options.linear_solver_type = ceres::DENSE_QR;
+        options.max_num_iterations = pass == 0 ? 5 : g_solver_max_iterations;
+        options.minimizer_progress_to_stdout = false;
+        ceres::Solve( options, &problem, &summary );
+        if ( pass == 1 )
+        {
+            break;
+        }
+
+        ceres::Problem::EvaluateOptions eval_options;
+        eval_options.residual_blocks = residual_block_ids;
+        double              total_cost = 0.0;
+        std::vector<double> residuals;
+        problem.Evaluate( eval_options, &total_cost, &residuals, nullptr, nullptr );
+        double           avr_cost = total_cost / active_idx.size();
+        std::vector<int> inlier_idx;
+        for ( size_t i = 0; i < active_idx.size(); i++ )
+        {
+            if ( ( fabs( residuals[ 3 * i + 0 ] ) + fabs( residuals[ 3 * i + 1 ] ) + fabs( residuals[ 3 * i + 2 ] ) ) <= std::min( 0.1, 10 * avr_cost ) )
+            {
+                inlier_idx.push_back( active_idx[ i ] );
+            }
+        }
+        active_idx.swap( inlier_idx );
+    }
+}
+
+// Association and Icp_lm_solver in turn, like Laser_mapping with icp_solver_type = 1 ( without correspondence caches ).
+// q_incre, t_incre: the increment to the pose of last frame, the initial guess is replaced by the result.
+// correspondences: those of the last iteration.
+static void register_frame( Map_search_backend *backend, const Feature_frame &frame, const Eigen::Quaterniond &q_last, const Eigen::Vector3d &t_last,
+                            Eigen::Quaterniond &q_incre, Eigen::Vector3d &t_incre, Icp_correspondence_vec &correspondences, Search_buffer &buffer )
+{
+    Icp_correspondence         correspondence;
+    pcl::PointCloud<PointType> pts_map;
+    Eigen::Vector3d            t_prior = t_incre;
+    double                     para[ 7 ] = { q_incre.x(), q_incre.y(), q_incre.z(), q_incre.w(), t_incre( 0 ), t_incre( 1 ), t_incre( 2 ) };
+    for ( int iter = 0; iter < g_icp_max_iterations; iter++ )
+    {
+        Eigen::Quaterniond q_curr = q_last * q_incre;
+        Eigen::Vector3d    t_curr = q_last * t_incre + t_last;
+        correspondences.clear();
+        for ( int if_corner = 1; if_corner >= 0; if_corner-- )
+        {
+            transform_to_map( frame.m_pts[ if_corner ], q_curr, t_curr, pts_map );
+            for ( size_t i = 0; i < pts_map.points.size(); i++ )
+            {
+                if ( associate_point( backend, if_corner, frame.m_pts[ if_corner ].points[ i ], pts_map.points[ i ], correspondence, buffer ) )
+                {
+                    correspondences.push_back( correspondence );
+                }
+            }
+        }
+
+        solve_with_lm( correspondences, q_last, t_last, t_prior, para );
+        q_incre = Eigen::Quaterniond( para[ 3 ], para[ 0 ], para[ 1 ], para[ 2 ] );
+        t_incre = Eigen::Vector3d( para[ 4 ], para[ 5 ], para[ 6 ] );
+        if ( iter >= 1 && ( q_last * t_incre + t_last - t_curr ).norm() < g_converge_translation &&
+             ( q_last * q_incre ).angularDistance( q_curr ) * 57.3 < g_converge_rotation )
+        {
+            break;
+        }
+    }
+}
+
+// Put the frame into the cubes, and the centroids of the changed voxels of the window into the backends, like Laser_mapping.
+static void insert_frame( Points_cube_map &cube_map, const Feature_frame &frame, const Eigen::Quaterniond &q, const Eigen::Vector3d &t,
+                          const int *center_idx, const float *resolution, Map_search_backend **backends, Backend_statistic *statistics )
+{
+    pcl::PointCloud<PointType> pts_map;
+    int                        pt_idx;
+    PointType                  old_centroid;
+    for ( int if_corner = 0; if_corner < 2; if_corner++ )
+    {
+        std::vector<std::pair<Points_cube *, int>> changed_voxels;
+        std::unordered_set<int64_t>                changed_voxel_keys;
+        std::vector<PointType>                     old_centroids;
+        transform_to_map( frame.m_pts[ if_corner ], q, t, pts_map );
+        for ( size_t i = 0; i < pts_map.points.size(); i++ )
+        {
+            const PointType &pt = pts_map.points[ i ];
+            int              cube_i, cube_j, cube_k;
+            cube_map.get_cube_index( pt.x, pt.y, pt.z, cube_i, cube_j, cube_k );
+            if ( !cube_map.is_in_grid( cube_i, cube_j, cube_k ) )
+            {
+                continue;
+            }
+            Points_cube *cube = cube_map.get_cube( cube_map.get_cube_id( cube_i, cube_j, cube_k ) );
+            bool         if_new_voxel = cube->add_point( if_corner, pt, resolution[ if_corner ], &pt_idx, &old_centroid );
+            if ( abs( cube_i - center_idx[ 0 ] ) <= 2 && abs( cube_j - center_idx[ 1 ] ) <= 2 && abs( cube_k - center_idx[ 2 ] ) <= 1 &&
+                 changed_voxel_keys.insert( ( cube_map.get_slot_index( cube->m_id ) << 32 ) | pt_idx ).second )
+            {
+                changed_voxels.push_back( std::make_pair( cube, pt_idx ) );
+                if ( !if_new_voxel )
+                {
+                    old_centroids.push_back( old_centroid );
+                }
+            }
+        }
+
+        std::vector<PointType> new_centroids( changed_voxels.size() );
+        for ( size_t i = 0; i < new_centroids.size(); i++ )
+        {
+            Points_cube *cube = changed_voxels[ i ].first;
+            new_centroids[ i ] = ( if_corner ? cube->m_corner_pts : cube->m_surface_pts )->points[ changed_voxels[ i ].second ];
+        }
+        for ( int b = 0; b < g_backend_num; b++ )
+        {
+            ros::WallTime start_time = ros::WallTime::now();
+            backends[ b ]->update_points( if_corner, old_centroids, new_centroids );
+            statistics[ b ].m_build_time += ( ros::WallTime::now() - start_time ).toSec();
+        }
+    }
+}
+
+// k nearest search of all feature points at the pose, compared to the first backend.
+static void compare_queries( const Feature_frame &frame, const Eigen::Quaterniond &q, const Eigen::Vector3d &t,
+                             Map_search_backend **backends, Backend_statistic *statistics )
+{
+    pcl::PointCloud<PointType>          pts_map;
+    std::vector<std::vector<PointType>> results[ g_backend_num ];
+    std::vector<std::vector<float>>     results_sq_dis[ g_backend_num ];
+    for ( int if_corner = 0; if_corner < 2; if_corner++ )
+    {
+        transform_to_map( frame.m_pts[ if_corner ], q, t, pts_map );
+        int query_num = pts_map.points.size();
+        for ( int b = 0; b < g_backend_num; b++ )
+        {
+            Map_search_backend::Search_buffer buffer;
+            results[ b ].resize( query_num );
+            results_sq_dis[ b ].resize( query_num );
+            ros::WallTime start_time = ros::WallTime::now();
+            for ( int i = 0; i < query_num; i++ )
+            {
+                backends[ b ]->nearest_search( if_corner, pts_map.points[ i ], g_search_num, results[ b ][ i ], results_sq_dis[ b ][ i ], buffer );
+            }
+            statistics[ b ].m_query_time += ( ros::WallTime::now() - start_time ).toSec();
+            statistics[ b ].m_query_num += query_num;
+        }
+
+        for ( int i = 0; i < query_num; i++ )
+        {
+            bool if_ref_accepted = false;
+            for ( int b = 0; b < g_backend_num; b++ )
+            {
+                const std::vector<PointType> &pts = results[ b ][ i ];
+                const std::vector<float> &    sq_dis = results_sq_dis[ b ][ i ];
+                bool                          if_accepted = ( int ) pts.size() == g_search_num && sq_dis[ g_search_num - 1 ] < g_max_sq_dis[ if_corner ];
+                if ( b == 0 )
+                {
+                    if_ref_accepted = if_accepted;
+                }
+                statistics[ b ].m_agree_num += ( if_accepted == if_ref_accepted );
+                if ( !if_ref_accepted )
+                {
+                    continue;
+                }
+                statistics[ b ].m_accepted_num++;
+                for ( size_t j = 0; j < results[ 0 ][ i ].size(); j++ )
+                {
+                    const PointType &ref_pt = results[ 0 ][ i ][ j ];
+                    for ( size_t k = 0; k < pts.size(); k++ )
+                    {
+                        if ( pts[ k ].x == ref_pt.x && pts[ k ].y == ref_pt.y && pts[ k ].z == ref_pt.z )
+                        {
+                            statistics[ b ].m_recall_num++;
+                            break;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Solve the same correspondences from the same initial guess with every solver, compared to ceres with analytic jacobian.
+static void compare_solvers( const Icp_correspondence_vec &correspondences, const Eigen::Quaterniond &q_last, const Eigen::Vector3d &t_last,
+                             const Eigen::Quaterniond &q_incre_init, const Eigen::Vector3d &t_incre_init, Solver_statistic *statistics )
+{
+    double para_init[ 7 ] = { q_incre_init.x(), q_incre_init.y(), q_incre_init.z(), q_incre_init.w(), t_incre_init( 0 ), t_incre_init( 1 ), t_incre_init( 2 ) };
+    double para[ g_solver_num ][ 7 ];
+    for ( int solver = 0; solver < g_solver_num; solver++ )
+    {
+        std::copy( para_init, para_init + 7, para[ solver ] );
+        ros::WallTime start_time = ros::WallTime::now();
+        if ( solver == e_solver_lm )
+        {
+            solve_with_lm( correspondences, q_last, t_last, t_incre_init, para[ solver ] );
+        }
+        else
+        {
+            solve_with_ceres( correspondences, q_last, t_last, t_incre_init, solver == e_solver_ceres_analytic, para[ solver ] );
+        }
+        statistics[ solver ].m_solve_time += ( ros::WallTime::now() - start_time ).toSec();
+    }
+
+    const double *para_ref = para[ e_solver_ceres_analytic ];
+    for ( int solver = 0; solver < g_solver_num; solver++ )
+    {
+        double angle_diff = Eigen::Quaterniond( para[ solver ][ 3 ], para[ solver ][ 0 ], para[ solver ][ 1 ], para[ solver ][ 2 ] )
+                                .angularDistance( Eigen::Quaterniond( para_ref[ 3 ], para_ref[ 0 ], para_ref[ 1 ], para_ref[ 2 ] ) ) * 57.3;
+        double t_diff = ( Eigen::Vector3d( para[ solver ][ 4 ], para[ solver ][ 5 ], para[ solver ][ 6 ] ) -
+                          Eigen::Vector3d( para_ref[ 4 ], para_ref[ 5 ], para_ref[ 6 ] ) ).norm();
+        statistics[ solver ].m_solve_num++;
+        statistics[ solver ].m_angle_diff_sum += angle_diff;
+        statistics[ solver ].m_angle_diff_max = std::max( statistics[ solver ].m_angle_diff_max, angle_diff );
+        statistics[ solver ].m_t_diff_sum += t_diff;
+        statistics[ solver ].m_t_diff_max = std::max( statistics[ solver ].m_t_diff_max, t_diff );
+    }
+}
+
+// Replay the frames, see the top of this file.
+static void run_benchmark( const std::vector<Feature_frame> &frames, float line_resolution, float plane_resolution )
+{
+    Points_cube_map cube_map;
+    cube_map.init( 50.0, 50.0, 50.0, 50, 50, 50 ); // default mapping_cube_* of Laser_mapping
+    float               max_sq_dis[ 2 ] = { g_max_sq_dis[ 0 ], g_max_sq_dis[ 1 ] };
+    float               resolution[ 2 ] = { plane_resolution, line_resolution };
+    Map_search_backend *backends[ g_backend_num ];
+    Backend_statistic   statistics[ g_backend_num ];
+    Solver_statistic    solver_statistics[ g_solver_num ];
+    for ( int b = 0; b < g_backend_num; b++ )
+    {
+        backends[ b ] = Map_search_backend::create( b, 1.0, max_sq_dis );
+    }
+
+    Search_buffer          buffer;
+    Icp_correspondence_vec correspondences, correspondences_ref;
+    Eigen::Quaterniond q_last = Eigen::Quaterniond::Identity(), q_incre_last = Eigen::Quaterniond::Identity();
+    Eigen::Vector3d    t_last = Eigen::Vector3d::Zero(), t_incre_last = Eigen::Vector3d::Zero();
+    std::vector<Points_cube_map::Cube_id> window_ids;
+    for ( size_t frame_idx = 0; frame_idx < frames.size(); frame_idx++ )
+    {
+        const Feature_frame &frame = frames[ frame_idx ];
+        int                  center_idx[ 3 ];
+        cube_map.get_cube_index( t_last( 0 ), t_last( 1 ), t_last( 2 ), center_idx[ 0 ], center_idx[ 1 ], center_idx[ 2 ] );
+        window_ids.clear();
+        for ( int i = center_idx[ 0 ] - 2; i <= center_idx[ 0 ] + 2; i++ )
+        {
+            for ( int j = center_idx[ 1 ] - 2; j <= center_idx[ 1 ] + 2; j++ )
+            {
+                for ( int k = center_idx[ 2 ] - 1; k <= center_idx[ 2 ] + 1; k++ )
+                {
+                    if ( cube_map.is_in_grid( i, j, k ) )
+                    {
+                        window_ids.push_back( cube_map.get_cube_id( i, j, k ) );
+                    }
+                }
+            }
+        }
+        for ( int b = 0; b < g_backend_num; b++ )
+        {
+            ros::WallTime start_time = ros::WallTime::now();
+            backends[ b ]->update_window( cube_map, window_ids.data(), window_ids.size() );
+            statistics[ b ].m_build_time += ( ros::WallTime::now() - start_time ).toSec();
+        }
+
+        Eigen::Quaterniond q_curr = q_last;
+        Eigen::Vector3d    t_curr = t_last;
+        if ( ( int ) frame_idx > g_init_frame_num && backends[ 0 ]->size( 0 ) > 50 ) // SURFACE_MIN_MAP_NUM
+        {
+            // Every backend starts from the constant velocity guess, the reference result is the pose of the frame.
+            Eigen::Quaterniond q_incre_ref;
+            Eigen::Vector3d    t_incre_ref;
+            for ( int b = 0; b < g_backend_num; b++ )
+            {
+                Eigen::Quaterniond q_incre = q_incre_last;
+                Eigen::Vector3d    t_incre = t_incre_last;
+                ros::WallTime      start_time = ros::WallTime::now();
+                register_frame( backends[ b ], frame, q_last, t_last, q_incre, t_incre, correspondences, buffer );
+                statistics[ b ].m_register_time += ( ros::WallTime::now() - start_time ).toSec();
+                if ( b == 0 )
+                {
+                    q_incre_ref = q_incre;
+                    t_incre_ref = t_incre;
+                    correspondences_ref.swap( correspondences );
+                }
+                double angle_diff = q_incre.angularDistance( q_incre_ref ) * 57.3;
+                double t_diff = ( q_last * ( t_incre - t_incre_ref ) ).norm();
+                statistics[ b ].m_register_num++;
+                statistics[ b ].m_angle_diff_sum += angle_diff;
+                statistics[ b ].m_angle_diff_max = std::max( statistics[ b ].m_angle_diff_max, angle_diff );
+                statistics[ b ].m_t_diff_sum += t_diff;
+                statistics[ b ].m_t_diff_max = std::max( statistics[ b ].m_t_diff_max, t_diff );
+            }
+            compare_solvers( correspondences_ref, q_last, t_last, q_incre_last, t_incre_last, solver_statistics );
+            q_incre_last = q_incre_ref;
+            t_incre_last = t_incre_ref;
+            q_curr = q_last * q_incre_ref;
+            t_curr = q_last * t_incre_ref + t_last;
+            compare_queries( frame, q_curr, t_curr, backends, statistics );
+        }
+
+        insert_frame( cube_map, frame, q_curr, t_curr, center_idx, resolution, backends, statistics );
+        q_last = q_curr;
+        t_last = t_curr;
+        if ( frame_idx % 100 == 0 )
+        {
+            printf( "Frame %d / %d, map corner %d, surface %d \r\n", ( int ) frame_idx, ( int ) frames.size(), backends[ 0 ]->size( 1 ), backends[ 0 ]->size( 0 ) );
+        }
+    }
+
+    printf( "%d frames, %d registered, last position [%.2f, %.2f, %.2f] \r\n", ( int ) frames.size(), statistics[ 0 ].m_register_num, t_last( 0 ), t_last( 1 ), t_last( 2 ) );
+    printf( "%-20s %12s %12s %14s %10s %10s %22s %22s \r\n", "backend", "build(ms)", "query(us)", "register(ms)", "recall(%)", "agree(%)",
+            "angle diff avg/max", "trans diff avg/max(cm)" );
+    for ( int b = 0; b < g_backend_num; b++ )
+    {
+        const Backend_statistic &s = statistics[ b ];
+        int                      register_num = std::max( s.m_register_num, 1 );
+        printf( "%-20s %12.3f %12.3f %14.3f %10.3f %10.3f %10.5f / %9.5f %10.4f / %9.4f \r\n", backends[ b ]->name(),
+                s.m_build_time * 1000.0 / std::max( ( int ) frames.size(), 1 ),
+                s.m_query_time * 1e6 / std::max( s.m_query_num, 1L ),
+                s.m_register_time * 1000.0 / register_num,
+                s.m_recall_num * 100.0 / std::max( s.m_accepted_num * g_search_num, 1L ),
+                s.m_agree_num * 100.0 / std::max( s.m_query_num, 1L ),
+                s.m_angle_diff_sum / register_num, s.m_angle_diff_max,
+                s.m_t_diff_sum * 100.0 / register_num, s.m_t_diff_max * 100.0 );
+        delete backends[ b ];
+    }
+
+    printf( "%-20s %12s %10s %22s %22s \r\n", "solver", "solve(ms)", "speedup", "angle diff avg/max", "trans diff avg/max(cm)" );
+    for ( int solver = 0; solver < g_solver_num; solver++ )
+    {
+        const Solver_statistic &s = solver_statistics[ solver ];
+        int                     solve_num = std::max( s.m_solve_num, 1 );
+        printf( "%-20s %12.3f %10.2f %10.5f / %9.5f %10.4f / %9.4f \r\n", g_solver_names[ solver ],
+                s.m_solve_time * 1000.0 / solve_num,
+                solver_statistics[ e_solver_ceres_analytic ].m_solve_time / std::max( s.m_solve_time, 1e-9 ),
+                s.m_angle_diff_sum / solve_num, s.m_angle_diff_max,
+                s.m_t_diff_sum * 100.0 / solve_num, s.m_t_diff_max * 100.0 );
+    }
+}
+
+int main( int argc, char **argv )
+{
+    if ( argc < 2 )
+    {
+        printf( "Usage: %s bag_file [ line_resolution plane_resolution max_frame_num ]\r\n", argv[ 0 ] );
+        return 1;
+    }
+    float line_resolution = argc > 2 ? atof( argv[ 2 ] ) : 0.05; // mapping_line_resolution of launch/rosbag.launch
+    float plane_resolution = argc > 3 ? atof( argv[ 3 ] ) : 0.4;
+    int   max_frame_num = argc > 4 ? atoi( argv[ 4 ] ) : 0;
+    ros::Time::init();
+
+    // The corner and surface clouds of one frame carry the same stamp.
+    std::map<ros::Time, Feature_frame> frame_map;
+    rosbag::Bag                        bag;
+    try
+    {
+        bag.open( argv[ 1 ], rosbag::bagmode::Read );
+        std::vector<std::string> topics = { "/pc2_surface", "/pc2_corners" };
+        rosbag::View             view( bag, rosbag::TopicQuery( topics ) );
+        for ( rosbag::View::iterator it = view.begin(); it != view.end(); it++ )
+        {
+            sensor_msgs::PointCloud2::ConstPtr msg = it->instantiate<sensor_msgs::PointCloud2>();
+            if ( msg != nullptr )
+            {
+                Common_tools::Point_cloud2_view( *msg ).copy_to( frame_map[ msg->header.stamp ].m_pts[ it->getTopic() == topics[ 1 ] ] );
+            }
+        }
+        bag.close();
+    }
+    catch ( rosbag::BagException &e )
+    {
+        printf( "Can not read %s: %s\r\n", argv[ 1 ], e.what() );
+        return 1;
+    }
+
+    // Down sampled like Laser_mapping does before matching
+    std::vector<Feature_frame> frames;
+    pcl::VoxelGrid<PointType>  down_sample_filter[ 2 ];
+    down_sample_filter[ 0 ].setLeafSize( plane_resolution, plane_resolution, plane_resolution );
+    down_sample_filter[ 1 ].setLeafSize( line_resolution, line_resolution, line_resolution );
+    for ( std::map<ros::Time, Feature_frame>::iterator it = frame_map.begin(); it != frame_map.end(); it++ )
+    {
+        if ( max_frame_num > 0 && ( int ) frames.size() >= max_frame_num )
+        {
+            break;
+        }
+        frames.push_back( Feature_frame() );
+        for ( int if_corner = 0; if_corner < 2; if_corner++ )
+        {
+            pcl::PointCloud<PointType>::Ptr pts( new pcl::PointCloud<PointType>( it->second.m_pts[ if_corner ] ) );
+            down_sample_filter[ if_corner ].setInputCloud( pts );
+            down_sample_filter[ if_corner ].filter( frames.back().m_pts[ if_corner ] );
+        }
+    }
+    printf( "Read %d frames from %s \r\n", ( int ) frames.size(), argv[ 1 ] );
+
+    run_benchmark( frames, line_resolution, plane_resolution );
+    return 0;
+}
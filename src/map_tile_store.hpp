@@ -0,0 +1,403 @@
+// Author: Lin Jiarong          ziv.lin.ljr@gmail.com
+
+#ifndef __MAP_TILE_STORE_HPP__
+#define __MAP_TILE_STORE_HPP__
+
+#include <atomic>
+#include <condition_variable>
+#include <math.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <Eigen/Eigen>
+
+#include "map_file.hpp"
+#include "tools/blocking_queue.hpp"
+
+// Out-of-core storage of Points_cube_map: cubes farther than m_page_out_distance ( in cubes ) from the sensor,
+// or outside of the grid, are moved to one Map_file per cube in m_dir and freed. They are read back by a
+// background thread once they come within m_prefetch_distance of the sensor, or of the sensor position
+// predicted m_prefetch_frames ahead. A cube needed by the search window before it is read back is
+// loaded synchronously, so matching always sees the whole map.
+// update() must be called by the thread which owns the cube map, before the window is searched.
+class Map_tile_store
+{
+  public:
+    typedef Points_cube_map::Cube_id Cube_id;
+    typedef Map_file::Tile           Tile;
+
+    std::string m_dir = "./map_tiles/";
+    int         m_page_out_distance[ 3 ] = { 4, 4, 3 }; // in cubes, per axis
+    int         m_prefetch_distance[ 3 ] = { 3, 3, 2 }; // less than m_page_out_distance, or cubes are paged in and out again
+    int         m_prefetch_frames = 20;
+    float       m_line_resolution = 0.4;
+    float       m_plane_resolution = 0.8;
+    bool        m_if_primitive = false;
+
+    // Counters since construction
+    size_t              m_page_out_num = 0;
+    size_t              m_page_in_num = 0;
+    size_t              m_sync_page_in_num = 0; // paged in after it entered the window, prefetch was too late
+    std::atomic<size_t> m_io_error_num{ 0 };
+
+  private:
+    enum Tile_state
+    {
+        e_writing = 0, // m_tile is valid, being written by the io thread
+        e_on_disk = 1,
+        e_reading = 2, // read requested
+        e_ready = 3,   // m_tile is valid, read back and waiting for update()
+    };
+
+    struct Tile_entry
+    {
+        int                   m_state = e_on_disk;
+        std::shared_ptr<Tile> m_tile;
+    };
+
+    struct Io_job
+    {
+        int                   m_if_write = 0;
+        Cube_id               m_id = -1;
+        std::shared_ptr<Tile> m_tile;
+    };
+
+    std::unordered_map<Cube_id, Tile_entry> m_tiles; // cubes which are not in the cube map
+    std::mutex                              m_mutex;
+    std::condition_variable                 m_cv_ready;
+    Common_tools::Blocking_queue<Io_job>    m_io_jobs{ 1 << 20 }; // never dropped, just a bound of the memory
+    std::thread                             m_io_thread;
+    double                                  m_cube_size[ 3 ] = { 50, 50, 50 };
+    Eigen::Vector3d                         m_last_position = Eigen::Vector3d::Zero();
+    bool                                    m_if_init = false;
+
+    std::string get_file_name( const Cube_id &id ) const
+    {
+        return m_dir + "/cube_" + std::to_string( id ) + ".map";
+    }
+
+    bool read_tile( const Cube_id &id, Tile &tile )
+    {
+        std::vector<Tile> tiles;
+        Map_file          map_file;
+        if ( !map_file.read( get_file_name( id ), tiles ) || tiles.size() != 1 )
+        {
+            return false;
+        }
+        tile.m_id = tiles[ 0 ].m_id;
+        tile.m_version = tiles[ 0 ].m_version;
+        tile.m_corner_pts.swap( tiles[ 0 ].m_corner_pts );
+        tile.m_surface_pts.swap( tiles[ 0 ].m_surface_pts );
+        return true;
+    }
+
+    void io_process()
+    {
+        Io_job job;
+        while ( m_io_jobs.pop( job ) )
+        {
+            if ( job.m_if_write )
+            {
+                Map_file map_file;
+                bool     if_ok = map_file.write( std::vector<Tile>( 1, *job.m_tile ), m_cube_size, m_line_resolution, m_plane_resolution, get_file_name( job.m_id ) );
+                std::unique_lock<std::mutex> lock( m_mutex );
+                m_io_error_num += !if_ok;
+                auto it = m_tiles.find( job.m_id );
+                // Keep the tile in memory if it can not be written
+                if ( if_ok && it != m_tiles.end() && it->second.m_state == e_writing && it->second.m_tile == job.m_tile )
+                {
+                    it->second.m_state = e_on_disk;
+                    it->second.m_tile.reset();
+                }
+            }
+            else
+            {
+                std::shared_ptr<Tile> tile = std::make_shared<Tile>();
+                bool                  if_ok = read_tile( job.m_id, *tile );
+                {
+                    std::unique_lock<std::mutex> lock( m_mutex );
+                    m_io_error_num += !if_ok;
+                    auto it = m_tiles.find( job.m_id );
+                    if ( it != m_tiles.end() && it->second.m_state == e_reading )
+                    {
+                        it->second.m_state = if_ok ? e_ready : e_on_disk;
+                        it->second.m_tile = if_ok ? tile : nullptr;
+                    }
+                }
+                m_cv_ready.notify_all();
+            }
+        }
+    }
+
+    // Return the tile of a cube in m_tiles, wait for the io thread if it is being read.
+    std::shared_ptr<Tile> take_tile( const Cube_id &id )
+    {
+        std::unique_lock<std::mutex> lock( m_mutex );
+        auto                         it = m_tiles.find( id );
+        m_cv_ready.wait( lock, [&] { return it->second.m_state != e_reading; } );
+        std::shared_ptr<Tile> tile = it->second.m_tile;
+        if ( tile == nullptr )
+        {
+            lock.unlock();
+            tile = std::make_shared<Tile>();
+            if ( !read_tile( id, *tile ) )
+            {
+                lock.lock();
+                m_io_error_num++;
+                return nullptr; // keep the entry, try again next time
+            }
+            lock.lock();
+        }
+        m_tiles.erase( id );
+        return tile;
+    }
+
+    static bool is_far( const int *dis, const int *max_dis )
+    {
+        return abs( dis[ 0 ] ) > max_dis[ 0 ] || abs( dis[ 1 ] ) > max_dis[ 1 ] || abs( dis[ 2 ] ) > max_dis[ 2 ];
+    }
+
+  public:
+    Map_tile_store(){};
+
+    ~Map_tile_store()
+    {
+        m_io_jobs.stop(); // the io thread writes the queued tiles before it quits
+        if ( m_io_thread.joinable() )
+        {
+            m_io_thread.join();
+        }
+    }
+
+    // page_out_distance and prefetch_distance in meter.
+    void init( const std::string &dir, const Points_cube_map &cube_map, double page_out_distance, double prefetch_distance )
+    {
+        m_dir = dir;
+        mkdir( m_dir.c_str(), 0775 );
+        m_cube_size[ 0 ] = cube_map.m_cube_w;
+        m_cube_size[ 1 ] = cube_map.m_cube_h;
+        m_cube_size[ 2 ] = cube_map.m_cube_d;
+        for ( int i = 0; i < 3; i++ )
+        {
+            // The 5x5x3 window must stay in memory
+            m_page_out_distance[ i ] = std::max( ( int ) ceil( page_out_distance / m_cube_size[ i ] ), i < 2 ? 3 : 2 );
+            m_prefetch_distance[ i ] = std::min( std::max( ( int ) ceil( prefetch_distance / m_cube_size[ i ] ), i < 2 ? 2 : 1 ),
+                                                 m_page_out_distance[ i ] - 1 );
+        }
+        m_io_thread = std::thread( &Map_tile_store::io_process, this );
+    }
+
+    // Cubes which are not in the cube map yet, e.g. the outside tiles of Map_file::load().
+    void add_tiles( std::vector<Tile> &tiles )
+    {
+        for ( size_t i = 0; i < tiles.size(); i++ )
+        {
+            std::shared_ptr<Tile> tile = std::make_shared<Tile>();
+            tile->m_id = tiles[ i ].m_id;
+            tile->m_version = tiles[ i ].m_version;
+            tile->m_corner_pts.swap( tiles[ i ].m_corner_pts );
+            tile->m_surface_pts.swap( tiles[ i ].m_surface_pts );
+            page_out( tile );
+        }
+    }
+
+    void page_out( const std::shared_ptr<Tile> &tile )
+    {
+        {
+            std::unique_lock<std::mutex> lock( m_mutex );
+            m_tiles[ tile->m_id ].m_state = e_writing;
+            m_tiles[ tile->m_id ].m_tile = tile;
+        }
+        Io_job job;
+        job.m_if_write = 1;
+        job.m_id = tile->m_id;
+        job.m_tile = tile;
+        m_io_jobs.push_wait( job );
+        m_page_out_num++;
+    }
+
+    // Page cubes in and out around the sensor position ( in meter ), window_ids are the cubes to be searched.
+    // Primitives which get new points are appended to changed_primitives and need fit().
+    void update( Points_cube_map &cube_map, const Eigen::Vector3d &position, const Cube_id *window_ids, int window_size,
+                 std::vector<Voxel_primitive *> &changed_primitives )
+    {
+        Eigen::Vector3d predict_position = position;
+        if ( m_if_init )
+        {
+            predict_position += ( position - m_last_position ) * m_prefetch_frames;
+        }
+        m_last_position = position;
+        m_if_init = true;
+        int center[ 3 ], predict_center[ 3 ];
+        cube_map.get_cube_index( position( 0 ), position( 1 ), position( 2 ), center[ 0 ], center[ 1 ], center[ 2 ] );
+        cube_map.get_cube_index( predict_position( 0 ), predict_position( 1 ), predict_position( 2 ), predict_center[ 0 ], predict_center[ 1 ], predict_center[ 2 ] );
+        center[ 0 ] -= cube_map.m_center_width; // to world index
+        center[ 1 ] -= cube_map.m_center_height;
+        center[ 2 ] -= cube_map.m_center_depth;
+        predict_center[ 0 ] -= cube_map.m_center_width;
+        predict_center[ 1 ] -= cube_map.m_center_height;
+        predict_center[ 2 ] -= cube_map.m_center_depth;
+
+        std::vector<Voxel_primitive *> *primitives = m_if_primitive ? &changed_primitives : nullptr;
+        std::vector<Cube_id>            page_in_ids, prefetch_ids;
+        {
+            std::unique_lock<std::mutex> lock( m_mutex );
+            if ( m_tiles.size() )
+            {
+                for ( int i = 0; i < window_size; i++ )
+                {
+                    if ( m_tiles.count( window_ids[ i ] ) )
+                    {
+                        page_in_ids.push_back( window_ids[ i ] );
+                        m_sync_page_in_num++;
+                    }
+                }
+            }
+            for ( auto it = m_tiles.begin(); it != m_tiles.end(); it++ )
+            {
+                int wi[ 3 ], dis[ 3 ], predict_dis[ 3 ];
+                cube_map.get_world_index( it->first, wi[ 0 ], wi[ 1 ], wi[ 2 ] );
+                for ( int axis = 0; axis < 3; axis++ )
+                {
+                    dis[ axis ] = wi[ axis ] - center[ axis ];
+                    predict_dis[ axis ] = wi[ axis ] - predict_center[ axis ];
+                }
+                // A cube farther than m_page_out_distance would be paged out again by this update()
+                bool if_near = !is_far( dis, m_page_out_distance );
+                if ( it->second.m_state == e_ready )
+                {
+                    if ( if_near )
+                    {
+                        page_in_ids.push_back( it->first );
+                    }
+                    else
+                    {
+                        it->second.m_state = e_on_disk; // the sensor moved away before it was read back
+                        it->second.m_tile.reset();
+                    }
+                }
+                else if ( !is_far( dis, m_prefetch_distance ) || !is_far( predict_dis, m_prefetch_distance ) )
+                {
+                    if ( it->second.m_state == e_writing && if_near )
+                    {
+                        page_in_ids.push_back( it->first ); // still in memory
+                    }
+                    else if ( it->second.m_state == e_on_disk )
+                    {
+                        it->second.m_state = e_reading;
+                        prefetch_ids.push_back( it->first );
+                    }
+                }
+            }
+        }
+
+        for ( size_t i = 0; i < prefetch_ids.size(); i++ )
+        {
+            Io_job job;
+            job.m_id = prefetch_ids[ i ];
+            m_io_jobs.push_wait( job );
+        }
+
+        for ( size_t i = 0; i < page_in_ids.size(); i++ )
+        {
+            if ( !Map_file::is_tile_in_grid( cube_map, page_in_ids[ i ] ) )
+            {
+                continue; // the predicted position may be outside of the grid, keep it until the grid moves there
+            }
+            {
+                std::unique_lock<std::mutex> lock( m_mutex );
+                if ( m_tiles.count( page_in_ids[ i ] ) == 0 )
+                {
+                    continue; // listed twice
+                }
+            }
+            std::shared_ptr<Tile> tile = take_tile( page_in_ids[ i ] );
+            if ( tile != nullptr )
+            {
+                Map_file::insert_tile( cube_map, *tile, m_line_resolution, m_plane_resolution, primitives );
+                m_page_in_num++;
+            }
+        }
+
+        // Points inserted to a cube which is on disk, e.g. far points of the lidar, are merged with it before paging out.
+        std::vector<Cube_id> page_out_ids;
+        cube_map.for_each_cube( [&]( Points_cube &cube ) {
+            int wi[ 3 ], dis[ 3 ];
+            cube_map.get_world_index( cube.m_id, wi[ 0 ], wi[ 1 ], wi[ 2 ] );
+            for ( int axis = 0; axis < 3; axis++ )
+            {
+                dis[ axis ] = wi[ axis ] - center[ axis ];
+            }
+            if ( is_far( dis, m_page_out_distance ) || !Map_file::is_tile_in_grid( cube_map, cube.m_id ) )
+            {
+                page_out_ids.push_back( cube.m_id );
+            }
+        }, true );
+        for ( size_t i = 0; i < page_out_ids.size(); i++ )
+        {
+            bool if_on_disk;
+            {
+                std::unique_lock<std::mutex> lock( m_mutex );
+                if_on_disk = m_tiles.count( page_out_ids[ i ] ) > 0;
+            }
+            if ( if_on_disk )
+            {
+                std::shared_ptr<Tile> old_tile = take_tile( page_out_ids[ i ] );
+                if ( old_tile == nullptr )
+                {
+                    continue; // keep it in memory, the tile on disk can not be read
+                }
+                Map_file::insert_tile( cube_map, *old_tile, m_line_resolution, m_plane_resolution, nullptr );
+            }
+            std::shared_ptr<Tile> tile = std::make_shared<Tile>();
+            Map_file::cube_to_tile( *cube_map.find_cube( page_out_ids[ i ] ), *tile );
+            cube_map.erase_cube( page_out_ids[ i ] );
+            page_out( tile );
+        }
+    }
+
+    // Copy of all cubes which are not in the cube map, for saving the whole map. Tiles which are only on disk
+    // are listed in on_disk_ids instead, read_tiles() reads them without blocking the thread of update().
+    void get_tiles( std::vector<Tile> &tiles, std::vector<Cube_id> &on_disk_ids )
+    {
+        std::unique_lock<std::mutex> lock( m_mutex );
+        for ( auto it = m_tiles.begin(); it != m_tiles.end(); it++ )
+        {
+            if ( it->second.m_tile != nullptr )
+            {
+                tiles.push_back( *it->second.m_tile );
+            }
+            else
+            {
+                on_disk_ids.push_back( it->first );
+            }
+        }
+    }
+
+    // Append the tiles of ids on disk to tiles, can be called by any thread.
+    void read_tiles( const std::vector<Cube_id> &ids, std::vector<Tile> &tiles )
+    {
+        for ( size_t i = 0; i < ids.size(); i++ )
+        {
+            tiles.push_back( Tile() );
+            if ( !read_tile( ids[ i ], tiles.back() ) )
+            {
+                tiles.pop_back();
+                m_io_error_num++;
+            }
+        }
+    }
+
+    size_t size()
+    {
+        std::unique_lock<std::mutex> lock( m_mutex );
+        return m_tiles.size();
+    }
+};
+
+#endif
@@ -0,0 +1,146 @@
+// Author: Lin Jiarong          ziv.lin.ljr@gmail.com
+
+#ifndef __MOTION_PRIOR_HPP__
+#define __MOTION_PRIOR_HPP__
+
+#include <algorithm>
+#include <deque>
+#include <math.h>
+#include <mutex>
+
+#include <Eigen/Eigen>
+
+// Initial guess of the incremental transform of scan-to-map registration, in the frame of the last pose,
+// the same as ( m_q_w_incre, m_t_w_incre ) of Laser_mapping.
+// Translation is extrapolated from the last registered frame ( constant velocity ), rotation is the integral
+// of the gyroscope between the two frames if the imu covers that interval, else also constant velocity.
+// The imu is assumed to be aligned with the lidar, e.g. the built-in imu of livox, and its rotation
+// extrinsic is m_q_lidar_imu otherwise. Accelerometer is not integrated, it drifts too fast without bias estimation.
+// add_imu() is called by the ros callback thread, the others by the mapping thread.
+class Motion_prior
+{
+  public:
+    enum Prior_source
+    {
+        e_none = 0, // no motion history, e.g. first frame or after a rejected registration
+        e_constant_velocity = 1,
+        e_imu = 2,
+    };
+
+    double             m_max_extrapolate_ratio = 3.0; // the last motion is not extrapolated over more than this times its interval
+    double             m_imu_buffer_time = 2.0;       // in second
+    Eigen::Quaterniond m_q_lidar_imu = Eigen::Quaterniond::Identity();
+
+    // Counters since construction
+    size_t m_source_num[ 3 ] = { 0, 0, 0 };
+
+  private:
+    struct Imu_sample
+    {
+        double          m_time;
+        Eigen::Vector3d m_gyro;
+    };
+
+    std::deque<Imu_sample> m_imu_samples;
+    std::mutex             m_mutex_imu;
+
+    Eigen::Quaterniond m_last_q_incre = Eigen::Quaterniond::Identity();
+    Eigen::Vector3d    m_last_t_incre = Eigen::Vector3d::Zero();
+    double             m_last_interval = 0;
+    double             m_last_time = -1;
+    bool               m_if_motion_valid = false;
+
+    // Integrate gyroscope over [ time_begin, time_end ] with piecewise constant angular rate.
+    bool integrate_imu( double time_begin, double time_end, Eigen::Quaterniond &q_incre )
+    {
+        std::unique_lock<std::mutex> lock( m_mutex_imu );
+        if ( m_imu_samples.size() < 2 || m_imu_samples.front().m_time > time_begin || m_imu_samples.back().m_time < time_end )
+        {
+            return false;
+        }
+        q_incre.setIdentity();
+        for ( size_t i = 0; i + 1 < m_imu_samples.size(); i++ )
+        {
+            double seg_begin = std::max( m_imu_samples[ i ].m_time, time_begin );
+            double seg_end = std::min( m_imu_samples[ i + 1 ].m_time, time_end );
+            if ( seg_end <= seg_begin )
+            {
+                continue;
+            }
+            Eigen::Vector3d rot_vec = 0.5 * ( m_imu_samples[ i ].m_gyro + m_imu_samples[ i + 1 ].m_gyro ) * ( seg_end - seg_begin );
+            double          angle = rot_vec.norm();
+            if ( angle > 1e-12 )
+            {
+                q_incre = q_incre * Eigen::Quaterniond( Eigen::AngleAxisd( angle, rot_vec / angle ) );
+            }
+        }
+        q_incre = m_q_lidar_imu * q_incre * m_q_lidar_imu.inverse();
+        q_incre.normalize();
+        return true;
+    }
+
+  public:
+    Motion_prior(){};
+    ~Motion_prior(){};
+
+    void add_imu( double time, const Eigen::Vector3d &gyro )
+    {
+        std::unique_lock<std::mutex> lock( m_mutex_imu );
+        if ( m_imu_samples.size() && time <= m_imu_samples.back().m_time )
+        {
+            return; // out of order
+        }
+        Imu_sample sample;
+        sample.m_time = time;
+        sample.m_gyro = gyro;
+        m_imu_samples.push_back( sample );
+        while ( m_imu_samples.front().m_time < time - m_imu_buffer_time )
+        {
+            m_imu_samples.pop_front();
+        }
+    }
+
+    // Predict the motion from the last registered frame to the frame at time, return Prior_source.
+    int predict( double time, Eigen::Quaterniond &q_incre, Eigen::Vector3d &t_incre )
+    {
+        q_incre.setIdentity();
+        t_incre.setZero();
+        int source = e_none;
+        if ( m_last_time >= 0 && time > m_last_time )
+        {
+            if ( m_if_motion_valid && m_last_interval > 0 )
+            {
+                double            ratio = std::min( ( time - m_last_time ) / m_last_interval, m_max_extrapolate_ratio );
+                Eigen::AngleAxisd angle_axis( m_last_q_incre );
+                q_incre = Eigen::Quaterniond( Eigen::AngleAxisd( angle_axis.angle() * ratio, angle_axis.axis() ) );
+                t_incre = m_last_t_incre * ratio;
+                source = e_constant_velocity;
+            }
+            if ( integrate_imu( m_last_time, time, q_incre ) )
+            {
+                source = e_imu;
+            }
+        }
+        m_source_num[ source ]++;
+        return source;
+    }
+
+    // Motion of the registered frame at time, from the last one.
+    void update( double time, const Eigen::Quaterniond &q_incre, const Eigen::Vector3d &t_incre )
+    {
+        m_if_motion_valid = ( m_last_time >= 0 );
+        m_last_interval = time - m_last_time;
+        m_last_time = time;
+        m_last_q_incre = q_incre;
+        m_last_t_incre = t_incre;
+    }
+
+    // The frame at time is not registered, the pose is kept, so is the velocity unknown.
+    void reset( double time )
+    {
+        m_if_motion_valid = false;
+        m_last_time = time;
+    }
+};
+
+#endif
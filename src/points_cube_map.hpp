@@ -0,0 +1,407 @@
+// Author: Lin Jiarong          ziv.lin.ljr@gmail.com
+
+#ifndef __POINTS_CUBE_MAP_HPP__
+#define __POINTS_CUBE_MAP_HPP__
+
+#include <algorithm>
+#include <math.h>
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+
+#include <pcl/kdtree/kdtree_flann.h>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+
+#include "tools/common.h"
+#include "voxel_primitive.hpp"
+
+// Points of the map that fall into one cube.
+struct Points_cube
+{
+    int64_t                         m_id = -1; // id of the world cube this slot currently holds
+    pcl::PointCloud<PointType>::Ptr m_corner_pts;
+    pcl::PointCloud<PointType>::Ptr m_surface_pts;
+
+    // Increase m_version whenever the points change, the kd-trees are rebuilt only when it differs from m_kdtree_version.
+    int                              m_version = 0;
+    int                              m_kdtree_version = -1;
+    int                              m_published_version = -1; // m_version of last map delta publishing
+    pcl::KdTreeFLANN<PointType>::Ptr m_kdtree_corner;
+    pcl::KdTreeFLANN<PointType>::Ptr m_kdtree_surface;
+
+    // Lines fitted to corner points and planes fitted to surface points, in small voxels.
+    Voxel_primitive_map m_corner_primitives;
+    Voxel_primitive_map m_surface_primitives;
+
+    // Occupied voxels of the map resolution, there is at most one point in each voxel:
+    // the centroid of all the points inserted into it, like the output of pcl::VoxelGrid.
+    struct Voxel_occupancy
+    {
+        int m_pt_idx;   // index in m_corner_pts or m_surface_pts
+        int m_pt_count; // number of merged points
+    };
+    typedef std::unordered_map<Voxel_primitive_map::Voxel_key, Voxel_occupancy> Occupancy_map;
+    Occupancy_map m_corner_occupancy;
+    Occupancy_map m_surface_occupancy;
+
+    Points_cube() : m_corner_pts( new pcl::PointCloud<PointType>() ),
+                    m_surface_pts( new pcl::PointCloud<PointType>() ),
+                    m_kdtree_corner( new pcl::KdTreeFLANN<PointType>() ),
+                    m_kdtree_surface( new pcl::KdTreeFLANN<PointType>() ){};
+
+    void clear()
+    {
+        m_corner_pts->clear();
+        m_surface_pts->clear();
+        m_corner_primitives.clear();
+        m_surface_primitives.clear();
+        m_corner_occupancy.clear();
+        m_surface_occupancy.clear();
+        m_version++;
+    }
+
+    // Insert pt into the voxel of size resolution, merge it with the point already in the voxel if any.
+    // Return true if pt occupies a new voxel. pt_idx receives the index of the voxel's point,
+    // old_pt its value before the merge ( untouched for a new voxel ).
+    bool add_point( int if_corner, const PointType &pt, float resolution, int *pt_idx = nullptr, PointType *old_pt = nullptr )
+    {
+        pcl::PointCloud<PointType> &pts = if_corner ? *m_corner_pts : *m_surface_pts;
+        Occupancy_map &             occupancy = if_corner ? m_corner_occupancy : m_surface_occupancy;
+        int                         i, j, k;
+        Voxel_primitive_map::get_voxel_index( Eigen::Vector3d( pt.x, pt.y, pt.z ), resolution, i, j, k );
+        std::pair<Occupancy_map::iterator, bool> res = occupancy.insert( std::make_pair( Voxel_primitive_map::get_voxel_key( i, j, k ),
+                                                                                        Voxel_occupancy{ ( int ) pts.size(), 1 } ) );
+        m_version++;
+        if ( pt_idx != nullptr )
+        {
+            *pt_idx = res.first->second.m_pt_idx;
+        }
+        if ( res.second )
+        {
+            pts.push_back( pt );
+            return true;
+        }
+
+        // Running mean of all points of the voxel
+        Voxel_occupancy &voxel = res.first->second;
+        PointType &      centroid = pts.points[ voxel.m_pt_idx ];
+        if ( old_pt != nullptr )
+        {
+            *old_pt = centroid;
+        }
+        float            w = 1.0f / ( voxel.m_pt_count + 1 );
+        centroid.x += ( pt.x - centroid.x ) * w;
+        centroid.y += ( pt.y - centroid.y ) * w;
+        centroid.z += ( pt.z - centroid.z ) * w;
+        centroid.intensity += ( pt.intensity - centroid.intensity ) * w;
+        voxel.m_pt_count++;
+        return false;
+    }
+
+    void update_kdtree()
+    {
+        if ( m_kdtree_version == m_version )
+        {
+            return;
+        }
+        if ( m_corner_pts->size() )
+        {
+            m_kdtree_corner->setInputCloud( m_corner_pts );
+        }
+        if ( m_surface_pts->size() )
+        {
+            m_kdtree_surface->setInputCloud( m_surface_pts );
+        }
+        m_kdtree_version = m_version;
+    }
+};
+
+// Sparse cube grid of the map, addressed toroidally.
+// A cube id encodes the world cube coordinate, the grid coordinate (i, j, k) is the world
+// coordinate plus the center offset. Storage is keyed by the world coordinate modulo the
+// grid extent, so recentering the grid only moves the center offset; a slot that wrapped
+// around still holds the old cube until it is touched again, and is cleared at that time.
+class Points_cube_map
+{
+  public:
+    typedef int64_t                                  Cube_id;
+    typedef std::unordered_map<Cube_id, Points_cube> Cube_hash_map;
+
+    static const int     m_id_bits = 21;
+    static const Cube_id m_id_offset = ( ( Cube_id ) 1 ) << ( m_id_bits - 1 );
+    static const Cube_id m_id_mask = ( ( ( Cube_id ) 1 ) << m_id_bits ) - 1;
+
+    double m_cube_w = 50.0; // size of cube in meter
+    double m_cube_h = 50.0;
+    double m_cube_d = 50.0;
+
+    int m_center_width = 50; // grid coordinate of world origin
+    int m_center_height = 50;
+    int m_center_depth = 50;
+    int m_width = 101; // grid extent, in cubes
+    int m_height = 101;
+    int m_depth = 101;
+
+    double m_primitive_voxel_size = 1.0; // voxel size of Points_cube::m_corner_primitives and m_surface_primitives
+
+    Cube_hash_map m_cubes; // key is slot index
+
+    // Only set it if take_removed_cube_ids() is called regularly, e.g. for map delta publishing, the list grows until then.
+    bool                 m_if_track_removed_cubes = false;
+    std::vector<Cube_id> m_removed_cube_ids; // cubes cleared for reuse of their slot, since last take_removed_cube_ids()
+
+    // Scratch memory of nearest_search, use one per thread.
+    struct Search_buffer
+    {
+        std::vector<std::pair<float, Points_cube *>> m_search_cubes;
+        std::vector<std::pair<float, PointType>>     m_search_candidates;
+        std::vector<int>                             m_search_idx;
+        std::vector<float>                           m_search_sq_dis;
+    };
+
+    Points_cube_map(){};
+    ~Points_cube_map(){};
+
+    void init( double cube_w, double cube_h, double cube_d, int half_width, int half_height, int half_depth )
+    {
+        m_cube_w = cube_w;
+        m_cube_h = cube_h;
+        m_cube_d = cube_d;
+        m_center_width = half_width;
+        m_center_height = half_height;
+        m_center_depth = half_depth;
+        m_width = half_width * 2 + 1;
+        m_height = half_height * 2 + 1;
+        m_depth = half_depth * 2 + 1;
+        m_cubes.clear();
+    }
+
+    void get_cube_index( double x, double y, double z, int &i, int &j, int &k ) const
+    {
+        i = int( ( x + m_cube_w / 2 ) / m_cube_w ) + m_center_width;
+        j = int( ( y + m_cube_h / 2 ) / m_cube_h ) + m_center_height;
+        k = int( ( z + m_cube_d / 2 ) / m_cube_d ) + m_center_depth;
+
+        if ( x + m_cube_w / 2 < 0 )
+            i--;
+
+        if ( y + m_cube_h / 2 < 0 )
+            j--;
+
+        if ( z + m_cube_d / 2 < 0 )
+            k--;
+    }
+
+    bool is_in_grid( int i, int j, int k ) const
+    {
+        return ( i >= 0 && i < m_width &&
+                 j >= 0 && j < m_height &&
+                 k >= 0 && k < m_depth );
+    }
+
+    // False if the world cube is outside of the current grid, e.g. its slot has wrapped around.
+    bool is_cube_in_grid( const Cube_id &id ) const
+    {
+        int wi, wj, wk;
+        get_world_index( id, wi, wj, wk );
+        return is_in_grid( wi + m_center_width, wj + m_center_height, wk + m_center_depth );
+    }
+
+    // Id of the world cube at grid coordinate (i, j, k).
+    Cube_id get_cube_id( int i, int j, int k ) const
+    {
+        return ( ( ( Cube_id )( i - m_center_width ) + m_id_offset ) << ( 2 * m_id_bits ) ) |
+               ( ( ( Cube_id )( j - m_center_height ) + m_id_offset ) << m_id_bits ) |
+               ( ( Cube_id )( k - m_center_depth ) + m_id_offset );
+    }
+
+    void get_world_index( const Cube_id &id, int &wi, int &wj, int &wk ) const
+    {
+        wi = ( int ) ( ( ( id >> ( 2 * m_id_bits ) ) & m_id_mask ) - m_id_offset );
+        wj = ( int ) ( ( ( id >> m_id_bits ) & m_id_mask ) - m_id_offset );
+        wk = ( int ) ( ( id & m_id_mask ) - m_id_offset );
+    }
+
+    Cube_id get_slot_index( const Cube_id &id ) const
+    {
+        int wi, wj, wk;
+        get_world_index( id, wi, wj, wk );
+        wi = ( ( wi % m_width ) + m_width ) % m_width;
+        wj = ( ( wj % m_height ) + m_height ) % m_height;
+        wk = ( ( wk % m_depth ) + m_depth ) % m_depth;
+        return ( Cube_id ) wi + ( Cube_id ) m_width * wj + ( Cube_id ) m_width * m_height * wk;
+    }
+
+    // Region of the world cube in meter, as [box_min, box_max).
+    void get_cube_box( const Cube_id &id, float *box_min, float *box_max ) const
+    {
+        int wi, wj, wk;
+        get_world_index( id, wi, wj, wk );
+        box_min[ 0 ] = wi * m_cube_w - m_cube_w / 2;
+        box_min[ 1 ] = wj * m_cube_h - m_cube_h / 2;
+        box_min[ 2 ] = wk * m_cube_d - m_cube_d / 2;
+        box_max[ 0 ] = box_min[ 0 ] + m_cube_w;
+        box_max[ 1 ] = box_min[ 1 ] + m_cube_h;
+        box_max[ 2 ] = box_min[ 2 ] + m_cube_d;
+    }
+
+    // Return nullptr if no point has been put into this cube yet.
+    Points_cube *find_cube( const Cube_id &id )
+    {
+        Cube_hash_map::iterator it = m_cubes.find( get_slot_index( id ) );
+        if ( it == m_cubes.end() || it->second.m_id != id )
+        {
+            return nullptr;
+        }
+        return &it->second;
+    }
+
+    Points_cube *get_cube( const Cube_id &id )
+    {
+        Points_cube *cube = &m_cubes[ get_slot_index( id ) ];
+        if ( cube->m_id != id )
+        {
+            // Slot still holds a cube that has wrapped out of the grid.
+            if ( cube->m_id != -1 && m_if_track_removed_cubes )
+            {
+                m_removed_cube_ids.push_back( cube->m_id );
+            }
+            cube->clear();
+            cube->m_id = id;
+        }
+        return cube;
+    }
+
+    // Free the memory of the cube, e.g. after it is paged out to disk. Not reported by take_removed_cube_ids().
+    void erase_cube( const Cube_id &id )
+    {
+        Cube_hash_map::iterator it = m_cubes.find( get_slot_index( id ) );
+        if ( it != m_cubes.end() && it->second.m_id == id )
+        {
+            m_cubes.erase( it );
+        }
+    }
+
+    // Move the grid by (di, dj, dk) cubes, this only updates the center offset.
+    void shift_cubes( int di, int dj, int dk )
+    {
+        m_center_width += di;
+        m_center_height += dj;
+        m_center_depth += dk;
+    }
+
+    // Rebuild the kd-trees of the cubes which changed since last call.
+    void update_kdtrees( const Cube_id *ids, int id_num )
+    {
+        for ( int i = 0; i < id_num; i++ )
+        {
+            Points_cube *cube = find_cube( ids[ i ] );
+            if ( cube != nullptr )
+            {
+                cube->update_kdtree();
+            }
+        }
+    }
+
+    // k nearest search over the cached kd-trees of the given cubes, nearest cubes first.
+    // Cubes farther than the current k-th neighbour are skipped.
+    int nearest_search( const Cube_id *ids, int id_num, int if_corner, const PointType &pt, int k,
+                        std::vector<PointType> &nearest_pts, std::vector<float> &nearest_sq_dis, Search_buffer &buffer )
+    {
+        float box_min[ 3 ], box_max[ 3 ];
+        float pt_coord[ 3 ] = { pt.x, pt.y, pt.z };
+        buffer.m_search_cubes.clear();
+        for ( int i = 0; i < id_num; i++ )
+        {
+            Points_cube *cube = find_cube( ids[ i ] );
+            if ( cube == nullptr || ( if_corner ? cube->m_corner_pts : cube->m_surface_pts )->size() == 0 )
+            {
+                continue;
+            }
+            get_cube_box( ids[ i ], box_min, box_max );
+            float box_sq_dis = 0;
+            for ( int axis = 0; axis < 3; axis++ )
+            {
+                float d = std::max( std::max( box_min[ axis ] - pt_coord[ axis ], pt_coord[ axis ] - box_max[ axis ] ), 0.0f );
+                box_sq_dis += d * d;
+            }
+            buffer.m_search_cubes.push_back( std::make_pair( box_sq_dis, cube ) );
+        }
+        std::sort( buffer.m_search_cubes.begin(), buffer.m_search_cubes.end(),
+                   []( const std::pair<float, Points_cube *> &a, const std::pair<float, Points_cube *> &b ) { return a.first < b.first; } );
+
+        buffer.m_search_candidates.clear();
+        for ( size_t i = 0; i < buffer.m_search_cubes.size(); i++ )
+        {
+            if ( ( int ) buffer.m_search_candidates.size() >= k && buffer.m_search_cubes[ i ].first > buffer.m_search_candidates[ k - 1 ].first )
+            {
+                break;
+            }
+            Points_cube *                   cube = buffer.m_search_cubes[ i ].second;
+            pcl::PointCloud<PointType>::Ptr cube_pts = if_corner ? cube->m_corner_pts : cube->m_surface_pts;
+            int found_num = ( if_corner ? cube->m_kdtree_corner : cube->m_kdtree_surface )->nearestKSearch( pt, k, buffer.m_search_idx, buffer.m_search_sq_dis );
+            for ( int j = 0; j < found_num; j++ )
+            {
+                buffer.m_search_candidates.push_back( std::make_pair( buffer.m_search_sq_dis[ j ], cube_pts->points[ buffer.m_search_idx[ j ] ] ) );
+            }
+            int keep_num = std::min( k, ( int ) buffer.m_search_candidates.size() );
+            std::partial_sort( buffer.m_search_candidates.begin(), buffer.m_search_candidates.begin() + keep_num, buffer.m_search_candidates.end(),
+                               []( const std::pair<float, PointType> &a, const std::pair<float, PointType> &b ) { return a.first < b.first; } );
+            buffer.m_search_candidates.resize( keep_num );
+        }
+
+        nearest_pts.resize( buffer.m_search_candidates.size() );
+        nearest_sq_dis.resize( buffer.m_search_candidates.size() );
+        for ( size_t i = 0; i < buffer.m_search_candidates.size(); i++ )
+        {
+            nearest_sq_dis[ i ] = buffer.m_search_candidates[ i ].first;
+            nearest_pts[ i ] = buffer.m_search_candidates[ i ].second;
+        }
+        return buffer.m_search_candidates.size();
+    }
+
+    // Primitive of the voxel which pt falls in, nullptr if there is none.
+    const Voxel_primitive *find_primitive( int if_corner, const PointType &pt )
+    {
+        int i, j, k;
+        get_cube_index( pt.x, pt.y, pt.z, i, j, k );
+        if ( !is_in_grid( i, j, k ) )
+        {
+            return nullptr;
+        }
+        Points_cube *cube = find_cube( get_cube_id( i, j, k ) );
+        if ( cube == nullptr )
+        {
+            return nullptr;
+        }
+        return ( if_corner ? cube->m_corner_primitives : cube->m_surface_primitives ).find( Eigen::Vector3d( pt.x, pt.y, pt.z ), m_primitive_voxel_size );
+    }
+
+    // Visit every allocated cube in the grid, func( Points_cube & ). A cube which has wrapped out of the grid
+    // keeps its slot until the slot is reused, it is only visited if if_out_of_grid, e.g. to page it out.
+    template <typename T_func>
+    void for_each_cube( const T_func &func, bool if_out_of_grid = false )
+    {
+        for ( Cube_hash_map::iterator it = m_cubes.begin(); it != m_cubes.end(); it++ )
+        {
+            if ( it->second.m_id != -1 && ( if_out_of_grid || is_cube_in_grid( it->second.m_id ) ) )
+            {
+                func( it->second );
+            }
+        }
+    }
+
+    void take_removed_cube_ids( std::vector<Cube_id> &ids )
+    {
+        ids.swap( m_removed_cube_ids );
+        m_removed_cube_ids.clear();
+    }
+
+    size_t size() const
+    {
+        return m_cubes.size();
+    }
+};
+
+#endif
@@ -0,0 +1,127 @@
+// Author: Lin Jiarong          ziv.lin.ljr@gmail.com
+
+#ifndef __VOXEL_PRIMITIVE_HPP__
+#define __VOXEL_PRIMITIVE_HPP__
+
+#include <Eigen/Eigen>
+#include <math.h>
+#include <stdint.h>
+#include <unordered_map>
+
+// Line and plane fitted to the map points in one small voxel.
+// Points are only accumulated as first and second moments, so adding a point is O(1) and fit()
+// needs no neighbour search, it is called once for every voxel that changed in a frame.
+struct Voxel_primitive
+{
+    Eigen::Vector3d m_origin; // points are accumulated relative to it, to keep the moments small
+    int             m_point_num = 0;
+    Eigen::Vector3d m_sum = Eigen::Vector3d::Zero();
+    Eigen::Matrix3d m_sum_sq = Eigen::Matrix3d::Zero();
+    bool            m_if_dirty = false; // added points since last fit()
+
+    // Fitted primitive
+    Eigen::Vector3d m_center = Eigen::Vector3d::Zero();
+    Eigen::Vector3d m_line_direction = Eigen::Vector3d::UnitX(); // eigen vector of largest eigen value
+    Eigen::Vector3d m_plane_normal = Eigen::Vector3d::UnitZ();   // eigen vector of smallest eigen value
+    Eigen::Vector3d m_plane_axis_a = Eigen::Vector3d::UnitX();   // in plane, orthogonal to m_plane_axis_b
+    Eigen::Vector3d m_plane_axis_b = Eigen::Vector3d::UnitY();
+    float           m_line_quality = 0;  // 1 - lambda_mid / lambda_max
+    float           m_plane_quality = 0; // 1 - lambda_min / lambda_mid
+
+    void add_point( const Eigen::Vector3d &pt )
+    {
+        Eigen::Vector3d pt_local = pt - m_origin;
+        m_sum += pt_local;
+        m_sum_sq += pt_local * pt_local.transpose();
+        m_point_num++;
+        m_if_dirty = true;
+    }
+
+    void fit()
+    {
+        m_if_dirty = false;
+        if ( m_point_num < 2 )
+        {
+            m_line_quality = 0;
+            m_plane_quality = 0;
+            return;
+        }
+        Eigen::Vector3d mean = m_sum / m_point_num;
+        Eigen::Matrix3d cov = m_sum_sq / m_point_num - mean * mean.transpose();
+        m_center = m_origin + mean;
+
+        // Eigen library sort eigenvalues in increasing order
+        Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> saes( cov );
+        Eigen::Vector3d                                eigen_values = saes.eigenvalues().cwiseMax( 0.0 );
+        m_line_direction = saes.eigenvectors().col( 2 );
+        m_plane_normal = saes.eigenvectors().col( 0 );
+        m_plane_axis_a = saes.eigenvectors().col( 2 );
+        m_plane_axis_b = saes.eigenvectors().col( 1 );
+        m_line_quality = eigen_values( 2 ) > 0 ? 1.0 - eigen_values( 1 ) / eigen_values( 2 ) : 0;
+        m_plane_quality = eigen_values( 1 ) > 0 ? 1.0 - eigen_values( 0 ) / eigen_values( 1 ) : 0;
+    }
+};
+
+// Primitives of one cube of the map, keyed by the packed world voxel index.
+class Voxel_primitive_map
+{
+  public:
+    typedef int64_t                                      Voxel_key;
+    typedef std::unordered_map<Voxel_key, Voxel_primitive> Voxel_hash_map;
+
+    static const int       m_key_bits = 21;
+    static const Voxel_key m_key_offset = ( ( Voxel_key ) 1 ) << ( m_key_bits - 1 );
+    static const Voxel_key m_key_mask = ( ( ( Voxel_key ) 1 ) << m_key_bits ) - 1;
+
+    Voxel_hash_map m_voxels;
+
+    static void get_voxel_index( const Eigen::Vector3d &pt, double voxel_size, int &i, int &j, int &k )
+    {
+        i = ( int ) floor( pt( 0 ) / voxel_size );
+        j = ( int ) floor( pt( 1 ) / voxel_size );
+        k = ( int ) floor( pt( 2 ) / voxel_size );
+    }
+
+    static Voxel_key get_voxel_key( int i, int j, int k )
+    {
+        return ( ( ( ( Voxel_key ) i + m_key_offset ) & m_key_mask ) << ( 2 * m_key_bits ) ) |
+               ( ( ( ( Voxel_key ) j + m_key_offset ) & m_key_mask ) << m_key_bits ) |
+               ( ( ( Voxel_key ) k + m_key_offset ) & m_key_mask );
+    }
+
+    // Return the voxel if its state changed from clean to dirty, so that every changed voxel is reported once.
+    Voxel_primitive *add_point( const Eigen::Vector3d &pt, double voxel_size )
+    {
+        int i, j, k;
+        get_voxel_index( pt, voxel_size, i, j, k );
+        Voxel_hash_map::iterator it = m_voxels.find( get_voxel_key( i, j, k ) );
+        if ( it == m_voxels.end() )
+        {
+            it = m_voxels.insert( std::make_pair( get_voxel_key( i, j, k ), Voxel_primitive() ) ).first;
+            it->second.m_origin = Eigen::Vector3d( i + 0.5, j + 0.5, k + 0.5 ) * voxel_size;
+        }
+        bool if_dirty = it->second.m_if_dirty;
+        it->second.add_point( pt );
+        return if_dirty ? nullptr : &it->second;
+    }
+
+    const Voxel_primitive *find( const Eigen::Vector3d &pt, double voxel_size ) const
+    {
+        int i, j, k;
+        get_voxel_index( pt, voxel_size, i, j, k );
+        Voxel_hash_map::const_iterator it = m_voxels.find( get_voxel_key( i, j, k ) );
+        return it == m_voxels.end() ? nullptr : &it->second;
+    }
+
+    void clear()
+    {
+        m_voxels.clear();
+    }
+
+    size_t size() const
+    {
+        return m_voxels.size();
+    }
+};
+
+#endif
@@ -0,0 +1,111 @@
+// Author: Lin Jiarong          ziv.lin.ljr@gmail.com
+
+// Check the analytic point-to-line and point-to-plane cost functions against the autodiff ones:
+// residuals and jacobians at random poses, with and without motion blur, and with w < 0.
+#include <gtest/gtest.h>
+#include <memory>
+#include <random>
+
+#include "../src/ceres_icp.hpp"
+
+class Ceres_icp_test : public ::testing::Test
+{
+  protected:
+    std::mt19937                           m_rng{ 0 };
+    std::uniform_real_distribution<double> m_uniform{ -1.0, 1.0 };
+
+    Eigen::Matrix<double, 3, 1> random_vec( double scale )
+    {
+        return Eigen::Matrix<double, 3, 1>( m_uniform( m_rng ), m_uniform( m_rng ), m_uniform( m_rng ) ) * scale;
+    }
+
+    // As ( w, x, y, z ) for q_last, w with the sign of w_sign.
+    Eigen::Matrix<double, 4, 1> random_quaternion( double w_sign )
+    {
+        Eigen::Matrix<double, 4, 1> q;
+        do
+        {
+            q << m_uniform( m_rng ), m_uniform( m_rng ), m_uniform( m_rng ), m_uniform( m_rng );
+        } while ( q.norm() < 0.1 || fabs( q( 0 ) ) < 0.05 );
+        q.normalize();
+        if ( q( 0 ) * w_sign < 0 )
+        {
+            q = -q;
+        }
+        return q;
+    }
+
+    // Compare both cost functions at random increments, q_incre is stored as ( x, y, z, w ) like m_para_buffer_incremental.
+    void check( int if_plane, double motion_blur_s, double w_sign )
+    {
+        const double tolerance = 1e-8;
+        for ( int i = 0; i < 100; i++ )
+        {
+            Eigen::Matrix<double, 3, 1> current_pt = random_vec( 20.0 );
+            Eigen::Matrix<double, 3, 1> target_a = random_vec( 20.0 );
+            Eigen::Matrix<double, 3, 1> target_b = target_a + random_vec( 1.0 );
+            Eigen::Matrix<double, 3, 1> target_c = target_a + random_vec( 1.0 );
+            Eigen::Matrix<double, 4, 1> q_last = random_quaternion( 1.0 );
+            Eigen::Matrix<double, 3, 1> t_last = random_vec( 50.0 );
+
+            Eigen::Matrix<double, 4, 1> q_incre_wxyz = random_quaternion( w_sign );
+            double                      q_incre[ 4 ] = { q_incre_wxyz( 1 ), q_incre_wxyz( 2 ), q_incre_wxyz( 3 ), q_incre_wxyz( 0 ) };
+            Eigen::Matrix<double, 3, 1> t_incre_vec = random_vec( 2.0 );
+            double                      t_incre[ 3 ] = { t_incre_vec( 0 ), t_incre_vec( 1 ), t_incre_vec( 2 ) };
+
+            std::unique_ptr<ceres::CostFunction> cost_analytic, cost_autodiff;
+            if ( if_plane )
+            {
+                cost_analytic.reset( ceres_icp_point2plane_analytic::Create( current_pt, target_a, target_b, target_c, motion_blur_s, q_last, t_last ) );
+                cost_autodiff.reset( ceres_icp_point2plane<double>::Create( current_pt, target_a, target_b, target_c, motion_blur_s, q_last, t_last ) );
+            }
+            else
+            {
+                cost_analytic.reset( ceres_icp_point2line_analytic::Create( current_pt, target_a, target_b, motion_blur_s, q_last, t_last ) );
+                cost_autodiff.reset( ceres_icp_point2line<double>::Create( current_pt, target_a, target_b, motion_blur_s, q_last, t_last ) );
+            }
+            ASSERT_LT( ceres_icp_compare_cost_function( cost_analytic.get(), cost_autodiff.get(), q_incre, t_incre ), tolerance )
+                << "pose " << i << ", q_incre " << q_incre_wxyz.transpose() << ", s " << motion_blur_s;
+        }
+    }
+};
+
+TEST_F( Ceres_icp_test, point2line_without_blur )
+{
+    check( 0, 1.0, 1.0 );
+}
+
+TEST_F( Ceres_icp_test, point2line_with_blur )
+{
+    check( 0, 0.3, 1.0 );
+    check( 0, 0.8, 1.0 );
+}
+
+TEST_F( Ceres_icp_test, point2line_negative_w )
+{
+    check( 0, 1.0, -1.0 );
+    check( 0, 0.6, -1.0 );
+}
+
+TEST_F( Ceres_icp_test, point2plane_without_blur )
+{
+    check( 1, 1.0, 1.0 );
+}
+
+TEST_F( Ceres_icp_test, point2plane_with_blur )
+{
+    check( 1, 0.3, 1.0 );
+    check( 1, 0.8, 1.0 );
+}
+
+TEST_F( Ceres_icp_test, point2plane_negative_w )
+{
+    check( 1, 1.0, -1.0 );
+    check( 1, 0.6, -1.0 );
+}
+
+int main( int argc, char **argv )
+{
+    testing::InitGoogleTest( &argc, argv );
+    return RUN_ALL_TESTS();
+}
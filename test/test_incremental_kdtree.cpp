@@ -0,0 +1,125 @@
+// Author: Lin Jiarong          ziv.lin.ljr@gmail.com
+
+// Check that box deletion of Incremental_kdtree keeps every subtree balanced, also when the box
+// unbalances subtrees on both sides of a node, and that the search still matches brute force.
+#include <gtest/gtest.h>
+#include <random>
+#include <vector>
+
+#include "../src/incremental_kdtree.hpp"
+
+struct Test_point
+{
+    float x, y, z;
+};
+
+class Incremental_kdtree_test : public ::testing::Test
+{
+  protected:
+    Incremental_kdtree<Test_point> m_tree;
+    std::vector<Test_point>        m_pts; // not deleted ones
+
+    static bool is_in_box( const Test_point &pt, const float *box_min, const float *box_max )
+    {
+        return pt.x >= box_min[ 0 ] && pt.x < box_max[ 0 ] && pt.y >= box_min[ 1 ] && pt.y < box_max[ 1 ] && pt.z >= box_min[ 2 ] && pt.z < box_max[ 2 ];
+    }
+
+    void delete_box( const float *box_min, const float *box_max )
+    {
+        std::vector<Test_point> kept_pts;
+        for ( size_t i = 0; i < m_pts.size(); i++ )
+        {
+            if ( !is_in_box( m_pts[ i ], box_min, box_max ) )
+            {
+                kept_pts.push_back( m_pts[ i ] );
+            }
+        }
+        EXPECT_EQ( m_tree.delete_points_in_box( box_min, box_max ), ( int ) ( m_pts.size() - kept_pts.size() ) );
+        m_pts.swap( kept_pts );
+    }
+
+    void check_nearest( const Test_point &query )
+    {
+        std::vector<Test_point> nearest_pts;
+        std::vector<float>      nearest_sq_dis;
+        ASSERT_EQ( m_tree.nearest_search( query, 1, nearest_pts, nearest_sq_dis ), m_pts.empty() ? 0 : 1 );
+        float min_sq_dis = std::numeric_limits<float>::max();
+        for ( size_t i = 0; i < m_pts.size(); i++ )
+        {
+            float dx = m_pts[ i ].x - query.x, dy = m_pts[ i ].y - query.y, dz = m_pts[ i ].z - query.z;
+            min_sq_dis = std::min( min_sq_dis, dx * dx + dy * dy + dz * dz );
+        }
+        if ( !m_pts.empty() )
+        {
+            EXPECT_FLOAT_EQ( nearest_sq_dis[ 0 ], min_sq_dis );
+        }
+    }
+};
+
+// 64 x 16 points, x is unique so that the splits are known: the root splits at column 32, its children at
+// columns 16 and 48. The box of columns [ 16, 48 ) deletes the inner grandchild on both sides of the root,
+// while the root and its children keep at most half of their points deleted.
+TEST_F( Incremental_kdtree_test, delete_box_spanning_both_children )
+{
+    for ( int i = 0; i < 64; i++ )
+    {
+        for ( int j = 0; j < 16; j++ )
+        {
+            Test_point pt = { i + j * 0.01f, ( float ) j, 0 };
+            m_pts.push_back( pt );
+        }
+    }
+    m_tree.build( m_pts );
+    ASSERT_TRUE( m_tree.is_balanced() );
+    int rebuild_count = m_tree.get_rebuild_count();
+
+    float box_min[ 3 ] = { 16, -1, -1 };
+    float box_max[ 3 ] = { 48, 16, 1 };
+    delete_box( box_min, box_max );
+    EXPECT_EQ( m_tree.size(), 512 );
+    EXPECT_GE( m_tree.get_rebuild_count() - rebuild_count, 2 );
+    EXPECT_TRUE( m_tree.is_balanced() );
+
+    Test_point query = { 20, 5, 0 };
+    check_nearest( query );
+    query.x = 44;
+    check_nearest( query );
+}
+
+TEST_F( Incremental_kdtree_test, random_box_deletes )
+{
+    std::mt19937                          rng( 0 );
+    std::uniform_real_distribution<float> uniform( -50.0f, 50.0f );
+    for ( int i = 0; i < 4000; i++ )
+    {
+        Test_point pt = { uniform( rng ), uniform( rng ), uniform( rng ) * 0.2f };
+        m_pts.push_back( pt );
+    }
+    m_tree.build( std::vector<Test_point>( m_pts.begin(), m_pts.begin() + 2000 ) );
+    m_tree.add_points( std::vector<Test_point>( m_pts.begin() + 2000, m_pts.end() ) );
+    ASSERT_TRUE( m_tree.is_balanced() );
+
+    for ( int i = 0; i < 40; i++ )
+    {
+        float box_min[ 3 ], box_max[ 3 ];
+        for ( int axis = 0; axis < 3; axis++ )
+        {
+            float a = uniform( rng ), b = uniform( rng );
+            box_min[ axis ] = std::min( a, b );
+            box_max[ axis ] = std::max( a, b );
+        }
+        box_min[ 2 ] = -20;
+        box_max[ 2 ] = 20;
+        delete_box( box_min, box_max );
+        ASSERT_EQ( m_tree.size(), ( int ) m_pts.size() );
+        ASSERT_TRUE( m_tree.is_balanced() ) << "after box " << i;
+        Test_point query = { uniform( rng ), uniform( rng ), 0 };
+        check_nearest( query );
+    }
+}
+
+int main( int argc, char **argv )
+{
+    testing::InitGoogleTest( &argc, argv );
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,100 @@
+// Author: Lin Jiarong          ziv.lin.ljr@gmail.com
+
+// Check that the iteration of Points_cube_map skips the cubes whose slot has wrapped out of the grid.
+#include <gtest/gtest.h>
+#include <set>
+
+#include "../src/points_cube_map.hpp"
+
+class Points_cube_map_test : public ::testing::Test
+{
+  protected:
+    Points_cube_map m_cube_map;
+
+    void SetUp()
+    {
+        m_cube_map.init( 10.0, 10.0, 10.0, 2, 2, 1 ); // 5 x 5 x 3 cubes
+    }
+
+    // Put one point in the center of the world cube ( wi, wj, wk ).
+    void add_cube( int wi, int wj, int wk )
+    {
+        int i = wi + m_cube_map.m_center_width, j = wj + m_cube_map.m_center_height, k = wk + m_cube_map.m_center_depth;
+        ASSERT_TRUE( m_cube_map.is_in_grid( i, j, k ) );
+        PointType pt;
+        pt.x = wi * m_cube_map.m_cube_w;
+        pt.y = wj * m_cube_map.m_cube_h;
+        pt.z = wk * m_cube_map.m_cube_d;
+        pt.intensity = 0;
+        m_cube_map.get_cube( m_cube_map.get_cube_id( i, j, k ) )->add_point( 1, pt, 1.0 );
+    }
+
+    Points_cube_map::Cube_id get_world_cube_id( int wi, int wj, int wk )
+    {
+        return m_cube_map.get_cube_id( wi + m_cube_map.m_center_width, wj + m_cube_map.m_center_height, wk + m_cube_map.m_center_depth );
+    }
+
+    std::set<Points_cube_map::Cube_id> visit( bool if_out_of_grid = false )
+    {
+        std::set<Points_cube_map::Cube_id> ids;
+        m_cube_map.for_each_cube( [&]( Points_cube &cube ) { ids.insert( cube.m_id ); }, if_out_of_grid );
+        return ids;
+    }
+};
+
+TEST_F( Points_cube_map_test, visit_all_cubes_in_grid )
+{
+    add_cube( -2, 0, 0 );
+    add_cube( 2, 2, 1 );
+    std::set<Points_cube_map::Cube_id> ids = visit();
+    EXPECT_EQ( ids.size(), 2u );
+    EXPECT_EQ( ids.count( get_world_cube_id( -2, 0, 0 ) ), 1u );
+    EXPECT_EQ( ids.count( get_world_cube_id( 2, 2, 1 ) ), 1u );
+}
+
+TEST_F( Points_cube_map_test, skip_cubes_shifted_out_of_grid )
+{
+    add_cube( -2, 0, 0 );
+    add_cube( 0, 0, 0 );
+    Points_cube_map::Cube_id left_id = get_world_cube_id( -2, 0, 0 );
+    Points_cube_map::Cube_id center_id = get_world_cube_id( 0, 0, 0 );
+
+    // The grid moves by one cube to +x: world -2 wraps out, its slot is not reused yet.
+    m_cube_map.shift_cubes( -1, 0, 0 );
+    EXPECT_FALSE( m_cube_map.is_cube_in_grid( left_id ) );
+    EXPECT_TRUE( m_cube_map.is_cube_in_grid( center_id ) );
+    std::set<Points_cube_map::Cube_id> ids = visit();
+    EXPECT_EQ( ids.size(), 1u );
+    EXPECT_EQ( ids.count( center_id ), 1u );
+    EXPECT_EQ( visit( true ).size(), 2u ); // still held by the slot, e.g. for paging out
+
+    // Past the whole extent, nothing of the old grid is left.
+    m_cube_map.shift_cubes( -m_cube_map.m_width, 0, 0 );
+    EXPECT_TRUE( visit().empty() );
+    EXPECT_EQ( visit( true ).size(), 2u );
+
+    // World 5 is in the slot of world 0, reusing it replaces the old cube.
+    add_cube( 5, 0, 0 );
+    ids = visit();
+    EXPECT_EQ( ids.size(), 1u );
+    EXPECT_EQ( ids.count( get_world_cube_id( 5, 0, 0 ) ), 1u );
+    EXPECT_EQ( visit( true ).count( center_id ), 0u );
+}
+
+TEST_F( Points_cube_map_test, visit_cubes_shifted_back_into_grid )
+{
+    add_cube( 0, 0, 1 );
+    Points_cube_map::Cube_id id = get_world_cube_id( 0, 0, 1 );
+    m_cube_map.shift_cubes( 0, 0, 1 );
+    EXPECT_TRUE( visit().empty() );
+    m_cube_map.shift_cubes( 0, 0, -1 );
+    std::set<Points_cube_map::Cube_id> ids = visit();
+    EXPECT_EQ( ids.size(), 1u );
+    EXPECT_EQ( ids.count( id ), 1u );
+}
+
+int main( int argc, char **argv )
+{
+    testing::InitGoogleTest( &argc, argv );
+    return RUN_ALL_TESTS();
+}